@@ -43,6 +43,7 @@
 //Start ROM memory at different addresses.
 #define DEBUG_DIFF 0
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
@@ -88,6 +89,48 @@
 
 #define FBENCHMARK 0
 
+/* Resolve kernel symbols from the hot tier compiled into the kernel before
+ * reading the symbol table file. The kernel has to be linked with the
+ * table generated by mksymtab -H.
+ */
+#ifndef MINILINK_HOT_SYMBOLS
+#define MINILINK_HOT_SYMBOLS 0
+#endif
+
+/* Link programs which import kernel symbols by index. The kernel has to be
+ * linked with the export table generated by mksymtab -J.
+ */
+#ifndef MINILINK_ABI_TABLE
+#define MINILINK_ABI_TABLE 0
+#endif
+
+/* Flash area for programs. MSP430X parts may put it into flash above
+ * 64 KB, this needs MINILINK_ADDR20.
+ */
+#ifndef MINILINK_AREA_START
+#define MINILINK_AREA_START ((uintptr_t) __data_end_rom)
+#endif
+#ifndef MINILINK_AREA_END
+#define MINILINK_AREA_END ((uintptr_t) __vectors_start)
+#endif
+
+#if MINILINK_ADDR20
+#define ML_SYMFLAGS    MINILINK_SYMFLAG_ADDR20
+#define ML_SYMVAL_MASK 0xFFFFFUL
+/** Whether a plain word can hold the address */
+#define ML_WORD_REACH(addr) ((addr) <= 0xFFFF)
+#else
+#define ML_SYMFLAGS    0
+#define ML_SYMVAL_MASK 0xFFFF
+#define ML_WORD_REACH(addr) 1
+#endif
+
+/** Decode a zigzag coded addend */
+#define ML_ZIGZAG(val) ((int16_t) (((val) >> 1) ^ -((val) & 1)))
+
+/** Only check whether the program could be loaded */
+#define ML_LOAD_CHECK 0x80
+
 #define DEBUG 1
 #if DEBUG
 #define DPRINTF(...) printf(__VA_ARGS__)
@@ -131,11 +174,28 @@ struct crcgeninfo_st {
 	uint16_t magic; /**< Magic to identify the file type */
 };
 
+#define LZ_INBUF_SIZE 16
+
+/** State of the decompressor for LZ compressed section data */
+struct lz_st {
+	cfs_offset_t start; /**< File offset of the compressed data */
+	cfs_offset_t out; /**< Number of bytes decompressed so far */
+	uint8_t in[LZ_INBUF_SIZE]; /**< Compressed data read from the file */
+	uint8_t inpos;
+	uint8_t infill;
+	uint8_t window[MINILINK_LZ_WINDOW]; /**< Most recent output */
+	uint8_t wpos; /**< Next position to write in the window */
+	uint8_t dist; /**< Distance of the match being copied, minus one */
+	uint16_t len; /**< Bytes of the match left to copy */
+	uint16_t flags; /**< Flags of the current group, above a stop bit */
+};
+
 struct io_buf_st {
 	uint8_t data[LOADBUF_MIN_SIZE];
 	uint16_t pos;
 	uint16_t filled;
 	int fd;
+	struct lz_st *lz; /**< Decompressor, NULL if the file is read as is */
 };
 
 #if 0
@@ -151,6 +211,24 @@ struct iobuf_st {
 };
 #endif
 
+/** Everything needed to resolve the relocations of a program */
+struct reloc_info_st {
+	minilink_addr_t *table; /**< Target table: Entries followed by the symbol values */
+	size_t tablesize; /**< Number of values in target table */
+	minilink_addr_t *symvaltab; /**< Table of symbol values */
+	size_t symcount; /**< Number of symbols in table */
+	Minilink_ProgramInfoHeader *pihdr; /**< Section addresses and sizes */
+	uint8_t esc; /**< Escape byte of the section streams */
+	uint8_t delta; /**< Sections stored in base-delta form */
+};
+
+/** Imports of a program resolved before it is loaded, see minilink_load_many() */
+struct resolved_st {
+	minilink_addr_t *symvals;   /**< Room for the target table, followed by the symbol values */
+	cfs_offset_t listend;       /**< Offset of the end of the symbol list in the file */
+	struct export_use_st *uses; /**< Programs imported from */
+};
+
 /*---------------------------------------------------------------------------*/
 typedef size_t (*MemWriteFunc)(void * dest, void * src, size_t len);
 /*---------------------------------------------------------------------------*/
@@ -163,6 +241,61 @@ static const struct crcgeninfo_st crcgeninfo_sym = { sizeof(Minilink_SymbolHeade
 static char *freerom_start;
 /** Location where intallable area ends */
 static char *freerom_end;
+/** Set when the text of a program did not fit into flash */
+static uint8_t freerom_short;
+/** First byte of the flash area reserved for programs */
+static char *mlarea_start;
+/** End of the flash area reserved for programs (start of metadata block) */
+static char *mlarea_end;
+/** Location of the first installed program. Moves on every cleanup. */
+static char *instprog_first;
+
+/** Program loaded to RAM. The text follows the header. */
+struct ramprog_st {
+	struct ramprog_st *next;
+	Minilink_ProgramInfoHeader hdr;
+};
+/** Programs loaded to RAM, newest first */
+static struct ramprog_st *ramprog_list;
+
+/** Symbols exported by a loaded program. The entries follow the
+ * structure: the value as minilink_addr_t, then the name with its NUL.
+ */
+struct export_st {
+	struct export_st *next;
+	Minilink_ProgramInfoHeader *pih; /**< Program exporting the symbols */
+	uint16_t users; /**< Number of loaded programs importing from it */
+	uint16_t count; /**< Number of entries */
+};
+/** A loaded program importing symbols from another one */
+struct export_use_st {
+	struct export_use_st *next;
+	Minilink_ProgramInfoHeader *user; /**< Importing program */
+	struct export_st *lib;            /**< Symbols imported */
+};
+/** Export tables of the loaded programs, newest first */
+static struct export_st *export_list;
+/** Imports from the export tables */
+static struct export_use_st *export_uses;
+/** The imports of the programs in flash were noted again since boot */
+static uint8_t export_restored;
+
+/** Segment containing the first program. Programs wrapping around to the
+ * start of the area must end in front of it. */
+#define INSTPROG_FIRST_SEG ((char*) ALIGN_ROM_PREV((uintptr_t) instprog_first))
+#define INSTPROG_IN_FLASH(pih) ((char*) (pih) >= mlarea_start && (char*) (pih) < mlarea_end)
+#define INSTPROG_LIVE(pih) ((pih)->magic == MINILINK_INST_MAGIC || (pih)->magic == MINILINK_USED_MAGIC)
+
+#define RAMPROG_OF(pih) ((struct ramprog_st *) ((char *) (pih) - offsetof(struct ramprog_st, hdr)))
+
+/** Program in flash whose RAM was set up since boot */
+struct overlay_st {
+	struct overlay_st *next;
+	Minilink_ProgramInfoHeader *pih;
+	uint8_t ownram; /**< RAM sections were allocated since boot */
+};
+/** Programs in flash set up since boot, newest first */
+static struct overlay_st *overlay_list;
 
 /*---------------------------------------------------------------------------*/
 
@@ -214,20 +347,74 @@ static size_t memwrite_flash(void *dest, void *src, size_t len) {
 	return written;
 }
 
-static void erasearea_flash(void *start, size_t size) {
+static void erasesegment_flash(void *start) {
 #if USE_BLOCKWRITING
-	rom_erase(size, (off_t)(uintptr_t)start);
+	rom_erase(ROM_ERASE_UNIT_SIZE, (off_t)(uintptr_t)start);
+	return;
 #endif
 	flash_setup();
-	while (size > ROM_ERASE_UNIT_SIZE) {
-		flash_clear(start);
-		size -= ROM_ERASE_UNIT_SIZE;
-		start = (char*) start + ROM_ERASE_UNIT_SIZE;
-	}
+	flash_clear(start);
 	flash_done();
 }
 
 /*---------------------------------------------------------------------------*/
+/** Get the next byte of compressed data.
+ * \return The byte, -1 at the end of the file
+ */
+static int lz_getc(struct lz_st *lz, int fd) {
+	int status;
+
+	if (lz->inpos == lz->infill) {
+		status = cfs_read(fd, lz->in, LZ_INBUF_SIZE);
+		if (status <= 0) return -1;
+		lz->infill = status;
+		lz->inpos = 0;
+	}
+	return lz->in[lz->inpos++];
+}
+
+/** Decompress data into the given memory.
+ * The data is a sequence of groups of eight items. Each group starts with
+ * a byte holding a bit for each item, lowest bit first. A cleared bit
+ * stands for a literal byte. A set bit stands for a match of two bytes:
+ * the distance minus one and the length minus MINILINK_LZ_MINMATCH.
+ * \param b    Buffer to decompress for
+ * \param dest Output
+ * \param len  Maximum number of bytes to decompress
+ * \return Number of bytes decompressed, less than len at the end of file
+ */
+static int lz_read(struct io_buf_st *b, uint8_t *dest, int len) {
+	struct lz_st *lz = b->lz;
+	int done = 0, c;
+
+	while (done < len) {
+		if (lz->len == 0) {
+			if (lz->flags == 1) {
+				if ((c = lz_getc(lz, b->fd)) < 0) break;
+				lz->flags = 0x100 | c;
+			}
+			if ((c = lz_getc(lz, b->fd)) < 0) break;
+			if (lz->flags & 1) {
+				lz->dist = c;
+				if ((c = lz_getc(lz, b->fd)) < 0) break;
+				lz->len = c + MINILINK_LZ_MINMATCH;
+			} else {
+				lz->window[lz->wpos++] = c;
+				dest[done++] = c;
+			}
+			lz->flags >>= 1;
+			continue;
+		}
+		//The window is addressed modulo its size of 256 bytes
+		c = lz->window[(uint8_t) (lz->wpos - lz->dist - 1)];
+		lz->window[lz->wpos++] = c;
+		dest[done++] = c;
+		lz->len--;
+	}
+	lz->out += done;
+	return done;
+}
+
 /** Remove consumed bytes from the given I/O buffer.
  *
  * \param b Buffer to operate on.
@@ -245,7 +432,11 @@ static void shift_iobuf(struct io_buf_st *b) {
 	b->filled -= b->pos;
 	b->pos = 0;
 
-	status = cfs_read(b->fd, b->data + b->filled, LOADBUF_MIN_SIZE - b->filled);
+	if (b->lz != NULL) {
+		status = lz_read(b, b->data + b->filled, LOADBUF_MIN_SIZE - b->filled);
+	} else {
+		status = cfs_read(b->fd, b->data + b->filled, LOADBUF_MIN_SIZE - b->filled);
+	}
 
 	b->filled += status;
 #if DEBUG
@@ -256,6 +447,39 @@ static void shift_iobuf(struct io_buf_st *b) {
 	watchdog_periodic();
 }
 
+/** Get the file offset of the next unconsumed byte of the buffer.
+ * For compressed data this is the offset within the decompressed data.
+ */
+static cfs_offset_t tell_iobuf(struct io_buf_st *b) {
+	if (b->lz != NULL) return b->lz->out - (b->filled - b->pos);
+	return cfs_seek(b->fd, 0, CFS_SEEK_CUR) - (b->filled - b->pos);
+}
+
+/** Drop the buffer contents and refill it starting at the given offset. */
+static void seek_iobuf(struct io_buf_st *b, cfs_offset_t offset) {
+	int status;
+
+	b->pos = 0;
+	b->filled = 0;
+	if (b->lz != NULL) {
+		//Decompress again from the start, up to the offset
+		cfs_seek(b->fd, b->lz->start, CFS_SEEK_SET);
+		b->lz->out = 0;
+		b->lz->inpos = b->lz->infill = 0;
+		b->lz->wpos = 0;
+		b->lz->len = 0;
+		b->lz->flags = 1;
+		while (offset > 0) {
+			status = lz_read(b, b->data, Min(offset, LOADBUF_MIN_SIZE));
+			if (status <= 0) break;
+			offset -= status;
+		}
+	} else {
+		cfs_seek(b->fd, offset, CFS_SEEK_SET);
+	}
+	shift_iobuf(b);
+}
+
 static void * ml_alloc_text(size_t size) {
 
 	if (!freerom_start) {
@@ -269,6 +493,15 @@ static void * ml_alloc_text(size_t size) {
 		freerom_start += size;
 		return freerom_start - size;
 	}
+
+	//Does not fit at the end of the area - wrap around to the beginning
+	if (freerom_end == mlarea_end && INSTPROG_FIRST_SEG > mlarea_start + size) {
+		DPUTS("Wrapping module area.");
+		freerom_start = mlarea_start + size;
+		freerom_end = INSTPROG_FIRST_SEG;
+		return mlarea_start;
+	}
+	freerom_short = 1;
 	return NULL;
 }
 
@@ -280,6 +513,19 @@ static void * ml_alloc_mem(size_t size) {
 	return malloc(size);
 }
 
+/** Read the rest of the file through the decompressor.
+ * \return 0 on success, 1 if there is not enough memory
+ */
+static uint_fast8_t lz_start_iobuf(struct io_buf_st *b) {
+	cfs_offset_t start = tell_iobuf(b);
+
+	b->lz = ml_alloc_mem(sizeof(*b->lz));
+	if (b->lz == NULL) return 1;
+	b->lz->start = start;
+	seek_iobuf(b, 0);
+	return 0;
+}
+
 /*---------------------------------------------------------------------------*/
 
 /** Check program file for consistency.
@@ -360,29 +606,368 @@ static int ml_file_check(int myfd, uint16_t magic) {
 }
 
 /*---------------------------------------------------------------------------*/
+/** Read a variable length number: 7 bits per byte, least significant first,
+ * the top bit is set if another byte follows.
+ */
+static minilink_addr_t ml_varint(struct io_buf_st *iob) {
+	minilink_addr_t val = 0;
+	uint8_t shift = 0, b;
+
+	do {
+		b = iob->data[iob->pos++];
+		val |= (minilink_addr_t) (b & 0x7F) << shift;
+		shift += 7;
+	} while ((b & 0x80) && shift < 21);
+	return val;
+}
+
+/** Decode the target address of a relocation.
+ *
+ * \param iob  I/O buffer positioned behind the tag
+ * \param tag  Tag following the escape byte
+ * \param ri   Symbol values and section layout
+ * \param addr Output for the target address
+ * \return 0 on success, 1 if the relocation is invalid
+ */
+static uint_fast8_t ml_target(struct io_buf_st *iob, uint8_t tag, const struct reloc_info_st *ri, minilink_addr_t *addr) {
+	uint16_t val, addend;
+
+	if (tag >= MINILINK_TAG_SECT) { //An address within one of our sections
+		uint8_t sec = (tag >> 3) & 0x07;
+
+		val = (tag & 0x07) | (ml_varint(iob) << 3);
+		if (sec >= MINILINK_SEC || val > ri->pihdr->mem[sec].size) {
+			DPRINTF("Bad section reference %x:%x\n", sec, val);
+			return 1;
+		}
+		*addr = (uintptr_t)(ri->pihdr->mem[sec].ptr) + val;
+		return 0;
+	}
+
+	if (tag == MINILINK_TAG_SYMADD) { //A symbol with offset
+		val = ml_varint(iob);
+		addend = ml_varint(iob);
+		if (val >= ri->symcount) {
+			DPRINTF("Bad symbol %x\n", val);
+			return 1;
+		}
+		*addr = ri->symvaltab[val] + ML_ZIGZAG(addend);
+		return 0;
+	}
+
+	//An entry of the target table
+	val = (tag == MINILINK_TAG_TABLE) ? ml_varint(iob) : tag - 1;
+	if (tag > MINILINK_TAG_TABLE || val >= ri->tablesize) {
+		DPRINTF("Bad relocation %x:%x\n", tag, val);
+		return 1;
+	}
+	*addr = ri->table[val];
+	return 0;
+}
+
+/** Read the target table entries stored in the program file.
+ *
+ * \param iob   I/O buffer positioned behind the symbol list
+ * \param count Number of entries
+ * \param ri    Symbol values and section layout. The table is filled in.
+ * \return 0 on success, 1 if unexpected EOF or invalid entry.
+ */
+static uint_fast8_t ml_load_targets(struct io_buf_st *iob, uint16_t count, const struct reloc_info_st *ri) {
+	uint16_t ctr;
+	uint8_t tag;
+
+	for (ctr = 0; ctr < count; ctr++) {
+		if (iob->pos + 8 >= iob->filled) shift_iobuf(iob);
+		if (iob->pos >= iob->filled) return 1;
+
+		//Entries must not refer to the table
+		tag = iob->data[iob->pos++];
+		if (tag < MINILINK_TAG_SYMADD || ml_target(iob, tag, ri, &ri->table[ctr]) != 0) return 1;
+		if (iob->pos > iob->filled) return 1;
+	}
+	return 0;
+}
+
+/** Make sure the kernel contains the code and constants the program was
+ * built to use from there.
+ *
+ * \param iob   I/O buffer positioned behind the symbol list
+ * \param count Number of kernel ranges
+ * \param ri    Symbol values
+ * \return 0 if the kernel matches, 1 if unexpected EOF or invalid entry,
+ *         3 if the kernel differs
+ */
+static uint_fast8_t ml_check_kernel(struct io_buf_st *iob, uint16_t count, const struct reloc_info_st *ri) {
+	uint32_t crc, crc_file;
+	uint16_t ctr, id, addend, len;
+
+	if (count == 0) return 0;
+	crc32k_init(&crc);
+	for (ctr = 0; ctr < count; ctr++) {
+		if (iob->pos + 9 >= iob->filled) shift_iobuf(iob);
+		if (iob->pos >= iob->filled) return 1;
+
+		id = ml_varint(iob);
+		addend = ml_varint(iob);
+		len = ml_varint(iob);
+		if (id >= ri->symcount || iob->pos > iob->filled) return 1;
+		crc32k_add((uint8_t *) (uintptr_t) (minilink_addr_t) (ri->symvaltab[id] + ML_ZIGZAG(addend)),
+				len, &crc);
+	}
+
+	if (iob->pos + sizeof(crc_file) > iob->filled) shift_iobuf(iob);
+	if (iob->pos + sizeof(crc_file) > iob->filled) return 1;
+	memcpy(&crc_file, iob->data + iob->pos, sizeof(crc_file));
+	iob->pos += sizeof(crc_file);
+	if (crc != crc_file) {
+		DPRINTF("Kernel CRC is %08lx should be %08lx\n", crc, crc_file);
+		return 3;
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** Look a symbol up in the export tables of the loaded programs. The
+ * program exporting it is noted as used by the program being loaded.
+ * \param name Name of the symbol
+ * \param addr Output for the value of the symbol
+ * \param uses Programs the program being loaded imports from
+ * \return 0 if found, 1 if not, 2 if there is not enough memory to note
+ *         the use
+ */
+static uint_fast8_t ml_export_lookup(const char *name, minilink_addr_t *addr, struct export_use_st **uses) {
+	struct export_st *lib;
+	struct export_use_st *use;
+	uint8_t *entry;
+	uint16_t ctr;
+
+	for (lib = export_list; lib != NULL; lib = lib->next) {
+		entry = (uint8_t *) (lib + 1);
+		for (ctr = 0; ctr < lib->count; ctr++) {
+			if (!strcmp(name, (char *) entry + sizeof(*addr))) break;
+			entry += sizeof(*addr) + strlen((char *) entry + sizeof(*addr)) + 1;
+		}
+		if (ctr < lib->count) break;
+	}
+	if (lib == NULL) return 1;
+	memcpy(addr, entry, sizeof(*addr));
+
+	for (use = *uses; use != NULL; use = use->next) {
+		if (use->lib == lib) return 0;
+	}
+	use = ml_alloc_mem(sizeof(*use));
+	if (use == NULL) return 2;
+	use->user = NULL;
+	use->lib = lib;
+	use->next = *uses;
+	*uses = use;
+	return 0;
+}
+
+/** Assign the uses noted while loading a program to it, or drop them if
+ * loading failed.
+ * \param uses Uses noted by ml_export_lookup(), emptied
+ * \param user Program that was loaded, NULL to drop the uses
+ */
+static void ml_export_commit(struct export_use_st **uses, Minilink_ProgramInfoHeader *user) {
+	struct export_use_st *use, *old;
+
+	while ((use = *uses) != NULL) {
+		*uses = use->next;
+		//The program may have been set up before
+		for (old = export_uses; old != NULL; old = old->next) {
+			if (old->user == user && old->lib == use->lib) break;
+		}
+		if (user == NULL || old != NULL) {
+			ml_free_mem(use);
+			continue;
+		}
+		use->user = user;
+		use->lib->users++;
+		use->next = export_uses;
+		export_uses = use;
+		//The use has to survive a reset, the addresses are in flash now
+		if (INSTPROG_IN_FLASH(user) && INSTPROG_IN_FLASH(use->lib->pih)
+				&& use->lib->pih->magic == MINILINK_INST_MAGIC) {
+			uint16_t word = MINILINK_USED_MAGIC;
+			memwrite_flash(&use->lib->pih->magic, &word, sizeof(word));
+		}
+	}
+}
+
+/** Check whether a program in flash may import the symbols noted.
+ * \param uses Uses noted by ml_export_lookup()
+ * \return 0 if so, 3 if one of the programs is in RAM. Its addresses
+ *         would be gone after a reset.
+ */
+static uint_fast8_t ml_export_check_flash(struct export_use_st *uses) {
+	for (; uses != NULL; uses = uses->next) {
+		if (!INSTPROG_IN_FLASH(uses->lib->pih)) {
+			DPRINTF("Can't import from %s in RAM\n", uses->lib->pih->sourcefile);
+			return 3;
+		}
+	}
+	return 0;
+}
+
+/** Find the export table of a loaded program.
+ * \return Pointer to the table or NULL if the program exports nothing.
+ */
+static struct export_st *ml_export_of(Minilink_ProgramInfoHeader *pih) {
+	struct export_st *lib;
+
+	for (lib = export_list; lib != NULL; lib = lib->next) {
+		if (lib->pih == pih) break;
+	}
+	return lib;
+}
+
+/** Get the number of loaded programs importing symbols from a program.
+ * Until ml_export_restore() has found the importers, programs in flash
+ * other programs in flash imported from before a reset count as used once
+ * at least.
+ */
+static uint16_t ml_export_users(Minilink_ProgramInfoHeader *pih) {
+	struct export_st *lib = ml_export_of(pih);
+	uint16_t users = (lib != NULL) ? lib->users : 0;
+
+	if (users == 0 && pih->magic == MINILINK_USED_MAGIC && !export_restored) users = 1;
+	return users;
+}
+
+/** Check whether a program imports from a program in flash, directly or
+ * through programs in RAM.
+ */
+static uint_fast8_t ml_export_needs_flash(Minilink_ProgramInfoHeader *pih) {
+	struct export_use_st *use;
+
+	for (use = export_uses; use != NULL; use = use->next) {
+		if (use->user == pih && (INSTPROG_IN_FLASH(use->lib->pih) || ml_export_needs_flash(use->lib->pih))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Forget the imports and exports of a program which is removed.
+ * Imports from it are forgotten as well, so it should have no users left.
+ */
+static void ml_export_release(Minilink_ProgramInfoHeader *pih) {
+	struct export_use_st **prevuse, *use;
+	struct export_st *lib = ml_export_of(pih), **prev;
+
+	for (prevuse = &export_uses; (use = *prevuse) != NULL;) {
+		if (use->user == pih || use->lib == lib) {
+			use->lib->users--;
+			*prevuse = use->next;
+			ml_free_mem(use);
+		} else {
+			prevuse = &use->next;
+		}
+	}
+	if (lib == NULL) return;
+	for (prev = &export_list; *prev != lib; prev = &(*prev)->next);
+	*prev = lib->next;
+	ml_free_mem(lib);
+}
+
+/** Read the export table of a program.
+ * \param iob  I/O buffer positioned at the export table
+ * \param size Size of the export table in the file
+ * \param ri   Section layout of the program
+ * \param out  Output for the table, to be added to export_list once the
+ *             program is loaded
+ * \return 0 on success, 1 if unexpected EOF or invalid entry, 2 if not
+ *         enough memory
+ */
+static uint_fast8_t ml_load_exports(struct io_buf_st *iob, uint16_t size, const struct reloc_info_st *ri,
+		struct export_st **out) {
+	struct export_st *lib;
+	uint8_t *entry, *name, sec;
+	uint16_t ctr, len;
+	minilink_addr_t val;
+
+	//An entry takes as many bytes as it does in the file at most, a value two bytes more
+	lib = ml_alloc_mem(sizeof(*lib) + size + size / 4 * (sizeof(val) - 2));
+	if (lib == NULL) return 2;
+	*out = lib;
+	lib->users = 0;
+	lib->pih = NULL;
+
+	shift_iobuf(iob);
+	lib->count = ml_varint(iob);
+	entry = (uint8_t *) (lib + 1);
+	for (ctr = 0; ctr < lib->count; ctr++) {
+		shift_iobuf(iob);
+		name = iob->data + iob->pos;
+		for (len = 0; len < MINILINK_MAX_SYMLEN && iob->pos + len < iob->filled && name[len] != '\0'; len++);
+		if (len == MINILINK_MAX_SYMLEN || iob->pos + len + 2 >= iob->filled
+				|| entry + sizeof(val) + len + 1 > (uint8_t *) (lib + 1) + size + size / 4 * (sizeof(val) - 2)) {
+			DPUTS("Bad export table");
+			return 1;
+		}
+		memcpy(entry + sizeof(val), name, len + 1);
+		sec = name[len + 1];
+		iob->pos += len + 2;
+		val = ml_varint(iob);
+		if (sec >= MINILINK_SEC || val > ri->pihdr->mem[sec].size) {
+			DPRINTF("Bad export %s\n", entry + sizeof(val));
+			return 1;
+		}
+		val += (uintptr_t) ri->pihdr->mem[sec].ptr;
+		memcpy(entry, &val, sizeof(val));
+		entry += sizeof(val) + len + 1;
+	}
+	return 0;
+}
+
+/** Check the form byte of a wide relocation.
+ * \param form Form following MINILINK_TAG_WIDE
+ * \return Bytes the relocation takes from its offset on, 0 if the form is
+ *         invalid
+ */
+static uint8_t ml_wide_len(uint8_t form) {
+	if (form == MINILINK_WIDE_LONG) return 4;
+	if (MINILINK_WIDE_BACK(form) == 0 || MINILINK_WIDE_BACK(form) > MINILINK_WIDE_MAXBACK
+			|| MINILINK_WIDE_SHIFT(form) > 12) return 0;
+	return 2;
+}
+
+/** Put bits 16 - 19 of the target of a wide relocation into the word in
+ * front keeping them.
+ * \param word Word MINILINK_WIDE_BACK(form) bytes in front of the relocation
+ * \param form Form of the relocation, not MINILINK_WIDE_LONG
+ * \param val  Target
+ * \return The word changed
+ */
+static uint16_t ml_wide_high(uint16_t word, uint8_t form, minilink_addr_t val) {
+	uint8_t shift = MINILINK_WIDE_SHIFT(form);
+
+	return (word & ~(0x0Fu << shift)) | (uint16_t) (((uint32_t) val >> 16) & 0x0F) << shift;
+}
+
 /** Read from buffer and perform relocations.
  *
  * \param iob        I/O buffer to read data from
  * \param size       Number of bytes to relocate (destination size!)
  * \param start      Pointer to first output byte, to be passed to mwrite
+ * \param ri         Symbol values and section layout
  * \param mwrite     Memory writing function to use for output
- * \param symvaltab  Table of symbol values
- * \param symcount   Number of symbols in table
  * \return 0 on success, 1 if unexpected EOF or invalid relocation.
  */
 static uint_fast8_t ml_relocate(struct io_buf_st *iob, size_t size, uint8_t *start,
-		uint16_t *symvaltab, size_t symcount, Minilink_ProgramInfoHeader * pihdr,
-		MemWriteFunc mwrite) {
+		const struct reloc_info_st *ri, MemWriteFunc mwrite) {
 
-#define OUTBUF_SIZE 16
+#define OUTBUF_SIZE 24
 	uint8_t outbuf[OUTBUF_SIZE];
 	size_t outbuf_fill = 0;
-	uint16_t escape = 0;
-	uint16_t writeaddr = 0;
-
-	//Nothing in the input buffer -> return
-	if (iob->filled == 0)
-		return 1;
+	const size_t sectsize = size;
+	uint8_t tag, form, len;
+	uint8_t *dest;
+	minilink_addr_t writeaddr = 0;
+	uint16_t run = 0; //Relocations left in the current run
+	uint16_t word;
+	uint8_t pcrel;
 
 	//Loop through the loaded buffer
 	while (size) {
@@ -400,12 +985,13 @@ static uint_fast8_t ml_relocate(struct io_buf_st *iob, size_t size, uint8_t *sta
 			}
 		}
 
-		//Make sure we have enough buffer
-		if (outbuf_fill >= OUTBUF_SIZE - 3) {
+		/* Make sure we have enough buffer. The last bytes are kept, wide
+		 * relocations may change them. */
+		if (outbuf_fill > OUTBUF_SIZE - 4) {
 			size_t written;
 
 			//DPRINTF("W:%x\n", (uint16_t)mwrite);
-			written = mwrite(start, outbuf, outbuf_fill);
+			written = mwrite(start, outbuf, outbuf_fill - MINILINK_WIDE_MAXBACK);
 			if (outbuf_fill - written) {
 				memmove(outbuf, outbuf + written, outbuf_fill - written);
 			}
@@ -417,99 +1003,110 @@ static uint_fast8_t ml_relocate(struct io_buf_st *iob, size_t size, uint8_t *sta
 
 		DPRINTF("Offset: %x Char: %x\n", (uint16_t )start + outbuf_fill, iob->data[iob->pos]);
 
-		//Is the current char an escaped char?
-		if (iob->data[iob->pos] != MINILINK_RELOC_ESC) {
-			//If not write to memory
+		//Within a run every word is a relocation, there is no escape byte
+		if (run == 0) {
+			//Is the current char an escaped char?
+			if (iob->data[iob->pos] != ri->esc) {
+				//If not write to memory
 
-			if (mwrite == NULL) {
-				*(start++) = iob->data[iob->pos];
-			} else {
-				outbuf[outbuf_fill++] = iob->data[iob->pos];
+				if (mwrite == NULL) {
+					*(start++) = iob->data[iob->pos];
+				} else {
+					outbuf[outbuf_fill++] = iob->data[iob->pos];
 
+				}
+				iob->pos++;
+				size--;
+				continue; // Get next char
 			}
-			iob->pos++;
-			size--;
-			continue; // Get next char
-		}
-
-		//It's an escape - continue
-		iob->pos++;
 
-		/* Looks like less then three chars were loaded */
-		if (iob->pos >= iob->filled - 3) {
-			DPRINTF("Not enaugh Data to handle escape");
+			//It's an escape - continue
+			iob->pos++;
 		}
+		tag = iob->data[iob->pos++];
 
-		CPY16(escape, iob->data[iob->pos]);
-		iob->pos += 2;
-
-		DPRINTF("Escape: %x\n", escape);
+		DPRINTF("Escape: %x\n", tag);
 
-		//This should really be the char.
-		if (escape == 0) {
+		pcrel = 0;
+		form = 0;
+		len = 2;
+		if (run) {
+			run--;
+		} else if (tag == MINILINK_TAG_LITERAL) {
+			//This should really be the char.
 			if (mwrite == NULL) {
-				*(start++) = MINILINK_RELOC_ESC;
+				*(start++) = ri->esc;
 			} else {
-				outbuf[outbuf_fill++] = MINILINK_RELOC_ESC;
+				outbuf[outbuf_fill++] = ri->esc;
 
 			}
 			size--;
 			continue;
-		}
-		escape--; //correct offset
-
-		while (1) {
-			uint8_t mapctr;
-
-			if (escape < symcount) { //A symbol
-				writeaddr = symvaltab[escape];
-				break;
+		} else if (tag == MINILINK_TAG_RUN) {
+			run = ml_varint(iob);
+			continue;
+		} else if (tag == MINILINK_TAG_PCREL) {
+			pcrel = 1;
+			tag = iob->data[iob->pos++];
+		} else if (tag == MINILINK_TAG_WIDE) {
+			form = iob->data[iob->pos++];
+			tag = iob->data[iob->pos++];
+			len = ml_wide_len(form);
+			if (len == 0 || (len == 2 && MINILINK_WIDE_BACK(form) > sectsize - size)) {
+				DPRINTF("Bad wide relocation %x\n", form);
+				return 1;
 			}
-			//It's not a symbol
-			escape -= symcount;
+		}
 
-			if (escape < symcount) { //A Symbol with offset
-				uint16_t offset;
-				CPY16(offset, iob->data[iob->pos]);
-				iob->pos += 2;
-				writeaddr = symvaltab[escape] + offset;
+		//Literals and runs are not allowed within a run, ml_target rejects them
+		if (ml_target(iob, tag, ri, &writeaddr) != 0) return 1;
 
-				break;
-			}
-			// Looks like it's not a symbol with an offset.
-			escape -= symcount;
-
-			for (mapctr = 0; mapctr < MINILINK_SEC; mapctr++) {
-				DPRINTF("CMP %.4x < %.4x \n", escape, pihdr->mem[mapctr].size);
-				if (escape < pihdr->mem[mapctr].size) {
-					writeaddr = (uintptr_t)(pihdr->mem[mapctr].ptr) + escape;
-					DPRINTF("Setting to  %x = %x + %x\n", writeaddr, (uint16_t)(pihdr->mem[mapctr].ptr), escape);
-					break;
-				}
-				escape -= pihdr->mem[mapctr].size;
-			}
+		if (iob->pos > iob->filled) {
+			DPUTS("Relocation truncated");
+			return 1;
+		}
 
-			if (mapctr == MINILINK_SEC) {
-				DPRINTF("Remaining Reloc %x\n ", escape);
-				return 1;
-			}
-			break;
+		if (size < len) {
+			DPUTS("Relocation crosses end of section");
+			return 1;
+		}
 
+		//Distance from the word to the target
+		if (pcrel) {
+			writeaddr -= (uintptr_t) start + outbuf_fill;
+		} else if (len == 2 && form == 0 && !ML_WORD_REACH(writeaddr)) {
+			DPRINTF("Target %lx out of reach\n", (unsigned long) writeaddr);
+			return 1;
 		}
 
-		DPRINTF("Lnk: %x to %x\n", writeaddr, (uint16_t )start + outbuf_fill);
+		DPRINTF("Lnk: %lx to %x\n", (unsigned long) writeaddr, (uint16_t )start + outbuf_fill);
 		if (mwrite == NULL) {
-			CPY16(*start, writeaddr);
-			start += 2;
+			dest = start;
+			start += len;
 		} else {
-			CPY16(outbuf[outbuf_fill], writeaddr);
-			outbuf_fill += 2;
+			dest = outbuf + outbuf_fill;
+			outbuf_fill += len;
 
 		}
-		size -= 2;
+		CPY16(*dest, writeaddr);
+		if (len == 4) {
+			word = (uint32_t) writeaddr >> 16;
+			CPY16(dest[2], word);
+		} else if (form != 0) {
+			//The word in front is output already, the last bytes stay in outbuf
+			CPY16(word, dest[-MINILINK_WIDE_BACK(form)]);
+			word = ml_wide_high(word, form, writeaddr);
+			CPY16(dest[-MINILINK_WIDE_BACK(form)], word);
+		}
+		size -= len;
 
 	}
 
+	if (run) {
+		DPUTS("Relocation run crosses end of section");
+		return 1;
+	}
+
 	// Write remaining data in Output buffer
 	if (outbuf_fill) {
 		mwrite(start, outbuf, outbuf_fill);
@@ -521,79 +1118,581 @@ static uint_fast8_t ml_relocate(struct io_buf_st *iob, size_t size, uint8_t *sta
 	DPUTS("Relocations OK");
 	return 0;
 }
-/*---------------------------------------------------------------------------*/
-#if DEBUG_DIFF == 0
-#define INSTPROGRAM_FIRST (ALIGN_ROM_NEXT((uintptr_t)__data_end_rom))
-#else
-#include "node-id.h"
-#define INSTPROGRAM_FIRST (ALIGN_ROM_NEXT((uintptr_t)__data_end_rom) + (node_id) * 30)
-#endif
 
-static void init_freearea_base(void) {
-	freerom_start = (char*) INSTPROGRAM_FIRST;
-	freerom_end = (char*) ALIGN_ROM_PREV((uintptr_t )__vectors_start);
+/** Move a word of a base-delta image from the nominal layout to the
+ * section it points to.
+ * \param ri  Symbol values and section layout
+ * \param val Word to relocate
+ * \return 0 on success, 1 if the word points outside of all sections
+ */
+static uint_fast8_t ml_delta_target(const struct reloc_info_st *ri, uint16_t *val) {
+	Minilink_ProgramInfoHeader *pihdr = ri->pihdr;
+	minilink_addr_t addr;
+	uint16_t base = 0;
+	uint8_t sec;
+
+	for (sec = 0; sec < MINILINK_SEC; sec++) {
+		if ((uint16_t) (*val - base) <= pihdr->mem[sec].size) {
+			addr = (uintptr_t) pihdr->mem[sec].ptr + (uint16_t) (*val - base);
+			if (!ML_WORD_REACH(addr)) break;
+			*val = addr;
+			return 0;
+		}
+		base += pihdr->mem[sec].size + 2;
+	}
+	DPRINTF("Bad delta reference %x\n", *val);
+	return 1;
 }
-/*---------------------------------------------------------------------------*/
-/** Determine if given process structure was loaded by minilink.
- * This function assumes, that only minilink adds new processes / protthreds
- * to ram.
- * \param process Pointer to the process structure
- * \return 0 if process is from other source, 1 if process was loaded
- *         by minilink.
- *
+
+/** Read a section stored in base-delta form and relocate it.
+ * The parameters are the same as for ml_relocate().
+ * \return 0 on success, 1 if unexpected EOF or invalid relocation.
  */
-int minilink_is_process(struct process *process) {
-	uintptr_t iptr = (uintptr_t) process;
-	uintptr_t eptr = (uintptr_t) & __noinit_end;
-	if (iptr >= eptr) {
-		return 1;
+static uint_fast8_t ml_relocate_delta(struct io_buf_st *iob, size_t size, uint8_t *start,
+		const struct reloc_info_st *ri, MemWriteFunc mwrite) {
+	uint8_t group[MINILINK_DELTA_GROUP];
+	uint16_t index[MINILINK_DELTA_GROUP / 2];
+	uint8_t map, imports, len, ctr;
+	uint16_t val;
+
+	while (size) {
+		//Make sure the largest possible group is loaded
+		if (iob->pos + 2 + 3 * MINILINK_DELTA_GROUP / 2 + MINILINK_DELTA_GROUP > iob->filled) {
+			shift_iobuf(iob);
+		}
+
+		len = Min(size, MINILINK_DELTA_GROUP);
+		map = iob->data[iob->pos++];
+		imports = map ? iob->data[iob->pos++] : 0;
+		for (ctr = 0; ctr < MINILINK_DELTA_GROUP / 2; ctr++) {
+			if (!(imports & (1 << ctr))) continue;
+			index[ctr] = ml_varint(iob);
+			if (index[ctr] >= ri->tablesize) {
+				DPRINTF("Bad relocation %x\n", index[ctr]);
+				return 1;
+			}
+		}
+		memcpy(group, iob->data + iob->pos, len);
+		iob->pos += len;
+		if (iob->pos > iob->filled) {
+			DPUTS("Not enough data");
+			return 1;
+		}
+
+		for (ctr = 0; map; ctr++, map >>= 1) {
+			if (!(map & 1)) continue;
+			if (2 * ctr + 1 >= len) {
+				DPUTS("Relocation crosses end of section");
+				return 1;
+			}
+			CPY16(val, group[2 * ctr]);
+			if (imports & (1 << ctr)) {
+				if (!ML_WORD_REACH(ri->table[index[ctr]])) {
+					DPRINTF("Import %x out of reach\n", index[ctr]);
+					return 1;
+				}
+				val += ri->table[index[ctr]];
+			} else if (ml_delta_target(ri, &val) != 0) {
+				return 1;
+			}
+			CPY16(group[2 * ctr], val);
+		}
+
+		//The group is written in one go
+		if (mwrite == NULL) {
+			memcpy(start, group, len);
+		} else if (mwrite(start, group, len) != len) {
+			DPUTS("Not all Data written.");
+			return 1;
+		}
+		start += len;
+		size -= len;
 	}
-	/* else */
+
+	DPUTS("Relocations OK");
 	return 0;
 }
-/*---------------------------------------------------------------------------*/
-/** Remove all programs from flash memory.
+
+/** Read a section from the program file, in the form given by the header.
  *
- * \return NULL on success. If a linked program is still running,
- *         this function will return a pointer to the process instead.
+ * \param iob    I/O buffer to read data from
+ * \param sec    Section to read, address and size are taken from ri->pihdr
+ * \param ri     Symbol values and section layout
+ * \param mwrite Memory writing function to use for output, NULL for RAM
+ * \return 0 on success, 1 if unexpected EOF or invalid relocation.
  */
-struct process *
-clean_minilink_space(void) {
-	struct process *curproc;
+static uint_fast8_t ml_link_section(struct io_buf_st *iob, uint8_t sec, const struct reloc_info_st *ri,
+		MemWriteFunc mwrite) {
+	Minilink_ProgramInfoHeader *pihdr = ri->pihdr;
 
-	for (curproc = process_list; curproc != NULL; curproc = curproc->next) {
-		if (minilink_is_process(curproc)) return curproc;
+	if (ri->delta & (1 << sec)) {
+		return ml_relocate_delta(iob, pihdr->mem[sec].size, pihdr->mem[sec].ptr, ri, mwrite);
 	}
-
-	init_freearea_base();
-	erasearea_flash(freerom_start, freerom_end - freerom_start);
-	return NULL;
+	return ml_relocate(iob, pihdr->mem[sec].size, pihdr->mem[sec].ptr, ri, mwrite);
 }
 /*---------------------------------------------------------------------------*/
-/** Get next installed program
- * \param Pointer to header of currently selected program, or NULL to get
- *        first program in list.
- * \return Pointer to next entry in list or NULL if last one.
- */
-static Minilink_ProgramInfoHeader *instprog_next(Minilink_ProgramInfoHeader *current) {
-	uintptr_t stacktmp;
+#if DEBUG_DIFF == 0
+#define INSTPROGRAM_FIRST (ALIGN_ROM_NEXT(MINILINK_AREA_START))
+#else
+#include "node-id.h"
+#define INSTPROGRAM_FIRST (ALIGN_ROM_NEXT(MINILINK_AREA_START) + (node_id) * 30)
+#endif
 
-	if (current == NULL) {
-		current = (Minilink_ProgramInfoHeader*) INSTPROGRAM_FIRST;
-	} else {
-		current = (Minilink_ProgramInfoHeader*) ((char*) current + current->mem[MINILINK_TEXT].size + sizeof(Minilink_ProgramInfoHeader));
+/*---------------------------------------------------------------------------*/
+/* Wear leveling
+ *
+ * The last erase unit in front of the interrupt vectors holds the metadata
+ * block. It starts with a base record containing the erase counters of all
+ * segments of the program area. It is followed by a log of 16 bit words,
+ * which can be appended without erasing the block. Once the log is full,
+ * it is folded into the base record. The base record takes half of the
+ * block at most, which limits the number of segments of the program area.
+ */
+#define WEAR_MAGIC      0x5745
+#define WEAR_MAXSEG     (ROM_ERASE_UNIT_SIZE / 4 - 3)
+
+#define WEARLOG_FREE    0xFFFF
+#define WEARLOG_TAGMASK 0xF000
+#define WEARLOG_VALMASK 0x0FFF
+#define WEARLOG_ERASE   0x1000 /**< Segment was erased */
+#define WEARLOG_FIRST   0x2000 /**< Program chain now starts at segment */
+#define WEARLOG_JSTART  0x3000 /**< Install journal record of n words follows */
+#define WEARLOG_JBLOCK  0x4000 /**< Everything in front of segment is written */
+#define WEARLOG_JDONE   0x5000 /**< Install finished or range reclaimed */
+#define WEARLOG_HEAD    0x6000 /**< Program chain now starts at the word offset that follows */
+
+struct wear_base_st {
+	uint16_t magic;
+	uint16_t metaerase; /**< Erase count of the metadata block itself */
+	uint16_t first;     /**< Segment the program chain starts at */
+	uint16_t count[WEAR_MAXSEG]; /**< Erase count of each segment */
+};
+
+#define WEARLOG_START ((uint16_t *) (mlarea_end + sizeof(struct wear_base_st)))
+#define WEARLOG_END   ((uint16_t *) (mlarea_end + ROM_ERASE_UNIT_SIZE))
+
+#define WEAR_BASE ((struct wear_base_st *) mlarea_end)
+#define WEAR_SEGSTART ALIGN_ROM_PREV((uintptr_t)mlarea_start)
+#define WEAR_SEGMENTS ((uint16_t)(((uintptr_t)mlarea_end - WEAR_SEGSTART) / ROM_ERASE_UNIT_SIZE))
+
+/** The metadata block is set up. Programs installed by older versions may
+ * still use it, wear leveling starts once they are removed. */
+static uint8_t wear_ready;
+
+static char * wear_segment_ptr(uint16_t seg) {
+	char *ptr = (char*) WEAR_SEGSTART + (uintptr_t) seg * ROM_ERASE_UNIT_SIZE;
+	if (ptr < mlarea_start) return mlarea_start;
+	return ptr;
+}
+
+static uint16_t wear_segment_idx(char *ptr) {
+	return ((uintptr_t) ptr - WEAR_SEGSTART) / ROM_ERASE_UNIT_SIZE;
+}
+
+/** Get the log entry following the given one. */
+static uint16_t * wear_log_step(uint16_t *pos) {
+	if ((*pos & WEARLOG_TAGMASK) == WEARLOG_JSTART || (*pos & WEARLOG_TAGMASK) == WEARLOG_HEAD) {
+		pos += *pos & WEARLOG_VALMASK;
+	}
+	return pos + 1;
+}
+
+/** Find the first unused word of the log. */
+static uint16_t * wear_log_end(void) {
+	uint16_t *pos;
+	for (pos = WEARLOG_START; pos < WEARLOG_END && *pos != WEARLOG_FREE; pos = wear_log_step(pos));
+	if (pos > WEARLOG_END) pos = WEARLOG_END;
+	return pos;
+}
+
+/** Determine where the program chain starts.
+ * \return Pointer to the header of the first program.
+ */
+static char * wear_log_head(void) {
+	uint16_t *pos;
+	char *head;
+
+	if (!wear_ready) return mlarea_start;
+	head = wear_segment_ptr(WEAR_BASE->first);
+
+	for (pos = WEARLOG_START; pos < WEARLOG_END && *pos != WEARLOG_FREE; pos = wear_log_step(pos)) {
+		switch (*pos & WEARLOG_TAGMASK) {
+		case WEARLOG_FIRST:
+			head = wear_segment_ptr(*pos & WEARLOG_VALMASK);
+			break;
+		case WEARLOG_HEAD:
+			//Ignore entries torn by a power failure
+			if (pos + 1 < WEARLOG_END && pos[1] != 0xFFFF) {
+				head = (char*) WEAR_SEGSTART + 2 * (uintptr_t) pos[1];
+			}
+			break;
+		}
+	}
+	return head;
+}
+
+static void wear_log_set_head(char *head);
+
+/** Write a fresh base record. The metadata block must be erased. */
+static void wear_write_base(struct wear_base_st *base) {
+	base->magic = WEAR_MAGIC;
+	memwrite_flash(mlarea_end, base, sizeof(*base));
+}
+
+/** Fold the log into the base record.
+ * \return 0 on success, 1 if there was not enough memory.
+ */
+static uint_fast8_t wear_compact(void) {
+	struct wear_base_st *base;
+	uint16_t seg;
+	char *head;
+
+	DPUTS("Compacting wear log.");
+	base = ml_alloc_mem(sizeof(*base));
+	if (base == NULL) return 1;
+
+	head = wear_log_head();
+	base->first = wear_segment_idx(head);
+	base->metaerase = WEAR_BASE->metaerase + 1;
+	for (seg = 0; seg < WEAR_MAXSEG; seg++) {
+		base->count[seg] = minilink_wear_count(seg);
+	}
+
+	erasesegment_flash(mlarea_end);
+	wear_write_base(base);
+	ml_free_mem(base);
+
+	//The base record only holds the segment
+	if (head != wear_segment_ptr(base->first)) wear_log_set_head(head);
+	return 0;
+}
+
+/** Make sure the log has room for the given number of words.
+ * \return Pointer to the first free word, or NULL if the log is too small.
+ */
+static uint16_t * wear_log_reserve(uint16_t words) {
+	uint16_t *pos;
+
+	if (!wear_ready) return NULL;
+	pos = wear_log_end();
+	if (WEARLOG_END - pos < words) {
+		if (wear_compact() != 0) {
+			DPUTS("Wear log full.");
+			return NULL;
+		}
+		pos = wear_log_end();
+		if (WEARLOG_END - pos < words) return NULL;
+	}
+	return pos;
+}
+
+/** Append a word to the wear log, compacting the log if necessary. */
+static void wear_log_append(uint16_t entry) {
+	uint16_t *pos = wear_log_reserve(1);
+
+	if (pos == NULL) return;
+	memwrite_flash(pos, &entry, sizeof(entry));
+}
+
+/** Record a new start of the program chain. */
+static void wear_log_set_head(char *head) {
+	uint16_t entry[2];
+	uint16_t *pos;
+
+	if (head == wear_segment_ptr(wear_segment_idx(head))) {
+		wear_log_append(WEARLOG_FIRST | wear_segment_idx(head));
+		return;
+	}
+	entry[0] = WEARLOG_HEAD | 1;
+	entry[1] = ((uintptr_t) head - WEAR_SEGSTART) / 2;
+	pos = wear_log_reserve(2);
+	if (pos == NULL) return;
+	memwrite_flash(pos, entry, sizeof(entry));
+}
+
+/** Determine how often a segment of the program area was erased.
+ * \param segment Index of the segment, counted from the start of the area.
+ * \return Number of erase cycles.
+ */
+uint16_t minilink_wear_count(uint16_t segment) {
+	uint16_t *pos;
+	uint16_t retval = 0;
+
+	if (!wear_ready) return 0;
+	if (segment < WEAR_MAXSEG) retval = WEAR_BASE->count[segment];
+	for (pos = WEARLOG_START; pos < WEARLOG_END && *pos != WEARLOG_FREE; pos = wear_log_step(pos)) {
+		if (*pos == (WEARLOG_ERASE | segment)) retval++;
+	}
+	return retval;
+}
+
+/** Summarize the wear of the program area.
+ * \param info Structure to fill in.
+ */
+void minilink_wear_info(Minilink_WearInfo *info) {
+	uint16_t seg, cnt;
+
+	info->segments = WEAR_SEGMENTS;
+	info->metaerase = wear_ready ? WEAR_BASE->metaerase : 0;
+	info->min = 0xFFFF;
+	info->max = 0;
+	info->total = 0;
+	for (seg = 0; seg < info->segments; seg++) {
+		cnt = minilink_wear_count(seg);
+		if (cnt < info->min) info->min = cnt;
+		if (cnt > info->max) info->max = cnt;
+		info->total += cnt;
+	}
+}
+
+/** Erase all segments of the program area, that were written to. */
+static void wear_erase_dirty(void) {
+	uint16_t seg;
+	uint16_t *pos, *end;
+
+	for (seg = 0; seg < WEAR_SEGMENTS; seg++) {
+		pos = (uint16_t *) wear_segment_ptr(seg);
+		end = (uint16_t *) wear_segment_ptr(seg + 1);
+		while (pos < end && *pos == 0xFFFF) pos++;
+		if (pos == end) continue;
+
+		DPRINTF("Erasing segment %i\n", seg);
+		erasesegment_flash(wear_segment_ptr(seg));
+		wear_log_append(WEARLOG_ERASE | seg);
+	}
+}
+
+/** Pick the least worn segment as the new start of the program chain.
+ * Ties are resolved by taking the segment following the previous start,
+ * so the chain keeps moving through the area.
+ */
+static void wear_select_first(void) {
+	uint16_t seg, cnt, best, bestcnt = 0xFFFF;
+	uint16_t nseg = WEAR_SEGMENTS;
+	uint16_t prev = wear_segment_idx(instprog_first);
+	uint16_t ctr;
+
+	best = prev;
+	for (ctr = 1; ctr <= nseg; ctr++) {
+		seg = (prev + ctr) % nseg;
+		cnt = minilink_wear_count(seg);
+		if (cnt < bestcnt) {
+			bestcnt = cnt;
+			best = seg;
+		}
+	}
+	DPRINTF("New program chain start: segment %i\n", best);
+	wear_log_append(WEARLOG_FIRST | best);
+	instprog_first = wear_segment_ptr(best);
+}
+
+static Minilink_ProgramInfoHeader *instprog_at(char *ptr);
+
+/** Set up the program area and read the start of the program chain from
+ * the metadata block. Initializes the metadata block if necessary.
+ */
+static void init_freearea_base(void) {
+	uint16_t *pos;
+	char *end;
+
+	mlarea_start = (char*) INSTPROGRAM_FIRST;
+	mlarea_end = (char*) ALIGN_ROM_PREV(MINILINK_AREA_END);
+	//The base record holds the counters of a limited number of segments
+	if (WEAR_SEGMENTS > WEAR_MAXSEG + 1) {
+		DPRINTF("Program area limited to %i segments\n", WEAR_MAXSEG);
+		mlarea_end = (char*) WEAR_SEGSTART + (WEAR_MAXSEG + 1) * (uintptr_t) ROM_ERASE_UNIT_SIZE;
+	}
+	wear_ready = 0;
+
+	if (((struct wear_base_st *) (mlarea_end - ROM_ERASE_UNIT_SIZE))->magic != WEAR_MAGIC) {
+		//Older versions placed the programs back to back up to the end of the area
+		for (end = mlarea_start; instprog_at(end) != NULL;
+				end += sizeof(Minilink_ProgramInfoHeader) + ((Minilink_ProgramInfoHeader *) end)->mem[MINILINK_TEXT].size);
+		if (end > mlarea_end - ROM_ERASE_UNIT_SIZE) {
+			DPUTS("Programs use the metadata block, no wear leveling until cleaned.");
+			instprog_first = mlarea_start;
+			freerom_start = instprog_first;
+			freerom_end = mlarea_end;
+			return;
+		}
+	}
+
+	mlarea_end -= ROM_ERASE_UNIT_SIZE;
+	wear_ready = 1;
+	if (WEAR_BASE->magic != WEAR_MAGIC) {
+		struct wear_base_st *base;
+		DPUTS("Initializing wear metadata.");
+		base = ml_alloc_mem(sizeof(*base));
+		if (base != NULL) {
+			memset(base, 0, sizeof(*base));
+			for (pos = (uint16_t *) mlarea_end; pos < WEARLOG_END && *pos == 0xFFFF; pos++);
+			if (pos < WEARLOG_END) erasesegment_flash(mlarea_end);
+			wear_write_base(base);
+			ml_free_mem(base);
+		}
+	}
+
+	instprog_first = wear_log_head();
+	if (instprog_first >= mlarea_end) instprog_first = mlarea_start;
+
+	freerom_start = instprog_first;
+	freerom_end = mlarea_end;
+}
+/*---------------------------------------------------------------------------*/
+/** Determine if given process structure was loaded by minilink.
+ * This function assumes, that only minilink adds new processes / protthreds
+ * to ram.
+ * \param process Pointer to the process structure
+ * \return 0 if process is from other source, 1 if process was loaded
+ *         by minilink.
+ *
+ */
+int minilink_is_process(struct process *process) {
+	uintptr_t iptr = (uintptr_t) process;
+	uintptr_t eptr = (uintptr_t) & __noinit_end;
+	if (iptr >= eptr) {
+		return 1;
+	}
+	/* else */
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+static Minilink_ProgramInfoHeader *instprog_next(Minilink_ProgramInfoHeader *current);
+static void overlay_clear(void);
+static struct overlay_st *overlay_of(Minilink_ProgramInfoHeader *pih);
+
+/** Remove all programs from flash memory.
+ * Programs in RAM importing from them are unloaded as well.
+ *
+ * \return NULL on success. If a linked program is still running,
+ *         this function will return a pointer to the process instead.
+ */
+struct process *
+clean_minilink_space(void) {
+	struct process *curproc;
+	Minilink_ProgramInfoHeader *pih;
+	struct ramprog_st *ramprog, *next;
+
+	for (curproc = process_list; curproc != NULL; curproc = curproc->next) {
+		if (minilink_is_process(curproc)) return curproc;
+	}
+
+	//Importers are newer than the programs they import from, so they come first
+	for (ramprog = ramprog_list; ramprog != NULL; ramprog = next) {
+		next = ramprog->next;
+		if (ml_export_needs_flash(&ramprog->hdr)) {
+			DPRINTF("Unloading %s\n", ramprog->hdr.sourcefile);
+			minilink_unload(ramprog->hdr.sourcefile);
+		}
 	}
+
+	for (pih = instprog_next(NULL); pih != NULL && INSTPROG_IN_FLASH(pih); pih = instprog_next(pih)) {
+		ml_export_release(pih);
+	}
+	overlay_clear();
+	init_freearea_base();
+	wear_erase_dirty();
+	//The metadata block can be set up now, if programs used it before
+	if (!wear_ready) init_freearea_base();
+	wear_select_first();
+	freerom_start = instprog_first;
+	return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/** Check whether a valid program header is located at the given address.
+ * \param ptr Address to check
+ * \return Pointer to the header or NULL if there is none.
+ */
+static Minilink_ProgramInfoHeader *instprog_at(char *ptr) {
+	Minilink_ProgramInfoHeader *current = (Minilink_ProgramInfoHeader *) ptr;
+	uintptr_t stacktmp;
+
+	if (ptr + sizeof(Minilink_ProgramInfoHeader) > mlarea_end)
+		return NULL;
+
 	DPRINTF("MAGIC: %x, %x\n", current->magic, MINILINK_INST_MAGIC);
-	if (current->magic != MINILINK_INST_MAGIC)
+	if (!INSTPROG_LIVE(current) && current->magic != MINILINK_DEAD_MAGIC)
 		return NULL;
 
-	stacktmp = (uintptr_t) freerom_end - (uintptr_t) current - sizeof(Minilink_ProgramInfoHeader);
+	stacktmp = (uintptr_t) mlarea_end - (uintptr_t) current - sizeof(Minilink_ProgramInfoHeader);
 	if (current->mem[MINILINK_TEXT].size > (size_t) stacktmp)
 		return NULL;
 
 	return current;
 }
 
+/** Get next entry of the program chain, including dead entries.
+ * The chain starts at instprog_first. If a program did not fit in front of
+ * the end of the area, it continues at the start of the area.
+ * \param Pointer to header of current entry, or NULL to get the first one.
+ * \return Pointer to next entry in chain or NULL if last one.
+ */
+static Minilink_ProgramInfoHeader *instprog_step(Minilink_ProgramInfoHeader *current) {
+	char *next;
+
+	if (current == NULL) {
+		current = instprog_at(instprog_first);
+		//The first program did not fit in front of the end of the area
+		if (current == NULL && INSTPROG_FIRST_SEG > mlarea_start) {
+			current = instprog_at(mlarea_start);
+		}
+		return current;
+	}
+
+	next = (char*) current + current->mem[MINILINK_TEXT].size + sizeof(Minilink_ProgramInfoHeader);
+
+	if ((char*) current < instprog_first) {
+		//Already wrapped around - the chain ends where it started
+		if (next >= instprog_first) return NULL;
+		return instprog_at(next);
+	}
+
+	current = instprog_at(next);
+	if (current == NULL && INSTPROG_FIRST_SEG > mlarea_start) {
+		current = instprog_at(mlarea_start);
+	}
+	return current;
+}
+
+/** Get next installed program
+ * Programs in flash come first, followed by the ones loaded to RAM.
+ * \param Pointer to header of currently selected program, or NULL to get
+ *        first program in list.
+ * \return Pointer to next entry in list or NULL if last one.
+ */
+static Minilink_ProgramInfoHeader *instprog_next(Minilink_ProgramInfoHeader *current) {
+	struct ramprog_st *ramprog;
+
+	if (current != NULL && !INSTPROG_IN_FLASH(current)) {
+		ramprog = RAMPROG_OF(current)->next;
+		return ramprog ? &ramprog->hdr : NULL;
+	}
+
+	do {
+		current = instprog_step(current);
+	} while (current != NULL && !INSTPROG_LIVE(current));
+	if (current == NULL && ramprog_list != NULL) {
+		current = &ramprog_list->hdr;
+	}
+	return current;
+}
+
+/** Find a process of the given program in the process list.
+ * \param pih Header of the program
+ * \return Pointer to the process or NULL if none is running.
+ */
+static struct process *instprog_running(Minilink_ProgramInfoHeader *pih) {
+	struct process * curproc;
+
+	for (curproc = process_list; curproc != NULL; curproc = curproc->next) {
+		if ((uintptr_t) (void*) curproc >= (uintptr_t)(pih->mem[MINILINK_DATA].ptr)
+				&& (uintptr_t) (void*) curproc < (uintptr_t)(pih->mem[MINILINK_DATA].ptr + pih->mem[MINILINK_DATA].size)) {
+			return curproc;
+		}
+	}
+	return NULL;
+}
+
 /**
  * Get the Info-header of a process
  * @param proc The process to get the header of.
@@ -680,225 +1779,856 @@ minilink_get_filename(struct process *process) {
 	return NULL;
 }
 /*---------------------------------------------------------------------------*/
-/** Initialize minilink internal data.
- * \param stack_space Amount of stack space to reserve.
+/* Install journal
+ *
+ * Before a program is written to flash, a record describing the target range
+ * is appended to the metadata log. While the text is written, the progress is
+ * logged whenever a segment boundary is passed. As the program header is
+ * written last, an interrupted installation is detected on the next boot and
+ * either resumed or the range is reclaimed.
  */
-void minilink_init(void) {
-
-	char *tmpptr;
-
-	init_freearea_base();
+struct journal_rec_st {
+	uint32_t crc;    /**< CRC of the program file */
+	char *start;     /**< Location of the program info header */
+	uint16_t size;   /**< Size of header and text */
+	void *ptr[MINILINK_SEC - 1]; /**< Location of the RAM sections */
+	char sourcefile[MINILINK_MAX_FILENAME];
+	char symtabfile[MINILINK_MAX_FILENAME];
+};
 
-	DPUTS("Scanning free ROM space...");
-	for (tmpptr = freerom_end - 1; tmpptr >= freerom_start; tmpptr--) {
-		if (*tmpptr != (char) 0xff && *tmpptr != (char) 0x00) break;
+#define JOURNAL_WORDS (sizeof(struct journal_rec_st) / 2)
+
+/** Everything in front of this address was written before the power loss.
+ * NULL unless an installation is resumed. */
+static char *journal_skip;
+/** Segment the text is currently written to */
+static uint16_t journal_seg;
+/** Journal record is open */
+static uint8_t journal_active;
+/** Something was written to flash since the record was opened */
+static uint8_t journal_written;
+/** Flash content did not match while resuming */
+static uint8_t journal_fail;
+
+static uint_fast8_t ml_load(const char *programfile, const char *symtabfile,
+		struct process ***proclist, const struct journal_rec_st *resume, uint8_t flags,
+		struct resolved_st *resolved);
+static uint8_t ml_read_name(struct io_buf_st *b, char *name, uint8_t pos);
+
+/** Open a journal record for the given installation. */
+static void journal_start(const struct journal_rec_st *rec) {
+	uint16_t *pos;
+	uint16_t tag = WEARLOG_JSTART | JOURNAL_WORDS;
+
+	journal_active = 0;
+	journal_written = 0;
+	journal_fail = 0;
+	/* Record, one entry per segment when writing and another one when
+	 * reclaiming, and the final mark. Nothing may compact the log while the
+	 * record is open.
+	 */
+	pos = wear_log_reserve(1 + JOURNAL_WORDS + 2 * (rec->size / ROM_ERASE_UNIT_SIZE + 2) + 1);
+	if (pos == NULL) {
+		DPUTS("No room for install journal.");
+		return;
 	}
-	freerom_start = (char*) ALIGN_WORD_NEXT((uintptr_t )tmpptr);
+	memwrite_flash(pos, &tag, sizeof(tag));
+	memwrite_flash(pos + 1, (void *) rec, sizeof(*rec));
+	journal_seg = wear_segment_idx(rec->start);
+	journal_active = 1;
+}
 
-	DPUTS("Minilink init OK");
+/** Close the last journal record in the log. */
+static void journal_close(void) {
+	wear_log_append(WEARLOG_JDONE);
+	journal_active = 0;
+}
 
+/** Close the journal record, if one was opened. */
+static void journal_done(void) {
+	if (journal_active) journal_close();
 }
 
-/*---------------------------------------------------------------------------*/
-/** Link the given file into flash ROM.
- * \param programfile Filename containing program to load
- * \param symtabfile  File containing the symbol table of the kernel
- * \param process     Output for storing pointer to process structure
- *                    of program
- * \return 0 on success, 1 if file was damaged or not found, 2 if not
- *         enough memory, 3 if symbol could not be resolved
+/** Write to flash and log the progress in the install journal.
+ * When resuming, words that were already written are verified instead.
  */
-uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, struct process ***proclist) {
-	Minilink_Header mlhdr;
-	uint16_t *symvalp = NULL;
-	Minilink_ProgramInfoHeader pihdr, *instprog;
-	int status = 1;
-
-	struct io_buf_st buf_ml;
-	struct io_buf_st buf_sym;
-
-#if DEBUG_DIFF
-	void * memblock;
-	memblock = malloc(node_id * 40);
-#endif
-
-	LEDGOFF;
-	LEDBOFF;
-	LEDRON;
-	memset(&pihdr, 0, sizeof(pihdr));
-
-	if (strlen(programfile) > MINILINK_MAX_FILENAME - 1) {
+static size_t memwrite_flash_journal(void *dest, void *src, size_t len) {
+	uint16_t *lcldest = dest;
+	uint8_t *lclsrc = src;
+	uint16_t seg, word;
+	size_t written;
+
+	journal_written = 1;
+	if (journal_skip == NULL) {
+		written = memwrite_flash(dest, src, len);
+	} else {
+		for (written = 0; written + 1 < len; written += 2, lcldest++) {
+			if ((char*) lcldest < journal_skip) continue;
+			CPY16(word, lclsrc[written]);
+			if (*lcldest == word) continue;
+			if (*lcldest != 0xFFFF) {
+				journal_fail = 1;
+				continue;
+			}
+			memwrite_flash(lcldest, &word, sizeof(word));
+		}
+	}
 
-		DPUTS("Name too long.\n");
-		return 1;
+	seg = wear_segment_idx((char*) dest + written);
+	if (journal_active && seg != journal_seg) {
+		journal_seg = seg;
+		wear_log_append(WEARLOG_JBLOCK | seg);
 	}
+	return written;
+}
 
-	buf_ml.filled = 0;
-	buf_ml.pos = 0;
+/** Give up an interrupted installation.
+ * The program header is turned into a dead entry, so the chain can skip the
+ * range. Segments only used by the range are erased.
+ * \return End of the range that stays in use.
+ */
+static char * journal_reclaim(const struct journal_rec_st *rec) {
+	Minilink_ProgramInfoHeader *hdr = (Minilink_ProgramInfoHeader *) rec->start;
+	char *end = rec->start + rec->size;
+	char *seg;
+	uint16_t word;
+
+	DPRINTF("Reclaiming %x - %x\n", (uint16_t) rec->start, (uint16_t) end);
+	seg = (char*) ALIGN_ROM_NEXT((uintptr_t) rec->start + sizeof(Minilink_ProgramInfoHeader));
+	if (hdr->mem[MINILINK_TEXT].size != 0xFFFF || seg > end) {
+		seg = end;
+	}
+	end = seg;
 
-	LEDBON;
-	buf_ml.fd = cfs_open(programfile, CFS_READ);
+	//Everything behind the first segment boundary belongs to this program
+	for (; seg < rec->start + rec->size; seg += ROM_ERASE_UNIT_SIZE) {
+		erasesegment_flash(seg);
+		wear_log_append(WEARLOG_ERASE | wear_segment_idx(seg));
+	}
 
-	if (buf_ml.fd < 0) {
-		DPUTS("Could not open File.");
-		goto cleanup;
+	if (hdr->mem[MINILINK_TEXT].size == 0xFFFF) {
+		word = end - rec->start - sizeof(Minilink_ProgramInfoHeader);
+		memwrite_flash(&hdr->mem[MINILINK_TEXT].size, &word, sizeof(word));
 	}
+	word = MINILINK_DEAD_MAGIC;
+	memwrite_flash(&hdr->magic, &word, sizeof(word));
 
-	buf_sym.pos = 0;
-	buf_sym.filled = 0;
+	journal_done();
+	return end;
+}
 
-	buf_sym.fd = cfs_open(symtabfile, CFS_READ);
-	LEDBOFF;
+/** Look for an interrupted installation and resume or reclaim it. */
+static void journal_recover(void) {
+	uint16_t *pos, *rec = NULL, *blk = NULL;
+	struct journal_rec_st jr;
+	struct process **proclist;
 
-	//Check whether the files are ok
-	if (ml_file_check(buf_ml.fd, MINILINK_PGM_MAGIC) != 1) {
-		DPUTS("Ret is not 1\n");
-		return 1;
+	if (!wear_ready) return;
+	for (pos = WEARLOG_START; pos < WEARLOG_END && *pos != WEARLOG_FREE; pos = wear_log_step(pos)) {
+		switch (*pos & WEARLOG_TAGMASK) {
+		case WEARLOG_JSTART:
+			rec = pos;
+			blk = NULL;
+			break;
+		case WEARLOG_JBLOCK:
+			blk = pos;
+			break;
+		case WEARLOG_JDONE:
+			rec = NULL;
+			break;
+		}
 	}
+	if (rec == NULL) return;
 
-	if (ml_file_check(buf_sym.fd, MINILINK_SYM_MAGIC) != 1) {
-		DPUTS("Ret is not 1\n");
-		return 1;
+	//Power was lost while writing the record - nothing written to the range yet
+	if (rec + JOURNAL_WORDS >= WEARLOG_END || rec[JOURNAL_WORDS] == 0xFFFF) {
+		journal_close();
+		return;
 	}
-	LEDGON;
-
-	//Reset
-	cfs_seek(buf_ml.fd, 0, CFS_SEEK_SET);
-	cfs_seek(buf_sym.fd, 0, CFS_SEEK_SET);
-	LEDBON;
+	memcpy(&jr, rec + 1, sizeof(jr));
 
-	//Read header, but do not write to buffer!
-	if (cfs_read(buf_ml.fd, &mlhdr, sizeof(mlhdr)) != sizeof(mlhdr)) {
-		DPUTS("Could not Read Header.");
-		goto cleanup;
+	//Power was lost after the header was written
+	if (instprog_at(jr.start) != NULL) {
+		journal_close();
+		return;
 	}
 
-	//Now let's get the ram for the symbol table
-	symvalp = malloc(mlhdr.symentries * sizeof(uint16_t));
-	if (symvalp == NULL) {
-		DPUTS("Could not allocate memory for symtbl.");
-		status = 2;
-		goto cleanup;
+	DPRINTF("Resuming installation of %s\n", jr.sourcefile);
+	journal_skip = blk ? wear_segment_ptr(*blk & WEARLOG_VALMASK) : jr.start;
+	journal_seg = wear_segment_idx(journal_skip);
+	journal_active = 1;
+	journal_fail = 0;
+	if (ml_load(jr.sourcefile, jr.symtabfile, &proclist, &jr, 0, NULL) != 0) {
+		DPUTS("Resuming failed.");
+		journal_reclaim(&jr);
 	}
+	journal_skip = NULL;
+}
 
-	//------------ Resolve the symbol-list. - This must be done anyway
-	{
-		uint16_t symctr;
-
-		char cursym[MINILINK_MAX_SYMLEN];
-		uint16_t curr_add = 0;
-
-		cursym[0] = 0;
-
-		if (buf_sym.fd < 0) {
-			DPUTS("Could not open File.");
-			goto cleanup;
-		}
-		{ //get rid of the header.
-			uint8_t shift = sizeof(Minilink_SymbolHeader);
-			while (shift) {
-				shift_iobuf(&buf_sym);
-				buf_sym.pos = Min(buf_sym.filled, shift);
-				shift -= buf_sym.pos;
+/*---------------------------------------------------------------------------*/
+/** Note the imports of a program in flash from the programs set up, without
+ * setting it up.
+ * \param pih Program, its file must be the one it was linked from
+ * \return 0 on success, 1 if the file is missing or damaged, 2 if not
+ *         enough memory
+ */
+static uint_fast8_t ml_export_scan(Minilink_ProgramInfoHeader *pih) {
+	struct io_buf_st buf;
+	Minilink_Header mlhdr;
+	struct export_use_st *uses = NULL;
+	minilink_addr_t addr;
+	char name[MINILINK_SYMDELTA_NAMELEN];
+	uint_fast8_t status = 1;
+	uint16_t ctr;
+	uint8_t same;
+
+	buf.filled = 0;
+	buf.pos = 0;
+	buf.lz = NULL;
+	buf.fd = cfs_open(pih->sourcefile, CFS_READ);
+	if (buf.fd < 0) return 1;
+	if (cfs_read(buf.fd, &mlhdr, sizeof(mlhdr)) != sizeof(mlhdr) || mlhdr.version != MINILINK_PGM_VERSION
+			|| mlhdr.common.crc != pih->crc) goto cleanup;
+	//Imports by index are never taken from programs
+	if (!(mlhdr.flags & MINILINK_FLAG_ABI)) {
+		name[0] = '\0';
+		for (ctr = 0; ctr < mlhdr.symentries; ctr++) {
+			if (buf.pos >= buf.filled) shift_iobuf(&buf);
+			if (buf.pos >= buf.filled) goto cleanup;
+			same = buf.data[buf.pos++];
+			if (same > strlen(name) || ml_read_name(&buf, name, same) >= MINILINK_SYMDELTA_NAMELEN) goto cleanup;
+			if (ml_export_lookup(name, &addr, &uses) == 2) {
+				status = 2;
+				goto cleanup;
 			}
 		}
+	}
+	ml_export_commit(&uses, pih);
+	status = 0;
 
-		//Fill Buffer.....
-		shift_iobuf(&buf_sym);
+	cleanup:
+	ml_export_commit(&uses, NULL);
+	cfs_close(buf.fd);
+	return status;
+}
 
-#define NEXTSYMPOS {buf_sym.pos++; if(buf_sym.filled == buf_sym.pos) shift_iobuf(&buf_sym);}
+/** Set up the programs in flash which programs in flash imported from
+ * before the last reset, unless this happened already. Their exports must
+ * be known again before programs are loaded or relinked, so the imports
+ * resolve as they did when the programs were installed. The imports of the
+ * other programs in flash are noted as well, so the programs imported from
+ * count the users actually found.
+ * \param symtabfile File containing the symbol table of the kernel
+ * \return 0 on success, otherwise the status of the program that failed
+ */
+static uint_fast8_t ml_export_restore(const char *symtabfile) {
+	static uint8_t active;
+	Minilink_ProgramInfoHeader *pih;
+	struct process **proclist;
+	uint_fast8_t status = 0, found = 1;
+
+	//Programs are set up in the order they were installed, so a program is
+	//never set up before those it imports from
+	if (active || export_restored) return 0;
+	active = 1;
+	for (pih = instprog_next(NULL); status == 0 && pih != NULL && INSTPROG_IN_FLASH(pih); pih = instprog_next(pih)) {
+		if (overlay_of(pih) != NULL) continue;
+		if (pih->magic == MINILINK_USED_MAGIC && ml_export_of(pih) == NULL) {
+			DPRINTF("Setting up %s\n", pih->sourcefile);
+			status = ml_load(pih->sourcefile, symtabfile, &proclist, NULL, 0, NULL);
+		} else if (export_list != NULL && ml_export_scan(pih) != 0) {
+			//Its imports stay unknown, keep what it may import from
+			DPRINTF("Could not read the imports of %s\n", pih->sourcefile);
+			found = 0;
+		}
+	}
+	export_restored = (status == 0 && found);
+	active = 0;
+	return status;
+}
 
-		for (symctr = 0; symctr < mlhdr.symentries; symctr++) {
-			uint8_t samechars;
+/*---------------------------------------------------------------------------*/
+/* Overlays
+ *
+ * The program area can be used as a cache, with the program files as backing
+ * store. minilink_require() links a program if it is not resident. If there
+ * is not enough flash, the oldest program, the one at the start of the
+ * chain, is turned into a dead entry and its segments are reclaimed.
+ * Programs further down the chain can not be evicted, as the space they use
+ * only becomes free once everything in front of it is gone.
+ */
 
-			//fill buffer.
-			shift_iobuf(&buf_ml);
-			samechars = buf_ml.data[buf_ml.pos];
-			buf_ml.pos++;
-			DPRINTF("Looking up: <%i>%s\n", samechars, &(buf_ml.data[buf_ml.pos]));
+/** Find the record of a program set up since boot.
+ * \return Pointer to the record or NULL if there is none.
+ */
+static struct overlay_st *overlay_of(Minilink_ProgramInfoHeader *pih) {
+	struct overlay_st *ovl;
 
-			while (1) {
-				/// \fixme make sure we don't go past the buffer
-				// The next code is a bit complicated, I'll add some graphix to visualize it
-				/// \todo Grafiken erstellen.
-				//get next symbol
-				uint8_t symattr;
-				uint16_t sym_write_pos;
+	for (ovl = overlay_list; ovl != NULL && ovl->pih != pih; ovl = ovl->next);
+	return ovl;
+}
 
-				symattr = buf_sym.data[buf_sym.pos];
-				NEXTSYMPOS;
+/** Drop the record of a program, freeing its RAM if it was allocated
+ * since boot.
+ */
+static void overlay_drop(Minilink_ProgramInfoHeader *pih) {
+	struct overlay_st **prev, *ovl;
+	uint8_t ctr;
+
+	for (prev = &overlay_list; *prev != NULL && (*prev)->pih != pih; prev = &(*prev)->next);
+	ovl = *prev;
+	if (ovl == NULL) return;
+	*prev = ovl->next;
+	if (ovl->ownram) {
+		for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
+			ml_free_mem(pih->mem[ctr].ptr);
+		}
+	}
+	ml_free_mem(ovl);
+}
 
-				sym_write_pos = symattr & 0x3F;
+/** Drop the records of all programs in flash. */
+static void overlay_clear(void) {
+	while (overlay_list != NULL) overlay_drop(overlay_list->pih);
+}
 
-				if (samechars > sym_write_pos) { //Ok, looks like we went past the symbol
-					DPUTS("Symbol could not be resolved - past same\n");
-					status = 1;
-					goto cleanup;
-				} else if (samechars == sym_write_pos) {
-					while (1) { //Loop until we reach the Null-char
-						if (buf_sym.data[buf_sym.pos] != buf_ml.data[buf_ml.pos]) break;
-
-						if (buf_ml.data[buf_ml.pos] == '\0') {
-							DPUTS("FOUND!\n");
-							break; //Could take any of the two, as they are the same
-						}
-						//It is important that this comes afterwards! - It must point at the NULL
-						NEXTSYMPOS;
-						buf_ml.pos++;
-						samechars++;
+/** Move the start of the program chain past dead entries and erase the
+ * segments which are not used by the remaining programs anymore.
+ */
+static void overlay_reclaim(void) {
+	Minilink_ProgramInfoHeader *pih;
+	char *head, *seg, *end;
+
+	for (pih = instprog_step(NULL); pih != NULL && pih->magic == MINILINK_DEAD_MAGIC; pih = instprog_step(pih));
+	head = (pih != NULL) ? (char*) pih : freerom_start;
+	if (head >= mlarea_end) head = mlarea_start;
+	if (head == instprog_first) return;
+
+	DPRINTF("Program chain moves from %x to %x\n", (uint16_t) instprog_first, (uint16_t) head);
+	end = (char*) ALIGN_ROM_PREV((uintptr_t) head);
+	for (seg = INSTPROG_FIRST_SEG; seg != end;) {
+		erasesegment_flash(wear_segment_ptr(wear_segment_idx(seg)));
+		wear_log_append(WEARLOG_ERASE | wear_segment_idx(seg));
+		seg += ROM_ERASE_UNIT_SIZE;
+		if (seg >= mlarea_end) seg = (char*) WEAR_SEGSTART;
+	}
 
-					}
+	wear_log_set_head(head);
+	instprog_first = head;
+	freerom_end = (head > freerom_start) ? INSTPROG_FIRST_SEG : mlarea_end;
+}
 
-					if (buf_sym.data[buf_sym.pos] > buf_ml.data[buf_ml.pos]) { // We are searching for a symbol smaller then
-						// the current on. - They are sorted, therefore we will not find it anymore
+/** Evict the program at the start of the chain.
+ * \return 0 if a program was evicted, 1 if it has running processes or
+ *         programs importing from it, or the start of the chain can't be
+ *         recorded.
+ */
+static uint_fast8_t overlay_evict(void) {
+	Minilink_ProgramInfoHeader *victim = instprog_next(NULL);
+	uint16_t word = MINILINK_DEAD_MAGIC;
 
-						DPUTS("Symbol could not be resolved - past alpha\n");
-						status = 3;
-						goto cleanup;
-					}
+	if (!wear_ready || victim == NULL || !INSTPROG_IN_FLASH(victim)) return 1;
+	if (instprog_running(victim) != NULL || ml_export_users(victim) != 0) {
+		DPRINTF("Can't evict %s\n", victim->sourcefile);
+		return 1;
+	}
 
-				}
+	DPRINTF("Evicting %s\n", victim->sourcefile);
+	overlay_drop(victim);
+	ml_export_release(victim);
+	memwrite_flash(&victim->magic, &word, sizeof(word));
+	overlay_reclaim();
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/** Initialize minilink internal data.
+ * \param stack_space Amount of stack space to reserve.
+ */
+void minilink_init(void) {
+
+	char *tmpptr;
+	Minilink_ProgramInfoHeader *instprog, *last = NULL;
+
+	init_freearea_base();
+	journal_recover();
+
+	for (instprog = instprog_step(NULL); instprog != NULL; instprog = instprog_step(instprog)) {
+		last = instprog;
+	}
+	if (last != NULL) {
+		freerom_start = (char*) last + sizeof(Minilink_ProgramInfoHeader) + last->mem[MINILINK_TEXT].size;
+		if ((char*) last < instprog_first) freerom_end = INSTPROG_FIRST_SEG;
+	}
+
+	DPUTS("Scanning free ROM space...");
+	for (tmpptr = freerom_end - 1; tmpptr >= freerom_start; tmpptr--) {
+		if (*tmpptr != (char) 0xff && *tmpptr != (char) 0x00) break;
+	}
+	//tmpptr is the last byte in use, if it is even it starts a word in use
+	freerom_start = (char*) ALIGN_WORD_NEXT((uintptr_t )tmpptr + 1);
+
+	DPUTS("Minilink init OK");
+
+}
+
+/*---------------------------------------------------------------------------*/
+/** Memory writing function, that drops all data. */
+static size_t memwrite_discard(void *dest, void *src, size_t len) {
+	(void)dest;
+	(void)src;
+	return len;
+}
+
+/** Decode all sections of a program without writing anything.
+ * This catches broken relocations before flash or RAM are modified. The
+ * buffer is rewound to where it was afterwards.
+ * \param iob       Buffer positioned behind the symbol list
+ * \param ri        Symbol values and section layout
+ * \return 0 if all sections decode fine, 1 otherwise
+ */
+static uint_fast8_t ml_prescan(struct io_buf_st *iob, const struct reloc_info_st *ri) {
+	Minilink_ProgramInfoHeader *pihdr = ri->pihdr;
+	static const uint8_t order[] = { MINILINK_DATA, MINILINK_MIG, MINILINK_MIGPTR, MINILINK_TEXT };
+	cfs_offset_t offset = tell_iobuf(iob);
+	uint_fast8_t status = 0;
+	uint8_t ctr;
+
+	DPUTS("Prescanning relocations...");
+	for (ctr = 0; ctr < sizeof(order) && status == 0; ctr++) {
+		if (pihdr->mem[order[ctr]].size == 0) continue;
+		status = ml_link_section(iob, order[ctr], ri, &memwrite_discard);
+	}
+	seek_iobuf(iob, offset);
+	return status;
+}
+
+/** Open the symbol table of the kernel and read its header.
+ * \param b          Buffer to read the symbol table with, its file is
+ *                   positioned behind the header
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param symhdr     Output for the header
+ * \return 0 on success, 1 if the file is missing or damaged
+ */
+static uint_fast8_t ml_read_symtab_header(struct io_buf_st *b, const char *symtabfile,
+		Minilink_SymbolHeader *symhdr) {
+	b->pos = 0;
+	b->filled = 0;
+	b->fd = cfs_open(symtabfile, CFS_READ);
+	if (b->fd < 0) {
+		DPUTS("Could not open File.");
+		return 1;
+	}
+	if (ml_file_check(b->fd, MINILINK_SYM_MAGIC) != 1) {
+		DPUTS("Ret is not 1\n");
+		return 1;
+	}
+	cfs_seek(b->fd, 0, CFS_SEEK_SET);
+	if (cfs_read(b->fd, symhdr, sizeof(*symhdr)) != sizeof(*symhdr)) {
+		return 1;
+	}
+
+	if (symhdr->flags != ML_SYMFLAGS) {
+		DPRINTF("Symbol table flags are %x should be %x\n", symhdr->flags, ML_SYMFLAGS);
+		return 1;
+	}
+	return 0;
+}
+
+/** Open the symbol table of the kernel and skip its header.
+ * \param b          Buffer to read the symbol table with
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param dictionary Id of the dictionary the names of the program are coded with
+ * \return 0 on success, 1 if the file is missing or damaged, 3 if its names
+ *         are coded differently
+ */
+static uint_fast8_t ml_open_symtab(struct io_buf_st *b, const char *symtabfile, uint16_t dictionary) {
+	Minilink_SymbolHeader symhdr;
+
+	if (ml_read_symtab_header(b, symtabfile, &symhdr) != 0) return 1;
+
+	//Names are compared coded, so both must use the same dictionary
+	if (symhdr.dictionary != dictionary) {
+		DPRINTF("Dictionary is %x should be %x\n", symhdr.dictionary, dictionary);
+		return 3;
+	}
+
+	//get rid of the header, the dictionary itself is only used by the tools
+	cfs_seek(b->fd, sizeof(symhdr) + symhdr.dictsize, CFS_SEEK_SET);
+
+	//Fill Buffer.....
+	shift_iobuf(b);
+	return 0;
+}
+
+#if MINILINK_HOT_SYMBOLS
+/** Look a symbol up in the hot tier of the kernel symbol table.
+ * \param name Name of the symbol
+ * \param addr Output for the value of the symbol
+ * \return 0 if found, 1 otherwise
+ */
+static uint_fast8_t ml_hot_lookup(const char *name, minilink_addr_t *addr) {
+	uint16_t low = 0, high = minilink_hot_count, mid;
+	int cmp;
+
+	//The table is sorted by name
+	while (low < high) {
+		mid = (low + high) / 2;
+		cmp = strcmp(name, minilink_hot_symbols[mid].name);
+		if (cmp == 0) {
+			*addr = (uintptr_t) minilink_hot_symbols[mid].addr;
+			return 0;
+		}
+		if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return 1;
+}
+#endif
+
+#if MINILINK_ABI_TABLE
+/** Resolve the symbol list of a program importing symbols by index.
+ * \param iob   I/O buffer positioned at the symbol list
+ * \param count Number of symbols
+ * \param vals  Output for the symbol values
+ * \return 0 on success, 3 if an index is not in the export table
+ */
+static uint_fast8_t ml_abi_symbols(struct io_buf_st *iob, uint16_t count, minilink_addr_t *vals) {
+	uint16_t idx;
+
+	while (count--) {
+		shift_iobuf(iob);
+		idx = ml_varint(iob);
+		if (idx >= minilink_abi_count || minilink_abi_table[idx] == NULL) {
+			DPRINTF("Export %u not in kernel\n", idx);
+			return 3;
+		}
+		*vals++ = (uintptr_t) minilink_abi_table[idx];
+	}
+	return 0;
+}
+#endif
+/** Resolve the symbols imported by a program.
+ * \param buf_ml     I/O buffer positioned at the symbol list of the program
+ * \param buf_sym    I/O buffer for the symbol table. It is opened once a
+ *                   symbol is looked up there, the caller closes it.
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param mlhdr      Header of the program
+ * \param symvaltab  Output for the symbol values
+ * \param uses       Output for the programs imported from
+ * \return 0 on success, 1 if a file was damaged, 2 if not enough memory,
+ *         3 if a symbol could not be resolved
+ */
+static uint_fast8_t ml_resolve_symbols(struct io_buf_st *buf_ml, struct io_buf_st *buf_sym,
+		const char *symtabfile, const Minilink_Header *mlhdr, minilink_addr_t *symvaltab, struct export_use_st **uses) {
+	uint_fast8_t status;
+	uint16_t symctr;
+	char cursym[MINILINK_MAX_SYMLEN];
+	minilink_addr_t curr_add = 0;
+	//Most chars the next name can share with the last table entry read
+	uint8_t symlimit = 0xFF;
+
+	if (mlhdr->flags & MINILINK_FLAG_ABI) {
+#if MINILINK_ABI_TABLE
+		return ml_abi_symbols(buf_ml, mlhdr->symentries, symvaltab);
+#else
+		DPUTS("Kernel has no export table\n");
+		return 3;
+#endif
+	}
+
+	cursym[0] = 0;
+
+#define NEXTSYMPOS {buf_sym->pos++; if(buf_sym->filled == buf_sym->pos) shift_iobuf(buf_sym);}
+
+	for (symctr = 0; symctr < mlhdr->symentries; symctr++) {
+		uint8_t samechars, prefix;
+
+		//fill buffer.
+		shift_iobuf(buf_ml);
+		samechars = buf_ml->data[buf_ml->pos];
+		buf_ml->pos++;
+		DPRINTF("Looking up: <%i>%s\n", samechars, &(buf_ml->data[buf_ml->pos]));
+
+		/* Keep the name. If it does not fit, the last char stays set and
+		 * the part kept is all later names may share with it.
+		 */
+		prefix = samechars;
+		if (samechars < MINILINK_MAX_SYMLEN) {
+			strncpy(cursym + samechars, (char *) &(buf_ml->data[buf_ml->pos]),
+					MINILINK_MAX_SYMLEN - samechars);
+		}
+
+		/* Names and table are sorted, so the chars shared with the last
+		 * table entry are the fewer of those shared with the previous name
+		 * and those the previous name shared with the table entry. The
+		 * chars up to prefix are only in cursym.
+		 */
+		samechars = Min(samechars, symlimit);
+#define NAMECHAR ((samechars < prefix) ? (uint8_t) cursym[samechars] : buf_ml->data[buf_ml->pos])
+		//The values of the table are deltas, so curr_add must not change
+		status = 1;
+		if (cursym[MINILINK_MAX_SYMLEN - 1] == '\0') {
+			//Programs loaded before take precedence over the kernel
+			status = ml_export_lookup(cursym, &symvaltab[symctr], uses);
+			if (status == 2) return 2;
+#if MINILINK_HOT_SYMBOLS
+			if (status != 0) status = ml_hot_lookup(cursym, &symvaltab[symctr]);
+#endif
+		}
+		if (status == 0) {
+			DPUTS("Resolved without table\n");
+			while (buf_ml->data[buf_ml->pos] != '\0') buf_ml->pos++;
+			buf_ml->pos++;
+			symlimit = samechars;
+			continue;
+		}
+		symlimit = 0xFF;
 
-				while (buf_sym.data[buf_sym.pos] != '\0') NEXTSYMPOS;
-				NEXTSYMPOS; //one more!
+		if (buf_sym->fd < 0) {
+			status = ml_open_symtab(buf_sym, symtabfile, mlhdr->dictionary);
+			if (status != 0) return status;
+		}
+
+		while (1) {
+			/// \fixme make sure we don't go past the buffer
+			// The next code is a bit complicated, I'll add some graphix to visualize it
+			/// \todo Grafiken erstellen.
+			//get next symbol
+			uint8_t symattr;
+			uint16_t sym_write_pos;
+
+			//Only the end marker is left, the symbol sorts behind all others
+			if (buf_sym->filled < LOADBUF_MIN_SIZE && buf_sym->pos + 1 >= buf_sym->filled) {
+				DPUTS("Symbol could not be resolved - past end\n");
+				return 3;
+			}
 
-				symattr &= 0xC0;
-				symattr >>= 6;
+			symattr = buf_sym->data[buf_sym->pos];
+			NEXTSYMPOS;
 
-				switch (symattr) {
-				case 0:
-					CPY16(curr_add, buf_sym.data[buf_sym.pos]);
+			sym_write_pos = symattr & 0x3F;
+
+			if (samechars > sym_write_pos) { //Ok, looks like we went past the symbol
+				DPUTS("Symbol could not be resolved - past same\n");
+				return 3;
+			} else if (samechars == sym_write_pos) {
+				while (1) { //Loop until we reach the Null-char
+					if (buf_sym->data[buf_sym->pos] != NAMECHAR) break;
+
+					if (NAMECHAR == '\0') {
+						DPUTS("FOUND!\n");
+						break; //Could take any of the two, as they are the same
+					}
+					//It is important that this comes afterwards! - It must point at the NULL
 					NEXTSYMPOS;
-					break;
-				case 1:
-					curr_add--;
-					curr_add -= buf_sym.data[buf_sym.pos];
-					break;
-				case 3:
-					curr_add += 0x0100;
-				case 2:
-					curr_add += buf_sym.data[buf_sym.pos];
-					break;
+					if (samechars >= prefix) buf_ml->pos++;
+					samechars++;
+
 				}
-				NEXTSYMPOS;
 
-				//DPRINTF("Checking: %i:%s - %x same: %i\n",buf_sym.data[0] & 0x3F , &(buf_sym.data[1]), curr_add, samechars);
+				if (buf_sym->data[buf_sym->pos] > NAMECHAR) { // We are searching for a symbol smaller then
+					// the current on. - They are sorted, therefore we will not find it anymore
 
-				//We've found the symbol, so let's break
-				if (buf_ml.data[buf_ml.pos] == '\0') {
-					//Move on to next symbol.
-					buf_ml.pos++;
-					break;
+					DPUTS("Symbol could not be resolved - past alpha\n");
+					return 3;
 				}
-			} //Loop searching for the symbol
 
-			((uint16_t *) (symvalp))[symctr] = curr_add; //copy the symbol address to memory
-			MALLOC_CHK(symvalp);
-		} //Loop looping through symbols
-	} // End of resolving symbol list.
+			}
+
+			while (buf_sym->data[buf_sym->pos] != '\0') NEXTSYMPOS;
+			NEXTSYMPOS; //one more!
+
+			symattr &= 0xC0;
+			symattr >>= 6;
+
+			switch (symattr) {
+			case 0:
+				//The value may straddle the end of the buffer
+				curr_add = buf_sym->data[buf_sym->pos];
+				NEXTSYMPOS;
+				curr_add |= (uint16_t) buf_sym->data[buf_sym->pos] << 8;
+#if MINILINK_ADDR20
+				NEXTSYMPOS;
+				curr_add |= (minilink_addr_t) buf_sym->data[buf_sym->pos] << 16;
+#endif
+				break;
+			case 1:
+				curr_add--;
+				curr_add -= buf_sym->data[buf_sym->pos];
+				break;
+			case 3:
+				curr_add += 0x0100;
+			case 2:
+				curr_add += buf_sym->data[buf_sym->pos];
+				break;
+			}
+			curr_add &= ML_SYMVAL_MASK;
+			NEXTSYMPOS;
+
+			//DPRINTF("Checking: %i:%s - %x same: %i\n",buf_sym->data[0] & 0x3F , &(buf_sym->data[1]), curr_add, samechars);
+
+			//We've found the symbol, so let's break
+			if (NAMECHAR == '\0') {
+				//Move on to next symbol.
+				buf_ml->pos++;
+				break;
+			}
+		} //Loop searching for the symbol
+
+		symvaltab[symctr] = curr_add; //copy the symbol address to memory
+	} //Loop looping through symbols
 #undef NEXTSYMPOS
+#undef NAMECHAR
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+/** Link the given file into flash ROM.
+ * \param programfile Filename containing program to load
+ * \param symtabfile  File containing the symbol table of the kernel
+ * \param process     Output for storing pointer to process structure
+ *                    of program
+ * \param resume      Journal record of an interrupted installation to
+ *                    continue, or NULL
+ * \param flags       ML_LOAD_* flags
+ * \param resolved    Imports resolved by minilink_load_many(), or NULL
+ * \return 0 on success, 1 if file was damaged or not found, 2 if not
+ *         enough memory, 3 if symbol could not be resolved
+ */
+static uint_fast8_t ml_load(const char *programfile, const char *symtabfile,
+		struct process ***proclist, const struct journal_rec_st *resume, uint8_t flags,
+		struct resolved_st *resolved) {
+	Minilink_Header mlhdr;
+	minilink_addr_t *symvalp = NULL;
+	Minilink_ProgramInfoHeader pihdr, *instprog = NULL;
+	struct journal_rec_st jrec;
+	struct ramprog_st *ramprog = NULL;
+	struct export_st *exports = NULL;
+	struct export_use_st *uses = NULL;
+	struct overlay_st *overlay = NULL;
+	struct reloc_info_st rinfo;
+	char *rom_start = freerom_start, *rom_end = freerom_end;
+	MemWriteFunc ramwrite = NULL;
+	int status = 1;
+
+	struct io_buf_st buf_ml;
+	struct io_buf_st buf_sym;
+
+	if (resume == NULL && resolved == NULL) {
+		status = ml_export_restore(symtabfile);
+		if (status != 0) return status;
+		status = 1;
+	}
+
+#if DEBUG_DIFF
+	void * memblock;
+	memblock = malloc(node_id * 40);
+#endif
+
+	LEDGOFF;
+	LEDBOFF;
+	LEDRON;
+	memset(&pihdr, 0, sizeof(pihdr));
+	memset(&jrec, 0, sizeof(jrec));
+	if (resume == NULL) journal_written = 0;
+
+	if (strlen(programfile) > MINILINK_MAX_FILENAME - 1) {
+
+		DPUTS("Name too long.\n");
+		return 1;
+	}
+
+	buf_ml.filled = 0;
+	buf_ml.pos = 0;
+	buf_ml.lz = NULL;
+	buf_sym.fd = -1;
+	buf_sym.lz = NULL;
+
+	LEDBON;
+	buf_ml.fd = cfs_open(programfile, CFS_READ);
+
+	if (buf_ml.fd < 0) {
+		DPUTS("Could not open File.");
+		goto cleanup;
+	}
+
+	LEDBOFF;
+
+	//Check whether the file is ok, the symbol table is checked once needed
+	if (resolved == NULL && ml_file_check(buf_ml.fd, MINILINK_PGM_MAGIC) != 1) {
+		DPUTS("Ret is not 1\n");
+		goto cleanup;
+	}
+	LEDGON;
+
+	//Reset
+	cfs_seek(buf_ml.fd, 0, CFS_SEEK_SET);
+	LEDBON;
+
+	//Read header, but do not write to buffer!
+	if (cfs_read(buf_ml.fd, &mlhdr, sizeof(mlhdr)) != sizeof(mlhdr)) {
+		DPUTS("Could not Read Header.");
+		goto cleanup;
+	}
+	if (mlhdr.version != MINILINK_PGM_VERSION) {
+		DPRINTF("Unsupported file version %i\n", mlhdr.version);
+		goto cleanup;
+	}
+
+	//Now let's get the ram for the target table, symbols go behind the entries
+	if (resolved != NULL) {
+		symvalp = resolved->symvals;
+		resolved->symvals = NULL;
+	} else {
+		symvalp = malloc((mlhdr.targets + mlhdr.symentries) * sizeof(*symvalp));
+	}
+	if (symvalp == NULL) {
+		DPUTS("Could not allocate memory for symtbl.");
+		status = 2;
+		goto cleanup;
+	}
+	rinfo.table = symvalp;
+	rinfo.tablesize = mlhdr.targets + mlhdr.symentries;
+	rinfo.symvaltab = symvalp + mlhdr.targets;
+	rinfo.symcount = mlhdr.symentries;
+	rinfo.pihdr = &pihdr;
+	rinfo.esc = mlhdr.escape;
+	rinfo.delta = mlhdr.delta;
+
+	//------------ Resolve the symbol-list. - This must be done anyway
+	if (resolved != NULL) {
+		uses = resolved->uses;
+		resolved->uses = NULL;
+		seek_iobuf(&buf_ml, resolved->listend);
+	} else {
+		status = ml_resolve_symbols(&buf_ml, &buf_sym, symtabfile, &mlhdr, rinfo.symvaltab, &uses);
+		if (status != 0) goto cleanup;
+	}
+	if (!(flags & MINILINK_LOAD_RAM)) {
+		status = ml_export_check_flash(uses);
+		if (status != 0) goto cleanup;
+		//Record of the program for eviction
+		overlay = ml_alloc_mem(sizeof(*overlay));
+		if (overlay == NULL) {
+			status = 2;
+			goto cleanup;
+		}
+	}
+	status = 1;
+	MALLOC_CHK(symvalp);
 	LEDGOFF;
 
+	//Parts of the program may be taken from the kernel
+	status = ml_check_kernel(&buf_ml, mlhdr.kchecks, &rinfo);
+	if (status != 0) {
+		DPUTS("Kernel does not match program.");
+		goto cleanup;
+	}
+	status = 1;
+
 	pihdr.magic = MINILINK_INST_MAGIC;
 	pihdr.crc = mlhdr.common.crc;
 	//pihdr.mem[DATA].ptr = NULL;
@@ -913,21 +2643,33 @@ uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, stru
 	pihdr.mem[MINILINK_TEXT].size = mlhdr.textsize;
 	strncpy(pihdr.sourcefile, programfile, MINILINK_MAX_FILENAME);
 
-	//Let's see whether the program is already installed
-	instprog = program_already_loaded(&pihdr);
+	if (resume != NULL) {
+		uint8_t ctr;
+		//Continue where the interrupted installation stopped
+		if (resume->crc != pihdr.crc || resume->size != mlhdr.textsize + sizeof(pihdr)) {
+			DPUTS("Journal does not match program.");
+			goto cleanup;
+		}
+		pihdr.mem[MINILINK_TEXT].ptr = (uint8_t *) resume->start + sizeof(pihdr);
+		for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
+			pihdr.mem[ctr].ptr = resume->ptr[ctr - 1];
+		}
+		pihdr.process = pihdr.mem[MINILINK_TEXT].ptr + mlhdr.processoffset;
+	} else {
+		//Let's see whether the program is already installed
+		instprog = program_already_loaded(&pihdr);
+	}
 
-	if (instprog != NULL) {
-		struct process * curproc;
+	if (resume != NULL) {
+		DPUTS("Resuming.");
+	} else if (instprog != NULL) {
 		/* Check if program to be reloaded has active processes, i.e. appears
 		 * in the process list
 		 */
-		for (curproc = process_list; curproc != NULL; curproc = curproc->next) {
-			if ((uintptr_t) (void*) curproc >= (uintptr_t)(instprog->mem[MINILINK_DATA].ptr)
-					&& (uintptr_t) (void*) curproc < (uintptr_t)(instprog->mem[MINILINK_DATA].ptr + instprog->mem[MINILINK_DATA].size)) {
-				puts("Process in use. Can't install.");
-				status = 2;
-				goto cleanup;
-			}
+		if (instprog_running(instprog) != NULL) {
+			puts("Process in use. Can't install.");
+			status = 2;
+			goto cleanup;
 		}
 
 		DPRINTF("Loading header from %x\n Data: %x\nBss: %x\n", (uint16_t ) instprog, (uint16_t)instprog->mem[MINILINK_DATA].ptr,
@@ -947,17 +2689,27 @@ uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, stru
 			goto cleanup;
 		}
 
-		pihdr.mem[MINILINK_TEXT].ptr = ml_alloc_text(pihdr.mem[MINILINK_TEXT].size + sizeof(pihdr));
-		if (pihdr.mem[MINILINK_TEXT].ptr == NULL) {
-			DPUTS("Could not alloc Text.");
-			goto cleanup;
-		}
-		pihdr.mem[MINILINK_TEXT].ptr += sizeof(pihdr);
-
-		//Allocate Memory; Starting beheind text
-		for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
+		if (flags & MINILINK_LOAD_RAM) {
+			ramprog = ml_alloc_mem(offsetof(struct ramprog_st, hdr) + sizeof(pihdr) + pihdr.mem[MINILINK_TEXT].size);
+			if (ramprog == NULL) {
+				DPUTS("Could not alloc Text in RAM.");
+				goto cleanup;
+			}
+			pihdr.mem[MINILINK_TEXT].ptr = (uint8_t *) &ramprog->hdr + sizeof(pihdr);
+		} else {
+			pihdr.mem[MINILINK_TEXT].ptr = ml_alloc_text(pihdr.mem[MINILINK_TEXT].size + sizeof(pihdr));
+			if (pihdr.mem[MINILINK_TEXT].ptr == NULL) {
+				DPUTS("Could not alloc Text.");
+				goto cleanup;
+			}
+			jrec.start = (char *) pihdr.mem[MINILINK_TEXT].ptr;
+			pihdr.mem[MINILINK_TEXT].ptr += sizeof(pihdr);
+		}
+
+		//Allocate Memory; Starting beheind text
+		for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
 			if (pihdr.mem[ctr].size) {
-				pihdr.mem[ctr].ptr = ml_alloc_mem(mlhdr.datasize);
+				pihdr.mem[ctr].ptr = ml_alloc_mem(pihdr.mem[ctr].size);
 				if (pihdr.mem[ctr].ptr == NULL) {
 					DPRINTF("Could not alloc Memory for %i\n", ctr);
 					goto cleanup;
@@ -980,54 +2732,129 @@ uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, stru
 	}
 	LEDBOFF;
 
+	//Section addresses are known now, resolve the target table
+	if (ml_load_targets(&buf_ml, mlhdr.targets, &rinfo) != 0) {
+		DPUTS("Could not read target table.");
+		status = 1;
+		goto cleanup;
+	}
+	//The import sites are only needed to relink the program in flash
+	if (mlhdr.sitesize) seek_iobuf(&buf_ml, tell_iobuf(&buf_ml) + mlhdr.sitesize);
+	if (mlhdr.exportsize) {
+		status = ml_load_exports(&buf_ml, mlhdr.exportsize, &rinfo, &exports);
+		if (status != 0) goto cleanup;
+		status = 1;
+	}
+
+	//The section data may be compressed
+	if ((mlhdr.flags & MINILINK_FLAG_LZ) && lz_start_iobuf(&buf_ml) != 0) {
+		DPUTS("Could not alloc decompressor.");
+		status = 2;
+		goto cleanup;
+	}
+
+	/* Everything the program needs is reserved now. Make sure the
+	 * relocations can be applied before anything is written.
+	 */
+	if (resume == NULL && ml_prescan(&buf_ml, &rinfo) != 0) {
+		status = 1;
+		goto cleanup;
+	}
+	if (flags & ML_LOAD_CHECK) {
+		DPUTS("Check OK.");
+		status = 0;
+		goto cleanup;
+	}
+
+	//RAM is set up later when resuming at boot time
+	if (resume != NULL) ramwrite = &memwrite_discard;
+
 	// Link data section
 	DPRINTF("\n\nRelocating DATA to %x len: %x\n", (uint16_t)pihdr.mem[MINILINK_DATA].ptr, (uint16_t)pihdr.mem[MINILINK_DATA].size);
-	status = ml_relocate(&buf_ml, pihdr.mem[MINILINK_DATA].size, pihdr.mem[MINILINK_DATA].ptr, symvalp, mlhdr.symentries, &pihdr, NULL);
+	status = ml_link_section(&buf_ml, MINILINK_DATA, &rinfo, ramwrite);
 	if (status != 0) goto cleanup;
 	MALLOC_CHK(symvalp);
 	// Link mig section
 	if (mlhdr.migsize) {
 		DPRINTF("\n\nRelocating MIG to %x len: %x\n", (uint16_t)pihdr.mem[MINILINK_MIG].ptr, (uint16_t)pihdr.mem[MINILINK_MIG].size);
-		status = ml_relocate(&buf_ml, pihdr.mem[MINILINK_MIG].size, pihdr.mem[MINILINK_MIG].ptr, symvalp, mlhdr.symentries, &pihdr, NULL);
+		status = ml_link_section(&buf_ml, MINILINK_MIG, &rinfo, ramwrite);
 		if (status != 0) goto cleanup;
 	}
 	MALLOC_CHK(symvalp);
 	// Link migptr section
 	if (mlhdr.migptrsize) {
 		DPRINTF("\n\nRelocating MIG to %x len: %x\n", (uint16_t)pihdr.mem[MINILINK_MIGPTR].ptr, (uint16_t)pihdr.mem[MINILINK_MIGPTR].size);
-		status = ml_relocate(&buf_ml, pihdr.mem[MINILINK_MIGPTR].size, pihdr.mem[MINILINK_MIGPTR].ptr, symvalp, mlhdr.symentries, &pihdr, NULL);
+		status = ml_link_section(&buf_ml, MINILINK_MIGPTR, &rinfo, ramwrite);
 		if (status != 0) goto cleanup;
 	}
 	MALLOC_CHK(symvalp);
 	//Set Bss to 0
-	if (mlhdr.bsssize) {
+	if (mlhdr.bsssize && resume == NULL) {
 		DPRINTF("\n\nClearing BSS at %x\n", (uint16_t) pihdr.mem[MINILINK_BSS].ptr);
 		memset(pihdr.mem[MINILINK_BSS].ptr, 0, pihdr.mem[MINILINK_BSS].size);
 	}
 
 	LEDGON;
-	if (instprog == NULL) {
-		DPRINTF("\n\nRelocating ROM to %x len: %x\n", (uint16_t) pihdr.mem[MINILINK_TEXT].ptr, (uint16_t ) mlhdr.textsize);
-		//Buf ML is positioned behind the symbol table
-		status = ml_relocate(&buf_ml, mlhdr.textsize, pihdr.mem[MINILINK_TEXT].ptr, symvalp, mlhdr.symentries, &pihdr, &memwrite_flash);
+	if (ramprog != NULL) {
+		DPRINTF("\n\nRelocating RAM text to %x len: %x\n", (uint16_t) pihdr.mem[MINILINK_TEXT].ptr, (uint16_t ) mlhdr.textsize);
+		status = ml_link_section(&buf_ml, MINILINK_TEXT, &rinfo, NULL);
 		if (status != 0) goto cleanup;
 		MALLOC_CHK(symvalp);
 
-		DPRINTF("\n\nWriting header to %x\n", (uint16_t)pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr));
-		memwrite_flash(pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr), &pihdr, sizeof(pihdr));
-		//if(memcmp(pTxt - sizeof(pihdr), &pihdr, sizeof(pihdr)) != 0) printf("\n\nPANIC!!!\n\n");
-		{
-			Minilink_ProgramInfoHeader *tmp, *tmp2;
-			tmp2 = &pihdr;
-			tmp = pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr);
-			//printf("PIHproc: %x - %x\n", (uint16_t)(tmp->process), (uint16_t)(tmp2->process));
+		memcpy(&ramprog->hdr, &pihdr, sizeof(pihdr));
+		ramprog->next = ramprog_list;
+		ramprog_list = ramprog;
+	} else if (instprog == NULL) {
+		uint8_t ctr;
+
+		if (resume == NULL) {
+			jrec.crc = pihdr.crc;
+			jrec.size = pihdr.mem[MINILINK_TEXT].size + sizeof(pihdr);
+			for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
+				jrec.ptr[ctr - 1] = pihdr.mem[ctr].ptr;
+			}
+			strncpy(jrec.sourcefile, programfile, MINILINK_MAX_FILENAME);
+			if (strlen(symtabfile) < MINILINK_MAX_FILENAME) {
+				strncpy(jrec.symtabfile, symtabfile, MINILINK_MAX_FILENAME);
+			}
+			journal_start(&jrec);
 		}
 
+		DPRINTF("\n\nRelocating ROM to %x len: %x\n", (uint16_t) pihdr.mem[MINILINK_TEXT].ptr, (uint16_t ) mlhdr.textsize);
+		//Buf ML is positioned behind the symbol table
+		status = ml_link_section(&buf_ml, MINILINK_TEXT, &rinfo, &memwrite_flash_journal);
+		if (status == 0 && journal_fail) status = 1;
 		if (status != 0) goto cleanup;
+		MALLOC_CHK(symvalp);
+
+		/* The magic is written last, so a partially written header is never
+		 * taken for a valid one.
+		 */
+		DPRINTF("\n\nWriting header to %x\n", (uint16_t)pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr));
+		memwrite_flash(pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr) + sizeof(pihdr.magic),
+				(uint8_t *) &pihdr + sizeof(pihdr.magic), sizeof(pihdr) - sizeof(pihdr.magic));
+		memwrite_flash(pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr), &pihdr.magic, sizeof(pihdr.magic));
+		journal_done();
 	}
 	LEDROFF;
 	LEDGOFF;
 
+	if (instprog == NULL) instprog = (Minilink_ProgramInfoHeader *) (pihdr.mem[MINILINK_TEXT].ptr - sizeof(pihdr));
+	if (overlay != NULL && INSTPROG_IN_FLASH(instprog) && overlay_of(instprog) == NULL) {
+		overlay->pih = instprog;
+		overlay->ownram = (jrec.start != NULL);
+		overlay->next = overlay_list;
+		overlay_list = overlay;
+		overlay = NULL;
+	}
+	//Programs loaded after this one may import from it now
+	ml_export_commit(&uses, instprog);
+	if (exports != NULL && ml_export_of(instprog) == NULL) {
+		exports->pih = instprog;
+		exports->next = export_list;
+		export_list = exports;
+		exports = NULL;
+	}
 	*proclist = pihdr.process;
 	DPUTS("Loading complete.");
 
@@ -1036,18 +2863,1033 @@ uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, stru
 	free(memblock);
 #endif
 	free(symvalp);
+	ml_free_mem(exports);
+	ml_free_mem(overlay);
+	ml_export_commit(&uses, NULL);
+	ml_free_mem(buf_ml.lz);
 	cfs_close(buf_ml.fd);
 	cfs_close(buf_sym.fd);
-	if (status != 0) {
+	//Release the reservations, unless they belong to an installed program
+	if ((status != 0 || (flags & ML_LOAD_CHECK)) && resume == NULL && instprog == NULL) {
 		uint8_t ctr;
 		//No flash
 		for (ctr = 1; ctr < MINILINK_SEC; ctr++) {
 			ml_free_mem(pihdr.mem[ctr].ptr);
 		}
+		ml_free_mem(ramprog);
+
+		//Give back the flash allocated for the program
+		if (jrec.start != NULL) {
+			if (journal_written) {
+				freerom_start = journal_reclaim(&jrec);
+			} else {
+				journal_done();
+				freerom_start = rom_start;
+				freerom_end = rom_end;
+			}
+		}
 	}
 
 	return status;
 }
+/*---------------------------------------------------------------------------*/
+/** Link the given file into flash ROM.
+ * \param programfile Filename containing program to load
+ * \param symtabfile  File containing the symbol table of the kernel
+ * \param process     Output for storing pointer to process structure
+ *                    of program
+ * \return 0 on success, 1 if file was damaged or not found, 2 if not
+ *         enough memory, 3 if symbol could not be resolved, the kernel
+ *         lacks code the program was built to use from it or the program
+ *         imports from a program in RAM
+ */
+uint_fast8_t minilink_load(const char *programfile, const char *symtabfile, struct process ***proclist) {
+	return ml_load(programfile, symtabfile, proclist, NULL, 0, NULL);
+}
+
+/** Link the given file, choosing where it is placed.
+ * With MINILINK_LOAD_RAM the text is placed in heap memory instead of
+ * flash. Such programs don't wear the flash and load faster, but are gone
+ * after a reset and take up RAM until minilink_unload() is called.
+ * \param programfile Filename containing program to load
+ * \param symtabfile  File containing the symbol table of the kernel
+ * \param process     Output for storing pointer to process structure
+ *                    of program
+ * \param flags       MINILINK_LOAD_* flags
+ * \return Same as minilink_load()
+ */
+uint_fast8_t minilink_load_flags(const char *programfile, const char *symtabfile, struct process ***proclist,
+		uint8_t flags) {
+	return ml_load(programfile, symtabfile, proclist, NULL, flags & MINILINK_LOAD_RAM, NULL);
+}
+
+/** Remove a program loaded to RAM and free its memory.
+ * Programs in flash stay until clean_minilink_space() is called.
+ * \param programfile Filename the program was loaded from
+ * \return 0 on success, 1 if no such program is in RAM, 2 if one of its
+ *         processes is still running or a loaded program imports from it
+ */
+uint_fast8_t minilink_unload(const char *programfile) {
+	struct ramprog_st **prev, *ramprog;
+	uint8_t ctr;
+
+	for (prev = &ramprog_list; *prev != NULL; prev = &(*prev)->next) {
+		if (!strncmp((*prev)->hdr.sourcefile, programfile, MINILINK_MAX_FILENAME)) break;
+	}
+	ramprog = *prev;
+	if (ramprog == NULL) return 1;
+	if (instprog_running(&ramprog->hdr) != NULL) {
+		puts("Process in use. Can't unload.");
+		return 2;
+	}
+	if (ml_export_users(&ramprog->hdr) != 0) {
+		puts("Program in use by others. Can't unload.");
+		return 2;
+	}
+
+	*prev = ramprog->next;
+	ml_export_release(&ramprog->hdr);
+	for (ctr = MINILINK_DATA; ctr < MINILINK_SEC; ctr++) {
+		ml_free_mem(ramprog->hdr.mem[ctr].ptr);
+	}
+	ml_free_mem(ramprog);
+	return 0;
+}
+
+/** Check whether a program could be loaded, without touching flash.
+ * Runs everything minilink_load() does up to the point where the first
+ * byte would be written: the files are verified, all imports resolved,
+ * RAM and flash reserved and all relocations decoded. The reservations
+ * are released afterwards.
+ * \param programfile Filename containing program to check
+ * \param symtabfile  File containing the symbol table of the kernel
+ * \return Same as minilink_load()
+ */
+uint_fast8_t minilink_check(const char *programfile, const char *symtabfile) {
+	return ml_load(programfile, symtabfile, NULL, NULL, ML_LOAD_CHECK, NULL);
+}
+
+/** Make sure a program is linked, loading it on demand.
+ * If the program is not resident, it is linked into flash. If the flash is
+ * full, the oldest programs, those at the start of the chain, are evicted
+ * until it fits. Eviction stops at the first program with running processes
+ * or programs importing from it.
+ * \param programfile Filename containing program to load
+ * \param symtabfile  File containing the symbol table of the kernel
+ * \param process     Output for storing pointer to process structure
+ *                    of program
+ * \return Same as minilink_load()
+ */
+uint_fast8_t minilink_require(const char *programfile, const char *symtabfile, struct process ***proclist) {
+	Minilink_ProgramInfoHeader pihdr, *instprog = NULL;
+	Minilink_Header mlhdr;
+	uint_fast8_t status;
+	int fd;
+
+	fd = cfs_open(programfile, CFS_READ);
+	if (fd < 0) return 1;
+	status = (cfs_read(fd, &mlhdr, sizeof(mlhdr)) == sizeof(mlhdr));
+	cfs_close(fd);
+
+	if (status) {
+		memset(&pihdr, 0, sizeof(pihdr));
+		pihdr.crc = mlhdr.common.crc;
+		pihdr.mem[MINILINK_TEXT].size = mlhdr.textsize;
+		strncpy(pihdr.sourcefile, programfile, MINILINK_MAX_FILENAME);
+		instprog = program_already_loaded(&pihdr);
+	}
+
+	/* Programs linked before the last reset have to be reloaded to set up
+	 * their RAM, unless they are running already.
+	 */
+	if (instprog != NULL && INSTPROG_IN_FLASH(instprog)
+			&& (overlay_of(instprog) != NULL || instprog_running(instprog) != NULL)) {
+		*proclist = instprog->process;
+		return 0;
+	}
+
+	//Evicting only helps if the flash is short, not the RAM
+	do {
+		freerom_short = 0;
+		status = ml_load(programfile, symtabfile, proclist, NULL, 0, NULL);
+	} while (status == 2 && freerom_short && overlay_evict() == 0);
+	return status;
+}
+
+/** Create a program file from an older version and a patch.
+ * The new file is written to CFS rather than linked directly, as the loader
+ * reads a program several times: to verify it, to resolve the imports and
+ * again whenever it is reloaded after a reset. Once the patch is applied the
+ * old file can be removed and the new one handed to minilink_load().
+ * \param oldfile   Program file the patch was made for
+ * \param patchfile File containing the patch
+ * \param newfile   File to create, must differ from oldfile
+ * \return 0 on success, 1 if a file was damaged or the patch does not match
+ *         the old file, 2 if there is not enough space for the new file
+ */
+uint_fast8_t minilink_patch(const char *oldfile, const char *patchfile, const char *newfile) {
+	Minilink_PatchHeader phdr;
+	Minilink_CommonHeader chdr;
+	struct io_buf_st buf_patch;
+	uint8_t copybuf[LOADBUF_MIN_SIZE];
+	uint8_t *src;
+	uint16_t cmd, len, chunk, written = 0;
+	int fd_old, fd_new = -1;
+	uint_fast8_t status = 1;
+
+	buf_patch.pos = buf_patch.filled = 0;
+	buf_patch.lz = NULL;
+	buf_patch.fd = cfs_open(patchfile, CFS_READ);
+	fd_old = cfs_open(oldfile, CFS_READ);
+
+	if (ml_file_check(buf_patch.fd, MINILINK_PATCH_MAGIC) != 1) {
+		DPUTS("Patch file damaged");
+		goto cleanup;
+	}
+	if (ml_file_check(fd_old, MINILINK_PGM_MAGIC) != 1) {
+		DPUTS("Program file damaged");
+		goto cleanup;
+	}
+
+	cfs_seek(buf_patch.fd, 0, CFS_SEEK_SET);
+	cfs_seek(fd_old, 0, CFS_SEEK_SET);
+	if (cfs_read(buf_patch.fd, &phdr, sizeof(phdr)) != sizeof(phdr)
+			|| cfs_read(fd_old, &chdr, sizeof(chdr)) != sizeof(chdr)) goto cleanup;
+	if (chdr.crc != phdr.oldcrc) {
+		DPRINTF("Patch is for %08lx, program is %08lx\n", phdr.oldcrc, chdr.crc);
+		goto cleanup;
+	}
+
+	cfs_remove(newfile);
+	if (cfs_coffee_reserve(newfile, phdr.newsize) < 0
+			|| (fd_new = cfs_open(newfile, CFS_WRITE)) < 0) {
+		status = 2;
+		goto cleanup;
+	}
+
+	seek_iobuf(&buf_patch, sizeof(phdr));
+	while (written < phdr.newsize) {
+		//Two numbers take up to six bytes
+		if (buf_patch.pos + 6 > buf_patch.filled) shift_iobuf(&buf_patch);
+		if (buf_patch.pos >= buf_patch.filled) goto cleanup;
+
+		cmd = ml_varint(&buf_patch);
+		len = cmd >> 1;
+		if (len > phdr.newsize - written) goto cleanup;
+		if (cmd & 1) cfs_seek(fd_old, ml_varint(&buf_patch), CFS_SEEK_SET);
+
+		while (len > 0) {
+			if (cmd & 1) {
+				chunk = Min(len, sizeof(copybuf));
+				if (cfs_read(fd_old, copybuf, chunk) != chunk) goto cleanup;
+				src = copybuf;
+			} else {
+				if (buf_patch.pos >= buf_patch.filled) shift_iobuf(&buf_patch);
+				chunk = Min(len, buf_patch.filled - buf_patch.pos);
+				if (chunk == 0) goto cleanup;
+				src = buf_patch.data + buf_patch.pos;
+				buf_patch.pos += chunk;
+			}
+			if (cfs_write(fd_new, src, chunk) != chunk) {
+				status = 2;
+				goto cleanup;
+			}
+			len -= chunk;
+			written += chunk;
+		}
+	}
+	cfs_close(fd_new);
+
+	//Make sure the result is what the patch was made to create
+	fd_new = cfs_open(newfile, CFS_READ);
+	if (ml_file_check(fd_new, MINILINK_PGM_MAGIC) != 1) goto cleanup;
+	cfs_seek(fd_new, 0, CFS_SEEK_SET);
+	if (cfs_read(fd_new, &chdr, sizeof(chdr)) != sizeof(chdr) || chdr.crc != phdr.newcrc) goto cleanup;
+	status = 0;
+
+	cleanup:
+	if (fd_new >= 0) cfs_close(fd_new);
+	if (status != 0 && fd_new >= 0) cfs_remove(newfile);
+	if (fd_old >= 0) cfs_close(fd_old);
+	if (buf_patch.fd >= 0) cfs_close(buf_patch.fd);
+	DPRINTF("Patch status: %i\n", status);
+	return status;
+}
+
+/** Read a symbol name up to its terminating zero into a buffer.
+ *
+ * \param b    I/O buffer positioned at the name
+ * \param name Buffer of MINILINK_SYMDELTA_NAMELEN chars, holding the chars
+ *             before pos already
+ * \param pos  Index to store the first char at
+ * \return Index of the first char which differs from the previous buffer
+ *         contents, MINILINK_SYMDELTA_NAMELEN if the name is broken
+ */
+static uint8_t ml_read_name(struct io_buf_st *b, char *name, uint8_t pos) {
+	uint8_t changed = MINILINK_SYMDELTA_NAMELEN;
+	char c;
+
+	do {
+		if (b->pos >= b->filled) shift_iobuf(b);
+		if (b->pos >= b->filled || pos >= MINILINK_SYMDELTA_NAMELEN) return MINILINK_SYMDELTA_NAMELEN;
+		c = b->data[b->pos++];
+		if (c != name[pos] && changed == MINILINK_SYMDELTA_NAMELEN) changed = pos;
+		name[pos++] = c;
+	} while (c != '\0');
+	return (changed == MINILINK_SYMDELTA_NAMELEN) ? pos - 1 : changed;
+}
+
+/** Decode the next entry of a symbol table.
+ *
+ * \param b    Buffer positioned at the entry
+ * \param name Name of the previous entry, replaced by the one read
+ * \param val  Value of the previous entry, replaced by the one read
+ * \return 0 on success, 1 if the table ends or is damaged
+ */
+static uint_fast8_t ml_next_symbol(struct io_buf_st *b, char *name, minilink_addr_t *val) {
+	uint8_t attr;
+
+	if (b->pos >= b->filled) shift_iobuf(b);
+	if (b->pos >= b->filled) return 1;
+	attr = b->data[b->pos++];
+	if ((attr & 0x3F) > strlen(name)
+			|| ml_read_name(b, name, attr & 0x3F) >= MINILINK_SYMDELTA_NAMELEN) return 1;
+	if (b->pos + 3 > b->filled) shift_iobuf(b);
+	if (b->pos + ((attr >> 6) ? 1 : 2 + MINILINK_ADDR20) > b->filled) return 1;
+	switch (attr >> 6) {
+	case 0:
+		*val = b->data[b->pos] | ((uint16_t) b->data[b->pos + 1] << 8);
+		b->pos += 2;
+#if MINILINK_ADDR20
+		*val |= (minilink_addr_t) b->data[b->pos++] << 16;
+#endif
+		break;
+	case 1:
+		*val -= 1 + b->data[b->pos++];
+		break;
+	case 2:
+		*val += b->data[b->pos++];
+		break;
+	default:
+		*val += 0x100 + b->data[b->pos++];
+		break;
+	}
+	*val &= ML_SYMVAL_MASK;
+	return 0;
+}
+
+/** Append an entry to a symbol table, coded like mksymtab does.
+ *
+ * \param fd      File to write to
+ * \param name    Name of the symbol
+ * \param same    Number of chars shared with the previous name
+ * \param val     Value of the symbol
+ * \param lastval Value of the previous symbol, updated
+ * \return 0 on success, 2 if the file is full
+ */
+static uint_fast8_t ml_put_symbol(int fd, const char *name, uint8_t same, minilink_addr_t val,
+		minilink_addr_t *lastval) {
+	uint8_t attr, code[3], codelen = 1;
+	int16_t offset = val - *lastval;
+	int len;
+
+	if (same > 63) same = 63;
+	if ((int32_t) val - (int32_t) *lastval < -0x100 || (int32_t) val - (int32_t) *lastval > 0x1FF) {
+		attr = 0;
+		code[0] = val & 0xFF;
+		code[1] = (val >> 8) & 0xFF;
+		codelen = 2;
+#if MINILINK_ADDR20
+		code[codelen++] = val >> 16;
+#endif
+	} else if (offset < 0) {
+		attr = 1 << 6;
+		code[0] = -offset - 1;
+	} else if (offset < 0x100) {
+		attr = 1 << 7;
+		code[0] = offset;
+	} else {
+		attr = (1 << 7) | (1 << 6);
+		code[0] = offset - 0x100;
+	}
+	*lastval = val;
+
+	attr |= same;
+	len = strlen(name + same) + 1;
+	if (cfs_write(fd, &attr, 1) != 1 || cfs_write(fd, name + same, len) != len
+			|| cfs_write(fd, code, codelen) != codelen) return 2;
+	return 0;
+}
+
+/** Update the symbol table after the kernel was replaced.
+ * Instead of the new symbol table only the differences to the old one are
+ * sent: most symbols keep their name and move along with the code around
+ * them. The new table is written to CFS and checked against the checksum
+ * of the table the delta was made from. Modules linked against the old
+ * kernel have to be relinked.
+ * \param oldfile   Symbol table of the old kernel
+ * \param deltafile File containing the delta, created by mkmlpatch
+ * \param newfile   File to create, must differ from oldfile
+ * \return 0 on success, 1 if a file was damaged or the delta does not match
+ *         the old symbol table, 2 if there is not enough memory or space for
+ *         the new file
+ */
+uint_fast8_t minilink_symtab_update(const char *oldfile, const char *deltafile, const char *newfile) {
+	Minilink_SymDeltaHeader dhdr;
+	Minilink_SymbolHeader shdr;
+	struct io_buf_st buf_delta, buf_old;
+	char oldname[MINILINK_SYMDELTA_NAMELEN], newname[MINILINK_SYMDELTA_NAMELEN];
+	minilink_addr_t *shifts = NULL;
+	minilink_addr_t oldval = 0, newval = 0, val;
+	uint16_t shiftcount, ctr, cmd, same;
+	uint8_t attr;
+	int fd_new = -1;
+	uint_fast8_t status = 1;
+
+	buf_delta.pos = buf_delta.filled = 0;
+	buf_delta.lz = NULL;
+	buf_delta.fd = cfs_open(deltafile, CFS_READ);
+	buf_old.pos = buf_old.filled = 0;
+	buf_old.lz = NULL;
+	buf_old.fd = cfs_open(oldfile, CFS_READ);
+
+	if (ml_file_check(buf_delta.fd, MINILINK_SYMDELTA_MAGIC) != 1) {
+		DPUTS("Delta file damaged");
+		goto cleanup;
+	}
+	if (ml_file_check(buf_old.fd, MINILINK_SYM_MAGIC) != 1) {
+		DPUTS("Symbol table damaged");
+		goto cleanup;
+	}
+
+	cfs_seek(buf_delta.fd, 0, CFS_SEEK_SET);
+	cfs_seek(buf_old.fd, 0, CFS_SEEK_SET);
+	if (cfs_read(buf_delta.fd, &dhdr, sizeof(dhdr)) != sizeof(dhdr)
+			|| cfs_read(buf_old.fd, &shdr, sizeof(shdr)) != sizeof(shdr)) goto cleanup;
+	if (shdr.common.crc != dhdr.oldcrc) {
+		DPRINTF("Delta is for %08lx, symbol table is %08lx\n", dhdr.oldcrc, shdr.common.crc);
+		goto cleanup;
+	}
+	if (shdr.flags != ML_SYMFLAGS) {
+		DPRINTF("Symbol table flags are %x should be %x\n", shdr.flags, ML_SYMFLAGS);
+		goto cleanup;
+	}
+
+	//Pairs of first old address and shift
+	seek_iobuf(&buf_delta, sizeof(dhdr));
+	shiftcount = ml_varint(&buf_delta);
+	if (shiftcount) {
+		shifts = malloc(shiftcount * 2 * sizeof(*shifts));
+		if (shifts == NULL) {
+			status = 2;
+			goto cleanup;
+		}
+	}
+	for (ctr = 0; ctr < shiftcount; ctr++) {
+		if (buf_delta.pos + 6 > buf_delta.filled) shift_iobuf(&buf_delta);
+		if (buf_delta.pos >= buf_delta.filled) goto cleanup;
+		shifts[2 * ctr] = ml_varint(&buf_delta) + (ctr ? shifts[2 * ctr - 2] : 0);
+		val = ml_varint(&buf_delta);
+		shifts[2 * ctr + 1] = (val >> 1) ^ -(val & 1);
+	}
+
+	cfs_remove(newfile);
+	if (cfs_coffee_reserve(newfile, dhdr.newsize) < 0
+			|| (fd_new = cfs_open(newfile, CFS_WRITE)) < 0) {
+		status = 2;
+		goto cleanup;
+	}
+
+	//The dictionary stays the same
+	shdr.common.crc = dhdr.newcrc;
+	shdr.kernelchksum = dhdr.kernelchksum;
+	if (cfs_write(fd_new, &shdr, sizeof(shdr)) != sizeof(shdr)) {
+		status = 2;
+		goto cleanup;
+	}
+	seek_iobuf(&buf_old, sizeof(shdr));
+	for (ctr = shdr.dictsize; ctr > 0; ctr -= val) {
+		if (buf_old.pos >= buf_old.filled) shift_iobuf(&buf_old);
+		val = Min(ctr, buf_old.filled - buf_old.pos);
+		if (val == 0) goto cleanup;
+		if (cfs_write(fd_new, buf_old.data + buf_old.pos, val) != val) {
+			status = 2;
+			goto cleanup;
+		}
+		buf_old.pos += val;
+	}
+
+	oldname[0] = newname[0] = '\0';
+	while (1) {
+		if (buf_delta.pos + 3 > buf_delta.filled) shift_iobuf(&buf_delta);
+		if (buf_delta.pos >= buf_delta.filled) goto cleanup;
+		cmd = ml_varint(&buf_delta);
+
+		if ((cmd & 3) == MINILINK_SYMDELTA_ADD) {
+			same = ml_read_name(&buf_delta, newname, 0);
+			if (same >= MINILINK_SYMDELTA_NAMELEN) goto cleanup;
+			if (buf_delta.pos + 3 > buf_delta.filled) shift_iobuf(&buf_delta);
+			if (buf_delta.pos >= buf_delta.filled) goto cleanup;
+			status = ml_put_symbol(fd_new, newname, same, ml_varint(&buf_delta), &newval);
+			if (status) goto cleanup;
+			status = 1;
+			continue;
+		}
+		if (cmd == MINILINK_SYMDELTA_KEEP) break;
+		if ((cmd & 3) > MINILINK_SYMDELTA_DROP) goto cleanup;
+
+		for (ctr = cmd >> 2; ctr > 0; ctr--) {
+			if (ml_next_symbol(&buf_old, oldname, &oldval) != 0) goto cleanup;
+			if ((cmd & 3) == MINILINK_SYMDELTA_DROP) continue;
+
+			//Move the symbol along with the addresses around it
+			for (same = shiftcount; same > 0 && shifts[2 * same - 2] > oldval; same--);
+			val = (oldval + (same ? shifts[2 * same - 1] : 0)) & ML_SYMVAL_MASK;
+
+			for (same = 0; oldname[same] != '\0' && oldname[same] == newname[same]; same++);
+			strcpy(newname, oldname);
+			status = ml_put_symbol(fd_new, newname, same, val, &newval);
+			if (status) goto cleanup;
+			status = 1;
+		}
+	}
+
+	//Last byte must not be zero for CFS to find the end of the file
+	attr = 0xFF;
+	if (cfs_write(fd_new, &attr, 1) != 1) {
+		status = 2;
+		goto cleanup;
+	}
+	cfs_close(fd_new);
+
+	//Make sure the result is what the delta was made to create
+	fd_new = cfs_open(newfile, CFS_READ);
+	if (ml_file_check(fd_new, MINILINK_SYM_MAGIC) != 1) goto cleanup;
+	cfs_seek(fd_new, 0, CFS_SEEK_SET);
+	if (cfs_read(fd_new, &shdr, sizeof(shdr)) != sizeof(shdr) || shdr.common.crc != dhdr.newcrc) goto cleanup;
+	status = 0;
+
+	cleanup:
+	free(shifts);
+	if (fd_new >= 0) cfs_close(fd_new);
+	if (status != 0 && fd_new >= 0) cfs_remove(newfile);
+	if (buf_old.fd >= 0) cfs_close(buf_old.fd);
+	if (buf_delta.fd >= 0) cfs_close(buf_delta.fd);
+	DPRINTF("Symbol table update status: %i\n", status);
+	return status;
+}
+
+/** Flash segment rewritten by minilink_relink_all() */
+struct relink_st {
+	char *seg;    /**< Segment held in buf, NULL if none */
+	uint8_t *buf; /**< New contents of the segment */
+};
+
+/** Erase the segment held in the buffer and write it back. */
+static void ml_relink_flush(struct relink_st *rl) {
+	if (rl->seg == NULL) return;
+	DPRINTF("Rewriting segment %x\n", (uint16_t)(uintptr_t) rl->seg);
+	erasesegment_flash(rl->seg);
+	wear_log_append(WEARLOG_ERASE | wear_segment_idx(rl->seg));
+	memwrite_flash(rl->seg, rl->buf, ROM_ERASE_UNIT_SIZE);
+	rl->seg = NULL;
+}
+
+/** Change a byte in flash. Bits are cleared in place, only if one has to
+ * be set the segment is read into the buffer. It is erased once the
+ * changes move on to another segment.
+ */
+static void ml_relink_byte(struct relink_st *rl, uint8_t *addr, uint8_t val) {
+	char *seg = (char *) ALIGN_ROM_PREV((uintptr_t) addr);
+	uint16_t *word = (uint16_t *) ((uintptr_t) addr & ~1);
+	uint16_t tmp;
+
+	if (seg == rl->seg) {
+		rl->buf[(char *) addr - seg] = val;
+		return;
+	}
+	if (*addr == val) return;
+	if ((*addr & val) == val) {
+		tmp = *word;
+		((uint8_t *) &tmp)[(uintptr_t) addr & 1] = val;
+		memwrite_flash(word, &tmp, sizeof(tmp));
+		return;
+	}
+	ml_relink_flush(rl);
+	memcpy(rl->buf, seg, ROM_ERASE_UNIT_SIZE);
+	rl->seg = seg;
+	rl->buf[(char *) addr - seg] = val;
+}
+
+/** Get a byte in flash as changed by ml_relink_byte(). */
+static uint8_t ml_relink_get(struct relink_st *rl, uint8_t *addr) {
+	char *seg = (char *) ALIGN_ROM_PREV((uintptr_t) addr);
+
+	return (seg == rl->seg) ? rl->buf[(char *) addr - seg] : *addr;
+}
+
+/** Relink the text of an installed program against the symbol table.
+ * \param pih        Header of the program
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param rl         Segment buffer
+ * \return 0 on success, 1 if the program file is damaged or is not the
+ *         installed program, 2 if not enough memory, 3 if the program keeps
+ *         no import sites, a symbol could not be resolved or the kernel
+ *         lacks code the program uses from it
+ */
+static uint_fast8_t ml_relink(Minilink_ProgramInfoHeader *pih, const char *symtabfile, struct relink_st *rl) {
+	Minilink_Header mlhdr;
+	struct io_buf_st buf_ml, buf_sym;
+	struct reloc_info_st rinfo;
+	minilink_addr_t *symvalp = NULL;
+	minilink_addr_t val;
+	uint16_t count, id, addend, word;
+	struct export_use_st *uses = NULL;
+	uint8_t *site, *end, *high;
+	uint8_t form, len;
+	uint_fast8_t status = 1;
+
+	buf_ml.pos = buf_ml.filled = 0;
+	buf_ml.lz = NULL;
+	buf_sym.fd = -1;
+	buf_sym.lz = NULL;
+	buf_ml.fd = cfs_open(pih->sourcefile, CFS_READ);
+
+	if (ml_file_check(buf_ml.fd, MINILINK_PGM_MAGIC) != 1) {
+		DPRINTF("Program file %s damaged\n", pih->sourcefile);
+		goto cleanup;
+	}
+	cfs_seek(buf_ml.fd, 0, CFS_SEEK_SET);
+	if (cfs_read(buf_ml.fd, &mlhdr, sizeof(mlhdr)) != sizeof(mlhdr)
+			|| mlhdr.version != MINILINK_PGM_VERSION || mlhdr.common.crc != pih->crc) {
+		DPUTS("Program file does not match installed program");
+		goto cleanup;
+	}
+	if (mlhdr.sitesize == 0) {
+		DPUTS("Program keeps no import sites");
+		status = 3;
+		goto cleanup;
+	}
+
+	symvalp = malloc((mlhdr.targets + mlhdr.symentries) * sizeof(*symvalp));
+	if (symvalp == NULL) {
+		status = 2;
+		goto cleanup;
+	}
+	rinfo.table = symvalp;
+	rinfo.tablesize = mlhdr.targets + mlhdr.symentries;
+	rinfo.symvaltab = symvalp + mlhdr.targets;
+	rinfo.symcount = mlhdr.symentries;
+	rinfo.pihdr = pih;
+	rinfo.esc = mlhdr.escape;
+	rinfo.delta = mlhdr.delta;
+
+	status = ml_resolve_symbols(&buf_ml, &buf_sym, symtabfile, &mlhdr, rinfo.symvaltab, &uses);
+	if (status == 0) status = ml_export_check_flash(uses);
+	if (status != 0) goto cleanup;
+	status = ml_check_kernel(&buf_ml, mlhdr.kchecks, &rinfo);
+	if (status != 0) goto cleanup;
+	status = 1;
+	if (ml_load_targets(&buf_ml, mlhdr.targets, &rinfo) != 0) goto cleanup;
+
+	if (buf_ml.pos + 3 > buf_ml.filled) shift_iobuf(&buf_ml);
+	count = ml_varint(&buf_ml);
+	site = pih->mem[MINILINK_TEXT].ptr;
+	end = site + pih->mem[MINILINK_TEXT].size;
+	while (count--) {
+		//Three numbers and the form take up to ten bytes
+		if (buf_ml.pos + 10 > buf_ml.filled) shift_iobuf(&buf_ml);
+		if (buf_ml.pos >= buf_ml.filled) goto cleanup;
+		site += ml_varint(&buf_ml);
+		id = ml_varint(&buf_ml);
+		form = (id & 2) ? buf_ml.data[buf_ml.pos++] : 0;
+		len = (id & 2) ? ml_wide_len(form) : 2;
+		addend = ml_varint(&buf_ml);
+		high = site - ((len == 2) ? MINILINK_WIDE_BACK(form) : 0);
+		if ((id >> 2) >= mlhdr.symentries || len == 0 || site + len > end
+				|| high < (uint8_t *) pih->mem[MINILINK_TEXT].ptr) {
+			DPRINTF("Bad import site %x\n", (uint16_t)(uintptr_t) site);
+			goto cleanup;
+		}
+
+		val = rinfo.symvaltab[id >> 2] + ML_ZIGZAG(addend);
+		if (id & 1) {
+			val -= (uintptr_t) site;
+		} else if (!(id & 2) && !ML_WORD_REACH(val)) {
+			DPRINTF("Import site %x out of reach\n", (uint16_t)(uintptr_t) site);
+			goto cleanup;
+		}
+		ml_relink_byte(rl, site, val & 0xFF);
+		ml_relink_byte(rl, site + 1, (val >> 8) & 0xFF);
+		if (len == 4) {
+			word = (uint32_t) val >> 16;
+			ml_relink_byte(rl, site + 2, word & 0xFF);
+			ml_relink_byte(rl, site + 3, word >> 8);
+		} else if (high != site) {
+			word = ml_relink_get(rl, high) | (uint16_t) ml_relink_get(rl, high + 1) << 8;
+			word = ml_wide_high(word, form, val);
+			ml_relink_byte(rl, high, word & 0xFF);
+			ml_relink_byte(rl, high + 1, word >> 8);
+		}
+	}
+	status = 0;
+	ml_export_commit(&uses, pih);
+
+	cleanup:
+	ml_export_commit(&uses, NULL);
+	free(symvalp);
+	cfs_close(buf_ml.fd);
+	cfs_close(buf_sym.fd);
+	return status;
+}
+
+/** Relink the programs installed in flash after the kernel was updated.
+ * The places in the code that refer to the kernel are rewritten for the
+ * new symbol table, the rest of the programs stays as it is. This needs
+ * the program files to be built with mkminimod -r. If power fails while a
+ * segment is rewritten, the programs in it are lost. Programs that could
+ * not be relinked must be installed again after clean_minilink_space().
+ * \param symtabfile File containing the symbol table of the new kernel
+ * \return 0 if all programs were relinked, otherwise the status of the
+ *         first one that failed: 1 if its file is missing or damaged, 2 if
+ *         it is running or there is not enough memory, 3 if it keeps no
+ *         import sites, a symbol could not be resolved or the kernel lacks
+ *         code the program uses from it
+ */
+uint_fast8_t minilink_relink_all(const char *symtabfile) {
+	struct relink_st rl;
+	Minilink_ProgramInfoHeader *pih;
+	uint_fast8_t status, retval = 0;
+
+	rl.seg = NULL;
+	rl.buf = malloc(ROM_ERASE_UNIT_SIZE);
+	if (rl.buf == NULL) return 2;
+	retval = ml_export_restore(symtabfile);
+
+	for (pih = instprog_next(NULL); pih != NULL && INSTPROG_IN_FLASH(pih); pih = instprog_next(pih)) {
+		if (instprog_running(pih) != NULL) {
+			DPRINTF("%s is running\n", pih->sourcefile);
+			status = 2;
+		} else {
+			status = ml_relink(pih, symtabfile, &rl);
+		}
+		DPRINTF("Relinked %s: %i\n", pih->sourcefile, status);
+		if (retval == 0) retval = status;
+	}
+	ml_relink_flush(&rl);
+	free(rl.buf);
+	return retval;
+}
+
+/** Program of minilink_load_many() */
+struct batch_st {
+	struct io_buf_st buf;     /**< Positioned behind the current import */
+	Minilink_Header hdr;
+	struct resolved_st res;
+	uint16_t next;            /**< Index of the current import */
+	char name[MINILINK_SYMDELTA_NAMELEN]; /**< Name of the current import */
+};
+
+/** Read the imports of a program up to the next one which has to be looked
+ * up in the symbol table.
+ * \param b Program, b->next is set to the index of the import or to the
+ *          number of imports if there is none left
+ * \return 0 on success, 1 if the file is damaged, 2 if not enough memory
+ */
+static uint_fast8_t ml_batch_next(struct batch_st *b) {
+	minilink_addr_t *vals = b->res.symvals + b->hdr.targets;
+	uint_fast8_t status;
+	uint8_t same;
+
+	for (; b->next < b->hdr.symentries; b->next++) {
+		if (b->buf.pos >= b->buf.filled) shift_iobuf(&b->buf);
+		if (b->buf.pos >= b->buf.filled) return 1;
+		same = b->buf.data[b->buf.pos++];
+		if (same > strlen(b->name) || ml_read_name(&b->buf, b->name, same) >= MINILINK_SYMDELTA_NAMELEN) return 1;
+
+		status = ml_export_lookup(b->name, &vals[b->next], &b->res.uses);
+		if (status == 2) return 2;
+#if MINILINK_HOT_SYMBOLS
+		if (status != 0) status = ml_hot_lookup(b->name, &vals[b->next]);
+#endif
+		if (status != 0) return 0;
+	}
+	b->res.listend = tell_iobuf(&b->buf);
+	return 0;
+}
+
+/** Open a program of minilink_load_many() and read its first imports.
+ * \return Same as minilink_load()
+ */
+static uint_fast8_t ml_batch_open(struct batch_st *b, const char *programfile) {
+	b->buf.fd = cfs_open(programfile, CFS_READ);
+	if (ml_file_check(b->buf.fd, MINILINK_PGM_MAGIC) != 1) {
+		DPRINTF("Program file %s damaged\n", programfile);
+		return 1;
+	}
+	cfs_seek(b->buf.fd, 0, CFS_SEEK_SET);
+	if (cfs_read(b->buf.fd, &b->hdr, sizeof(b->hdr)) != sizeof(b->hdr)
+			|| b->hdr.version != MINILINK_PGM_VERSION) return 1;
+
+	b->res.symvals = malloc((b->hdr.targets + b->hdr.symentries) * sizeof(*b->res.symvals));
+	if (b->res.symvals == NULL) return 2;
+
+	if (b->hdr.flags & MINILINK_FLAG_ABI) {
+#if MINILINK_ABI_TABLE
+		b->next = b->hdr.symentries;
+		if (ml_abi_symbols(&b->buf, b->hdr.symentries, b->res.symvals + b->hdr.targets) != 0) return 3;
+		b->res.listend = tell_iobuf(&b->buf);
+		return 0;
+#else
+		DPUTS("Kernel has no export table\n");
+		return 3;
+#endif
+	}
+	return ml_batch_next(b);
+}
+
+/** Link several programs into flash ROM, resolving their imports together.
+ * The symbol table is checked and read once for all programs: their sorted
+ * import lists are merged while walking the table. The programs are linked
+ * in the given order afterwards. They can import from programs loaded
+ * before the call. The exports of a program in the batch are not visible
+ * to the programs behind it: such imports fail with status 3, load these
+ * programs with separate calls instead.
+ * \param programfiles Filenames containing the programs to load
+ * \param count        Number of programs. All of their files and the symbol
+ *                     table are open at the same time, so CFS must allow
+ *                     count + 1 open files.
+ * \param symtabfile   File containing the symbol table of the kernel
+ * \param proclists    Output for storing pointers to the process structures
+ *                     of the programs
+ * \return Same as minilink_load(). If a program fails, the ones before it
+ *         stay loaded and the ones behind it are not loaded.
+ */
+uint_fast8_t minilink_load_many(const char * const *programfiles, uint8_t count, const char *symtabfile,
+		struct process ***proclists) {
+	struct batch_st *batch, *b, *min;
+	struct io_buf_st buf_sym;
+	char tabname[MINILINK_SYMDELTA_NAMELEN];
+	minilink_addr_t tabval = 0;
+	uint16_t dictionary = 0;
+	uint_fast8_t status = 2;
+	uint8_t ctr;
+	int cmp;
+
+	buf_sym.fd = -1;
+	buf_sym.lz = NULL;
+	tabname[0] = '\0';
+
+	if (count == 0) return 0;
+	status = ml_export_restore(symtabfile);
+	if (status != 0) return status;
+	batch = malloc(count * sizeof(*batch));
+	if (batch == NULL) return 2;
+	memset(batch, 0, count * sizeof(*batch));
+	for (b = batch; b < batch + count; b++) b->buf.fd = -1;
+
+	for (ctr = 0; ctr < count; ctr++) {
+		status = ml_batch_open(&batch[ctr], programfiles[ctr]);
+		if (status != 0) goto cleanup;
+	}
+
+	while (1) {
+		//The smallest name still to be looked up
+		min = NULL;
+		for (b = batch; b < batch + count; b++) {
+			if (b->next < b->hdr.symentries && (min == NULL || strcmp(b->name, min->name) < 0)) min = b;
+		}
+		if (min == NULL) break;
+
+		if (buf_sym.fd < 0) {
+			dictionary = min->hdr.dictionary;
+			status = ml_open_symtab(&buf_sym, symtabfile, dictionary);
+			if (status != 0) goto cleanup;
+		} else if (min->hdr.dictionary != dictionary) {
+			status = 3;
+			goto cleanup;
+		}
+
+		//The table is sorted as well, so it is only read once
+		while ((cmp = strcmp(tabname, min->name)) < 0) {
+			if (ml_next_symbol(&buf_sym, tabname, &tabval) != 0) break;
+		}
+		if (cmp != 0) {
+			DPRINTF("Symbol %s could not be resolved\n", min->name);
+			status = 3;
+			goto cleanup;
+		}
+
+		for (b = batch; b < batch + count; b++) {
+			if (b->next >= b->hdr.symentries || strcmp(b->name, tabname) != 0) continue;
+			b->res.symvals[b->hdr.targets + b->next++] = tabval;
+			status = ml_batch_next(b);
+			if (status != 0) goto cleanup;
+		}
+	}
+	cfs_close(buf_sym.fd);
+	buf_sym.fd = -1;
+
+	for (ctr = 0; ctr < count; ctr++) {
+		cfs_close(batch[ctr].buf.fd);
+		batch[ctr].buf.fd = -1;
+		status = ml_load(programfiles[ctr], symtabfile, &proclists[ctr], NULL, 0, &batch[ctr].res);
+		if (status != 0) break;
+	}
+
+	cleanup:
+	for (b = batch; b < batch + count; b++) {
+		cfs_close(b->buf.fd);
+		free(b->res.symvals);
+		ml_export_commit(&b->res.uses, NULL);
+	}
+	cfs_close(buf_sym.fd);
+	free(batch);
+	DPRINTF("Batch load status: %i\n", status);
+	return status;
+}
+
+/** Name looked up by minilink_lookup_many() */
+struct lookup_st {
+	char code[MINILINK_SYMDELTA_NAMELEN]; /**< Name coded like the symbol table */
+	uint8_t pending;                      /**< Still to be looked up in the table */
+};
+
+/** Code a name with the dictionary of the symbol table, the way mksymtab
+ * does: the longest entry matching at each position is replaced.
+ * \param name     Name to code
+ * \param dict     Entries of the dictionary, each with its NUL
+ * \param dictsize Size of the dictionary
+ * \param code     Output of MINILINK_SYMDELTA_NAMELEN chars
+ * \return 0 on success, 1 if the name is empty or can not be coded
+ */
+static uint_fast8_t ml_code_name(const char *name, const char *dict, uint16_t dictsize, char *code) {
+	const char *entry;
+	uint8_t pos = 0, idx, best, bestlen;
+	size_t len;
+
+	if (*name == '\0') return 1;
+	while (*name) {
+		if ((uint8_t) *name >= MINILINK_DICT_TOKEN || pos + 1 >= MINILINK_SYMDELTA_NAMELEN) return 1;
+		best = 0;
+		bestlen = 1;
+		for (entry = dict, idx = 0; entry < dict + dictsize; entry += len + 1, idx++) {
+			len = strlen(entry);
+			if (len > bestlen && strncmp(name, entry, len) == 0) {
+				best = MINILINK_DICT_TOKEN + idx;
+				bestlen = len;
+			}
+		}
+		code[pos++] = best ? best : *name;
+		name += bestlen;
+	}
+	code[pos] = '\0';
+	return 0;
+}
+
+/** Look symbols up by name, the way the imports of programs are resolved:
+ * in the export tables of the loaded programs, in the hot tier and in the
+ * symbol table of the kernel. The table is read once for all names.
+ * \param names      Names of the symbols
+ * \param count      Number of names
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param addrs      Output for the values of the symbols. A value exported
+ *                   by a program stays valid as long as it is loaded.
+ * \return 0 if all symbols were found, 1 if the symbol table is missing or
+ *         damaged, 2 if not enough memory, 3 if a symbol was not found.
+ *         The values of the symbols found are set anyway.
+ */
+uint_fast8_t minilink_lookup_many(const char * const *names, uint16_t count, const char *symtabfile,
+		minilink_addr_t *addrs) {
+	Minilink_SymbolHeader symhdr;
+	struct io_buf_st buf_sym;
+	struct lookup_st *names_c = NULL, *l, *min;
+	struct export_use_st *uses = NULL;
+	char tabname[MINILINK_SYMDELTA_NAMELEN];
+	char *dict = NULL;
+	minilink_addr_t tabval = 0;
+	uint_fast8_t status = 1, found, missing = 0;
+	uint16_t ctr;
+	int cmp;
+
+	buf_sym.lz = NULL;
+	tabname[0] = '\0';
+
+	if (count == 0) return 0;
+	//The dictionary is needed to code the names first
+	if (ml_read_symtab_header(&buf_sym, symtabfile, &symhdr) != 0) goto cleanup;
+	status = 2;
+	names_c = malloc(count * sizeof(*names_c));
+	dict = malloc(symhdr.dictsize + 1);
+	if (names_c == NULL || dict == NULL) goto cleanup;
+	status = 1;
+	if (cfs_read(buf_sym.fd, dict, symhdr.dictsize) != symhdr.dictsize) goto cleanup;
+	seek_iobuf(&buf_sym, sizeof(symhdr) + symhdr.dictsize);
+
+	for (ctr = 0; ctr < count; ctr++) {
+		l = &names_c[ctr];
+		l->pending = 0;
+		if (ml_code_name(names[ctr], dict, symhdr.dictsize, l->code) != 0) {
+			DPRINTF("Name %s can not be coded\n", names[ctr]);
+			missing = 1;
+			continue;
+		}
+		//Programs loaded before take precedence over the kernel
+		found = ml_export_lookup(l->code, &addrs[ctr], &uses);
+		if (found == 2) {
+			status = 2;
+			goto cleanup;
+		}
+#if MINILINK_HOT_SYMBOLS
+		if (found != 0) found = ml_hot_lookup(l->code, &addrs[ctr]);
+#endif
+		l->pending = (found != 0);
+	}
+
+	while (1) {
+		//The smallest name still to be looked up
+		min = NULL;
+		for (l = names_c; l < names_c + count; l++) {
+			if (l->pending && (min == NULL || strcmp(l->code, min->code) < 0)) min = l;
+		}
+		if (min == NULL) break;
+
+		//The table is sorted as well, so it is only read once
+		while ((cmp = strcmp(tabname, min->code)) < 0) {
+			if (ml_next_symbol(&buf_sym, tabname, &tabval) != 0) break;
+		}
+		for (l = names_c; l < names_c + count; l++) {
+			if (l->pending && strcmp(l->code, min->code) == 0) {
+				if (cmp == 0) addrs[l - names_c] = tabval;
+				l->pending = 0;
+			}
+		}
+		if (cmp != 0) {
+			DPRINTF("Symbol %s not found\n", names[min - names_c]);
+			missing = 1;
+		}
+	}
+	status = missing ? 3 : 0;
+
+	cleanup:
+	//Looking a symbol up does not keep its program loaded
+	ml_export_commit(&uses, NULL);
+	free(names_c);
+	free(dict);
+	cfs_close(buf_sym.fd);
+	DPRINTF("Lookup status: %i\n", status);
+	return status;
+}
+
+/** Look a symbol up by name, see minilink_lookup_many().
+ * \param name       Name of the symbol
+ * \param symtabfile File containing the symbol table of the kernel
+ * \param addr       Output for the value of the symbol
+ * \return Same as minilink_lookup_many()
+ */
+uint_fast8_t minilink_lookup(const char *name, const char *symtabfile, minilink_addr_t *addr) {
+	return minilink_lookup_many(&name, 1, symtabfile, addr);
+}
 
 /** @} */
 
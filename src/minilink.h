@@ -52,8 +52,136 @@
 
 #define MINILINK_PGM_MAGIC  0x4d4c
 #define MINILINK_SYM_MAGIC  0x5359
+#define MINILINK_PATCH_MAGIC 0x5054
+#define MINILINK_SYMDELTA_MAGIC 0x5344
 #define MINILINK_INST_MAGIC 0x7887
+/** Magic of an installed program other programs in flash import from. It
+ * only clears bits of MINILINK_INST_MAGIC, so it is written without erasing. */
+#define MINILINK_USED_MAGIC 0x7807
+#define MINILINK_DEAD_MAGIC 0x0000
+
+/** Flag for minilink_load_flags(): Place .text in RAM instead of flash */
+#define MINILINK_LOAD_RAM 0x01
 #define MINILINK_RELOC_ESC  0xf5
+/** Version of the program file format */
+#define MINILINK_PGM_VERSION 12
+
+/* Tags following the escape byte. Numbers are stored 7 bits per byte,
+ * least significant first, with the top bit set if another byte follows.
+ * Addends are zigzag coded, so small negative values stay short.
+ *
+ * The target table holds the entries listed in the header, followed by
+ * the imported symbols. The entries are stored behind the symbol list,
+ * using the SYMADD and SECT forms.
+ */
+#define MINILINK_TAG_LITERAL 0x00 /**< The escape byte itself */
+#define MINILINK_TAG_SYMMAX  0x7F /**< 0x01 - 0x7F: Target table entry (tag - 1) */
+#define MINILINK_TAG_TABLE   0x80 /**< Target table entry, number follows */
+#define MINILINK_TAG_SYMADD  0x81 /**< Symbol and addend, two numbers follow */
+/** Number of words follows, each of them is a relocation. Their tags are
+ * not preceded by the escape byte. */
+#define MINILINK_TAG_RUN     0x82
+/** The relocation tag following is PC-relative: The address of the word
+ * is subtracted from the target. Not used within runs. */
+#define MINILINK_TAG_PCREL   0x83
+/** The relocation is wider than a word: A form byte follows, then the
+ * relocation tag. Not used within runs. */
+#define MINILINK_TAG_WIDE    0x84
+/** 0xC0 | section << 3 | (offset & 7), number (offset >> 3) follows */
+#define MINILINK_TAG_SECT    0xC0
+
+/* The word at a wide relocation gets bits 0 - 15 of the target. In the long
+ * form the next word gets bits 16 - 31, as pointers of the large memory
+ * model are stored. Other forms are MINILINK_WIDE_FORM(back, shift): Bits
+ * 16 - 19 go to bit shift of the word back bytes in front, as the
+ * extension words and address instructions of the MSP430X hold them.
+ */
+#define MINILINK_WIDE_LONG 0x00
+#define MINILINK_WIDE_FORM(back, shift) ((back) << 3 | (shift))
+#define MINILINK_WIDE_BACK(form) (((form) >> 3) & 0x1E)
+#define MINILINK_WIDE_SHIFT(form) ((form) & 0x0F)
+/** Largest distance of the word holding bits 16 - 19 */
+#define MINILINK_WIDE_MAXBACK 6
+
+/* Sections in base-delta form are stored as image, linked as if the
+ * sections were placed back to back from address zero, with two bytes
+ * between them. Every MINILINK_DELTA_GROUP bytes of the image are preceded
+ * by a byte marking the words to relocate. If it is not zero, a byte marking
+ * the imported symbols among them follows, and a target table index for
+ * each import. Imports get the value of the table entry added, the other
+ * words are moved to the section they point to.
+ */
+#define MINILINK_DELTA_GROUP 16
+
+/* Parts of the program found in the kernel are left out and referenced
+ * there. The kernel ranges follow the symbol list, each as symbol, addend
+ * and length, followed by the CRC32K of their contents. The program is only
+ * loaded if the kernel still contains the same bytes.
+ */
+
+/* Programs may keep the places in .text that refer to the kernel, so they
+ * can be relinked in flash after a kernel update. The table follows the
+ * target table: the number of sites, then for each the distance of its
+ * offset to the one of the previous site, the symbol number shifted left
+ * by two with bit 0 set if the site is PC-relative and bit 1 set if it is
+ * wide, the form byte of wide sites, and the addend.
+ */
+
+/* Programs used as libraries export their global symbols to programs
+ * loaded after them. The table follows the import sites: the number of
+ * symbols, then for each the name with the terminating NUL, the section
+ * number and the offset in the section.
+ */
+
+/** Flag for Minilink_Header.flags: The section data is LZ compressed */
+#define MINILINK_FLAG_LZ 0x01
+/** Size of the LZ window, matches reach back at most this far */
+#define MINILINK_LZ_WINDOW 256
+/** Shortest LZ match */
+#define MINILINK_LZ_MINMATCH 3
+/** Flag for Minilink_Header.flags: The symbol list holds indices into the
+ * export table of the kernel, one number each, instead of names. */
+#define MINILINK_FLAG_ABI 0x02
+
+/** Flag for Minilink_SymbolHeader.flags: Values stored as such take three
+ * bytes, for the 20-bit addresses of MSP430X parts. */
+#define MINILINK_SYMFLAG_ADDR20 0x0001
+
+/* A patch is a sequence of commands, each starting with a number n coded
+ * like the numbers of the section streams. If bit 0 of n is clear, n >> 1
+ * bytes follow, which are appended to the new file. Otherwise n >> 1 bytes
+ * are copied from the old file, starting at the offset given by the number
+ * following n. The commands end once the new file is complete.
+ */
+/* Symbol names may be coded with a dictionary of common substrings, kept
+ * with the kernel sources and stored behind the header of the symbol table.
+ * Byte MINILINK_DICT_TOKEN + n stands for entry n. Names are coded by
+ * replacing the longest entry matching at each position, and sorted and
+ * compared in coded form.
+ */
+#define MINILINK_DICT_TOKEN 0x80
+/** Largest number of dictionary entries */
+#define MINILINK_DICT_MAX 128
+
+/** Longest run a single patch command may describe */
+#define MINILINK_PATCH_MAXLEN 0x7FFF
+
+/* A symbol table delta turns the symbol table of a kernel into the one of
+ * the next build. It starts with the shifts: their number, then for each
+ * the distance of its first address to the one of the previous shift and
+ * the zigzag coded shift, taken modulo 64 KB unless the values have 20
+ * bits. A value of the old table is moved by the shift with the highest
+ * first address not above it. Commands follow, each a
+ * number n: n >> 2 entries of the old table are kept (n & 3 = 0) or
+ * dropped (n & 3 = 1). For n & 3 = 2 an entry is added, its name and the
+ * number of its value follow. Keeping no entries ends the commands.
+ */
+#define MINILINK_SYMDELTA_KEEP 0
+#define MINILINK_SYMDELTA_DROP 1
+#define MINILINK_SYMDELTA_ADD  2
+/** Names in tables to update by a delta must be shorter */
+#define MINILINK_SYMDELTA_NAMELEN 64
+
 #define MINILINK_MAX_FILENAME 16
 #define MINILINK_MAX_SYMLEN 32
 
@@ -88,6 +216,9 @@ typedef struct{
 typedef struct{
   Minilink_CommonHeader common PACK;
   uint32_t kernelchksum PACK;
+  uint16_t dictionary PACK;  /**< Id of the name dictionary, 0 if there is none */
+  uint16_t dictsize PACK;    /**< Size of the dictionary following the header */
+  uint16_t flags PACK;       /**< MINILINK_SYMFLAG_* */
 } Minilink_SymbolHeader;
 
 typedef struct{
@@ -99,8 +230,32 @@ typedef struct{
   uint16_t migsize PACK;       /**< Size of migratable area in RAM */
   uint16_t migptrsize PACK;    /**< Size of migratable pointee area in RAM */
   uint16_t symentries PACK;    /**< Number of symbols in file */
+  uint8_t version PACK;        /**< Format version, MINILINK_PGM_VERSION */
+  uint8_t escape PACK;         /**< Escape byte used in the section streams */
+  uint16_t targets PACK;       /**< Number of target table entries in file */
+  uint8_t delta PACK;          /**< Bit n set: Section n is stored in base-delta form */
+  uint8_t flags PACK;          /**< MINILINK_FLAG_* */
+  uint16_t kchecks PACK;       /**< Number of kernel ranges the program uses as its own */
+  uint16_t dictionary PACK;    /**< Id of the dictionary the names are coded with, 0 if none */
+  uint16_t sitesize PACK;      /**< Size of the import site table, 0 if there is none */
+  uint16_t exportsize PACK;    /**< Size of the export table, 0 if there is none */
 } Minilink_Header;
 
+typedef struct{
+  Minilink_CommonHeader common PACK; /**< Common header information */
+  uint32_t oldcrc PACK;  /**< CRC of the symbol table the delta applies to */
+  uint32_t newcrc PACK;  /**< CRC of the symbol table the delta creates */
+  uint16_t newsize PACK; /**< Size of the symbol table the delta creates */
+  uint32_t kernelchksum PACK; /**< Kernel checksum of the new symbol table */
+} Minilink_SymDeltaHeader;
+
+typedef struct{
+  Minilink_CommonHeader common PACK; /**< Common header information */
+  uint32_t oldcrc PACK;  /**< CRC of the program file the patch applies to */
+  uint32_t newcrc PACK;  /**< CRC of the program file the patch creates */
+  uint16_t newsize PACK; /**< Size of the program file the patch creates */
+} Minilink_PatchHeader;
+
 
 #undef PACK
 
@@ -118,16 +273,77 @@ typedef struct{
   char sourcefile[MINILINK_MAX_FILENAME]; /**< Name of file the program was loaded from */
 } Minilink_ProgramInfoHeader;
 
+/** Wear statistics of the flash area programs are installed to */
+typedef struct{
+  uint16_t segments;  /**< Number of erase units in the program area */
+  uint16_t min;       /**< Lowest erase count of any segment */
+  uint16_t max;       /**< Highest erase count of any segment */
+  uint32_t total;     /**< Sum of erase counts of all segments */
+  uint16_t metaerase; /**< Erase count of the metadata block */
+} Minilink_WearInfo;
+
+/** Entry of the hot tier of the kernel symbol table, which is compiled
+ * into the kernel. The table is generated by mksymtab -H.
+ */
+typedef struct{
+  const char *name; /**< Name of the symbol */
+  const void *addr; /**< Value of the symbol */
+} Minilink_HotSymbol;
+
 
 #ifndef COMPILE_HOSTED_TOOLS
 #include <sys/process.h>
+
+/** Set to 1 for kernels using the 20-bit addresses of MSP430X parts. Their
+ * symbol tables are built with mksymtab -X. */
+#ifndef MINILINK_ADDR20
+#define MINILINK_ADDR20 0
+#endif
+
+/** Address or symbol value as the linker handles it */
+#if MINILINK_ADDR20
+typedef uint32_t minilink_addr_t;
+#else
+typedef uint16_t minilink_addr_t;
+#endif
+
 const char * minilink_get_filename(struct process *process);
 uint_fast8_t minilink_load(const char *programfile, const char *symtabfile,
     struct process ***process);
+uint_fast8_t minilink_check(const char *programfile, const char *symtabfile);
+uint_fast8_t minilink_load_flags(const char *programfile, const char *symtabfile,
+    struct process ***process, uint8_t flags);
+uint_fast8_t minilink_load_many(const char * const *programfiles, uint8_t count,
+    const char *symtabfile, struct process ***process);
+uint_fast8_t minilink_unload(const char *programfile);
+uint_fast8_t minilink_require(const char *programfile, const char *symtabfile,
+    struct process ***process);
+uint_fast8_t minilink_patch(const char *oldfile, const char *patchfile,
+    const char *newfile);
+uint_fast8_t minilink_symtab_update(const char *oldfile, const char *deltafile,
+    const char *newfile);
+uint_fast8_t minilink_relink_all(const char *symtabfile);
+uint_fast8_t minilink_lookup(const char *name, const char *symtabfile,
+    minilink_addr_t *addr);
+uint_fast8_t minilink_lookup_many(const char * const *names, uint16_t count,
+    const char *symtabfile, minilink_addr_t *addrs);
 struct process *clean_minilink_space(void);
 int minilink_is_process(struct process *process);
 void minilink_init(void);
 Minilink_ProgramInfoHeader * minilink_programm_ih(struct process *proc);
+uint16_t minilink_wear_count(uint16_t segment);
+void minilink_wear_info(Minilink_WearInfo *info);
+
+/** Hot tier of the kernel symbol table, sorted by name */
+extern const Minilink_HotSymbol minilink_hot_symbols[];
+/** Number of entries of minilink_hot_symbols */
+extern const uint16_t minilink_hot_count;
+
+/** Export table of the kernel, generated by mksymtab -J. The index of a
+ * symbol stays the same across kernel builds. Retired entries are NULL. */
+extern const void * const minilink_abi_table[];
+/** Number of entries of minilink_abi_table */
+extern const uint16_t minilink_abi_count;
 #endif
 
 #endif /* INCLUDED_MINILINK__H__ */
@@ -41,6 +41,8 @@
 
 #include "filelib.h"
 #include <crc32k.h>
+#include <string.h>
+#include <errno.h>
 
 
 #if BOOTLOADER
@@ -90,6 +92,16 @@ get_le32_val(unsigned char *bytes)
   return retval;
 }
 
+static int
+set_u8(unsigned char **dest, size_t *space, uint8_t data)
+{
+  if (*space < 1) return -1;
+
+  *(*dest)++ = data;
+  *space -= 1;
+  return 0;
+}
+
 int
 set_le16(unsigned char **dest, size_t *space, uint16_t data)
 {
@@ -203,6 +215,12 @@ convert_symbol_header(const Minilink_SymbolHeader *sh, unsigned char *dest,
   if (status != 0) return status;
   status = set_le32(&dest, &destspace, sh->kernelchksum);
   if (status != 0) return status;
+  status = set_le16(&dest, &destspace, sh->dictionary);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, sh->dictsize);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, sh->flags);
+  if (status != 0) return status;
 
   return orig_destspace - destspace;
 }
@@ -232,10 +250,255 @@ convert_program_header(const Minilink_Header *mlh, unsigned char *dest,
   if (status != 0) return status;
   status = set_le16(&dest, &destspace, mlh->symentries);
   if (status != 0) return status;
+  status = set_u8(&dest, &destspace, mlh->version);
+  if (status != 0) return status;
+  status = set_u8(&dest, &destspace, mlh->escape);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, mlh->targets);
+  if (status != 0) return status;
+  status = set_u8(&dest, &destspace, mlh->delta);
+  if (status != 0) return status;
+  status = set_u8(&dest, &destspace, mlh->flags);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, mlh->kchecks);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, mlh->dictionary);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, mlh->sitesize);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, mlh->exportsize);
+  if (status != 0) return status;
+
+  return orig_destspace - destspace;
+}
+
+int
+convert_symdelta_header(const Minilink_SymDeltaHeader *dh, unsigned char *dest,
+    size_t destspace)
+{
+  int status;
+  size_t orig_destspace = destspace;
+
+  status = set_le16(&dest, &destspace, dh->common.magic);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, dh->common.crc);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, dh->oldcrc);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, dh->newcrc);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, dh->newsize);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, dh->kernelchksum);
+  if (status != 0) return status;
+
+  return orig_destspace - destspace;
+}
+
+int
+read_symbol_header(unsigned char *src, size_t srclen, Minilink_SymbolHeader *output) {
+  if (srclen < 2+4+4+2+2+2)
+    return -1;
+
+  output->common.magic  = get_le16_val(src); src += 2;
+  output->common.crc    = get_le32_val(src); src += 4;
+  output->kernelchksum  = get_le32_val(src); src += 4;
+  output->dictionary    = get_le16_val(src); src += 2;
+  output->dictsize      = get_le16_val(src); src += 2;
+  output->flags         = get_le16_val(src); src += 2;
+
+  return 2+4+4+2+2+2;
+}
+
+int
+convert_patch_header(const Minilink_PatchHeader *ph, unsigned char *dest,
+    size_t destspace)
+{
+  int status;
+  size_t orig_destspace = destspace;
+
+  status = set_le16(&dest, &destspace, ph->common.magic);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, ph->common.crc);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, ph->oldcrc);
+  if (status != 0) return status;
+  status = set_le32(&dest, &destspace, ph->newcrc);
+  if (status != 0) return status;
+  status = set_le16(&dest, &destspace, ph->newsize);
+  if (status != 0) return status;
 
   return orig_destspace - destspace;
 }
 
+int
+read_program_header(unsigned char *src, size_t srclen, Minilink_Header *output) {
+  if (srclen < 2+4+7*2+1+1+2+1+1+2+2+2+2)
+    return -1;
+
+  output->common.magic  = get_le16_val(src); src += 2;
+  output->common.crc    = get_le32_val(src); src += 4;
+  output->processoffset = get_le16_val(src); src += 2;
+  output->textsize      = get_le16_val(src); src += 2;
+  output->datasize      = get_le16_val(src); src += 2;
+  output->bsssize       = get_le16_val(src); src += 2;
+  output->migsize       = get_le16_val(src); src += 2;
+  output->migptrsize    = get_le16_val(src); src += 2;
+  output->symentries    = get_le16_val(src); src += 2;
+  output->version       = *src++;
+  output->escape        = *src++;
+  output->targets       = get_le16_val(src); src += 2;
+  output->delta         = *src++;
+  output->flags         = *src++;
+  output->kchecks       = get_le16_val(src); src += 2;
+  output->dictionary    = get_le16_val(src); src += 2;
+  output->sitesize      = get_le16_val(src); src += 2;
+  output->exportsize    = get_le16_val(src); src += 2;
+
+  return 2+4+7*2+1+1+2+1+1+2+2+2+2;
+}
+
+int
+read_name_lines(const char *filename, char ***names, size_t *count)
+{
+  FILE *f;
+  char line[256], **tmp;
+  int retval = 0;
+
+  *names = NULL;
+  *count = 0;
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    if (errno == ENOENT) return 1;
+    perror("Failed to open export index");
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, " \t\r\n")] = 0;
+    tmp = realloc(*names, (*count + 1) * sizeof(*tmp));
+    if (tmp == NULL) {
+      perror("Failed to allocate space for export index");
+      retval = -1;
+      break;
+    }
+    *names = tmp;
+    (*names)[*count] = strdup(line);
+    if ((*names)[*count] == NULL) {
+      perror("Failed to allocate space for export index");
+      retval = -1;
+      break;
+    }
+    (*count)++;
+  }
+  if (ferror(f)) {
+    perror("Failed to read export index");
+    retval = -1;
+  }
+  fclose(f);
+  if (retval < 0) free_name_lines(*names, *count);
+  return retval;
+}
+
+void
+free_name_lines(char **names, size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++) free(names[i]);
+  free(names);
+}
+
+int
+read_dictionary(const char *filename, char ***entries, size_t *count)
+{
+  size_t i, kept = 0;
+  int retval;
+
+  retval = read_name_lines(filename, entries, count);
+  if (retval != 0) return retval;
+  for (i = 0; i < *count; i++) {
+    if ((*entries)[i][0] == 0) {
+      free((*entries)[i]);
+    } else {
+      (*entries)[kept++] = (*entries)[i];
+    }
+  }
+  *count = kept;
+  if (kept > MINILINK_DICT_MAX) {
+    fprintf(stderr, "Dictionary %s has more than %u entries\n", filename,
+        MINILINK_DICT_MAX);
+    free_name_lines(*entries, *count);
+    *entries = NULL;
+    *count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+uint16_t
+dictionary_id(char **entries, size_t count)
+{
+  uint32_t crc;
+  size_t i;
+
+  if (count == 0) return 0;
+  crc32k_init(&crc);
+  for (i = 0; i < count; i++) {
+    crc32k_add(entries[i], strlen(entries[i]) + 1, &crc);
+  }
+  //Zero means no dictionary
+  return (crc & 0xffff) ? (crc & 0xffff) : 1;
+}
+
+int
+encode_symbol_name(const char *name, char **entries, size_t count, char *out,
+    size_t outlen)
+{
+  size_t i, len, best, bestlen, pos = 0;
+
+  while (*name) {
+    if ((unsigned char)*name >= MINILINK_DICT_TOKEN) return -1;
+    best = count;
+    bestlen = 1;
+    for (i = 0; i < count; i++) {
+      len = strlen(entries[i]);
+      if (len > bestlen && strncmp(name, entries[i], len) == 0) {
+        best = i;
+        bestlen = len;
+      }
+    }
+    if (pos + 1 >= outlen) return -1;
+    out[pos++] = (best < count) ? (char)(MINILINK_DICT_TOKEN + best) : *name;
+    name += bestlen;
+  }
+  out[pos] = 0;
+  return pos;
+}
+
+int
+decode_symbol_name(const char *code, char **entries, size_t count, char *out,
+    size_t outlen)
+{
+  size_t idx, len, pos = 0;
+
+  for (; *code; code++) {
+    idx = (unsigned char)*code;
+    if (idx >= MINILINK_DICT_TOKEN) {
+      idx -= MINILINK_DICT_TOKEN;
+      if (idx >= count) return -1;
+      len = strlen(entries[idx]);
+      if (pos + len >= outlen) return -1;
+      memcpy(out + pos, entries[idx], len);
+      pos += len;
+    } else {
+      if (pos + 1 >= outlen) return -1;
+      out[pos++] = *code;
+    }
+  }
+  out[pos] = 0;
+  return pos;
+}
+
 
 
 /* @} */
@@ -91,11 +91,46 @@ int convert_symbol_header(const Minilink_SymbolHeader *sh, unsigned char *dest,
     const size_t destspace);
 int convert_program_header(const Minilink_Header *mlh, unsigned char *dest,
     const size_t destspace);
+int convert_patch_header(const Minilink_PatchHeader *ph, unsigned char *dest,
+    const size_t destspace);
+int convert_symdelta_header(const Minilink_SymDeltaHeader *dh, unsigned char *dest,
+    const size_t destspace);
 
 int read_kernel_header(unsigned char *src, size_t srclen,
     OSImageInfo *output);
+int read_program_header(unsigned char *src, size_t srclen,
+    Minilink_Header *output);
+int read_symbol_header(unsigned char *src, size_t srclen,
+    Minilink_SymbolHeader *output);
+
+/** Read a file holding one name per line, as the export index and the name
+ * dictionary. The line number is the index of the name, empty lines give
+ * empty names. In the export index they are retired indices.
+ * \return 0 on success, 1 if the file does not exist, -1 on error
+ */
+int read_name_lines(const char *filename, char ***names, size_t *count);
+void free_name_lines(char **names, size_t count);
+
+/** Read a symbol name dictionary, one entry per line. Empty lines are
+ * skipped.
+ * \return 0 on success, 1 if the file does not exist, -1 on error
+ */
+int read_dictionary(const char *filename, char ***entries, size_t *count);
+/** Id of a symbol name dictionary, 0 if it is empty */
+uint16_t dictionary_id(char **entries, size_t count);
+/** Code a symbol name with the dictionary, see MINILINK_DICT_TOKEN.
+ * \return Length of the coded name, -1 if it does not fit into out
+ */
+int encode_symbol_name(const char *name, char **entries, size_t count, char *out,
+    size_t outlen);
+/** Expand a coded symbol name.
+ * \return Length of the name, -1 if it is broken or does not fit into out
+ */
+int decode_symbol_name(const char *code, char **entries, size_t count, char *out,
+    size_t outlen);
 
 uint16_t get_le16_val(unsigned char *bytes);
+uint32_t get_le32_val(unsigned char *bytes);
 int set_le16(unsigned char **dest, size_t *space, uint16_t data);
 
 #endif
@@ -56,6 +56,17 @@
 #define PROCESS_ENTRY_NAME "autostart_processes"
 #define RELTYPE_01_1 "R_MSP430_16"
 #define RELTYPE_01_2 "R_MSP430_16_BYTE"
+#define RELTYPE_ABS16 "R_MSP430X_ABS16"
+#define RELTYPE_PCREL_16 "R_MSP430_16_PCREL"
+#define RELTYPE_PCREL_16_BYTE "R_MSP430_16_PCREL_BYTE"
+#define RELTYPE_PCREL_RL "R_MSP430_RL_PCREL"
+#define RELTYPE_PCREL_10 "R_MSP430_10_PCREL"
+#define RELTYPE_PCREL_2X "R_MSP430_2X_PCREL"
+/** Shortest run of relocations written as relocation run. The run header
+ * takes three bytes and saves one escape byte per relocation. */
+#define MIN_RELOC_RUN 4
+/** Shortest part of the text looked up in the kernel */
+#define MIN_DEDUP_SIZE 8
 
 #define SFWRITE(data, size, stream) {   \
     if (size != fwrite(data, 1, size, stream)) { \
@@ -66,6 +77,7 @@
 
 
 static unsigned char databuf[FILEHEAD_MAXSIZE];
+static unsigned char reloc_esc = MINILINK_RELOC_ESC;
 
 typedef unsigned char BitArray;
 #define bitarray_calc_idx(bit) ((bit) / CHAR_BIT)
@@ -81,6 +93,8 @@ struct s_stats{
   int link_simp;
   int link_comp;
   int reloc;
+  int relbytes; // Bytes spent on relocations
+  int runs;
 }lstats, tstats;
 
 #define NUMSECT 5
@@ -94,6 +108,7 @@ static struct
   size_t reloc_count;
   size_t size;
   bfd_byte *content;
+  FILE *stream; // Encoded section data
   unsigned required:1; // Is the section required
   unsigned has_relocations; //does the section contain relocations
   unsigned available:1; // Is the section required - DO NOT SET
@@ -145,12 +160,55 @@ load_symtab(bfd *source, size_t *symcount, asymbol ***symtab)
   return 0;
 }
 
+/** Relocations wider than a word and their forms, see MINILINK_TAG_WIDE */
+static const struct {
+  const char *name;
+  uint8_t form;
+} wide_types[] = {
+  { "R_MSP430_32", MINILINK_WIDE_LONG },
+  { "R_MSP430_ABS32", MINILINK_WIDE_LONG },
+  { "R_MSP430X_ABS20_EXT_SRC", MINILINK_WIDE_FORM(4, 7) },
+  { "R_MSP430X_ABS20_EXT_DST", MINILINK_WIDE_FORM(4, 0) },
+  { "R_MSP430X_ABS20_EXT_ODST", MINILINK_WIDE_FORM(6, 0) },
+  { "R_MSP430X_ABS20_ADR_SRC", MINILINK_WIDE_FORM(2, 8) },
+  { "R_MSP430X_ABS20_ADR_DST", MINILINK_WIDE_FORM(2, 0) }
+};
+
+/** Get the form of a wide relocation.
+ * \return The MINILINK_WIDE_* form, -1 if the relocation patches a word
+ */
+static int
+wide_form(const arelent *reloc)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(wide_types) / sizeof(*wide_types); i++) {
+    if (strcmp(reloc->howto->name, wide_types[i].name) == 0) return wide_types[i].form;
+  }
+  return -1;
+}
+
+/** Get the bytes a relocation patches, from the word holding the top bits
+ * of a wide relocation to the end of the value.
+ */
+static void
+reloc_extent(const arelent *reloc, bfd_vma *start, bfd_vma *end)
+{
+  int form = wide_form(reloc);
+
+  *start = reloc->address;
+  *end = reloc->address + ((form == MINILINK_WIDE_LONG) ? 4 : 2);
+  if (form > 0) *start -= MINILINK_WIDE_BACK(form);
+}
+
 static int
 load_relocations(asection *sect_src, asymbol **symtab, size_t *relcount,
     arelent ***rels)
 {
-  long storage_needed, numrels;
+  long storage_needed, numrels, i;
   arelent **lrels;
+  bfd_vma start, end;
+  int form;
 
   storage_needed = bfd_get_reloc_upper_bound(sect_src->owner, sect_src);
   if (storage_needed < 0) {
@@ -177,6 +235,19 @@ load_relocations(asection *sect_src, asymbol **symtab, size_t *relcount,
     return -1;
   }
 
+  //Wide relocations are kept at the word getting the low bits
+  for (i = 0; i < numrels; i++) {
+    form = wide_form(lrels[i]);
+    if (form > 0) lrels[i]->address += MINILINK_WIDE_BACK(form);
+    reloc_extent(lrels[i], &start, &end);
+    if (form >= 0 && end > bfd_get_section_size(sect_src)) {
+      fprintf(stderr, "Relocation at %lx outside of section %s.\n",
+          (long unsigned int)start, sect_src->name);
+      free(lrels);
+      return -1;
+    }
+  }
+
   *rels = lrels;
   *relcount = numrels;
   return 0;
@@ -257,13 +328,56 @@ my_get_symbol_by_name(const char *name, const size_t symcount,
   return NULL;
 }
 
+/** Coded name of an imported symbol. The bfd symbol keeps its name. */
+struct coded_name {
+  const asymbol *sym;
+  char *name;
+};
+
+/** Coded names of the imported symbols, sorted by symbol */
+static struct coded_name *coded_names;
+static size_t coded_count;
+
+static int
+cmp_coded_sym(const void *a, const void *b)
+{
+  const struct coded_name *ca = a;
+  const struct coded_name *cb = b;
+
+  if ((uintptr_t)ca->sym < (uintptr_t)cb->sym) return -1;
+  if (ca->sym == cb->sym) return 0;
+  return 1;
+}
+
+static void
+free_coded_names(void)
+{
+  size_t i;
+
+  for (i = 0; i < coded_count; i++) free(coded_names[i].name);
+  free(coded_names);
+}
+
+/** Name of an imported symbol as it is written to the program file */
+static const char *
+import_name(const asymbol *sym)
+{
+  struct coded_name key, *found = NULL;
+
+  key.sym = sym;
+  if (coded_count) {
+    found = bsearch(&key, coded_names, coded_count, sizeof(key), cmp_coded_sym);
+  }
+  return (found != NULL) ? found->name : sym->name;
+}
+
 static int
 cmp_symname(const void *a, const void *b)
 {
   const asymbol *syma = **(asymbol***)a;
   const asymbol *symb = **(asymbol***)b;
-  const unsigned char *sa = (const unsigned char *)(syma->name);
-  const unsigned char *sb = (const unsigned char *)(symb->name);
+  const unsigned char *sa = (const unsigned char *)import_name(syma);
+  const unsigned char *sb = (const unsigned char *)import_name(symb);
 
   for (;;) {
     if (*sa < *sb) return -1;
@@ -309,6 +423,26 @@ sort_relocs_by_offset(const size_t relcount, arelent **input,
 
 }
 
+/** Kinds of PC-relative relocations */
+enum pcrel_kind {
+  PCREL_NONE = 0,
+  PCREL_16,      // Word holding target - address of the word
+  PCREL_JUMP,    // Offset field of a jump instruction
+  PCREL_JUMP2X   // Jump instruction preceded by a second one
+};
+
+static enum pcrel_kind
+pcrel_kind(const arelent *reloc)
+{
+  const char *name = reloc->howto->name;
+
+  if (strcmp(name, RELTYPE_PCREL_16) == 0 || strcmp(name, RELTYPE_PCREL_16_BYTE) == 0
+      || strcmp(name, RELTYPE_PCREL_RL) == 0) return PCREL_16;
+  if (strcmp(name, RELTYPE_PCREL_10) == 0) return PCREL_JUMP;
+  if (strcmp(name, RELTYPE_PCREL_2X) == 0) return PCREL_JUMP2X;
+  return PCREL_NONE;
+}
+
 static void
 inverse_map_symbols(const size_t symcount, asymbol **baseoffs,
     const size_t inpcount, asymbol ***input, size_t *output)
@@ -336,12 +470,12 @@ static int write_symbollist(const size_t symcount, asymbol ***symtab,
     match = 0;
     if (i != 0){
       while(1){
-        if((*(symtab[i -1]))->name[match] != (*(symtab[i]))->name[match]) break;
+        if(import_name(*(symtab[i -1]))[match] != import_name(*(symtab[i]))[match]) break;
         match++;
       }
 
     }
-    curname = (*(symtab[i]))->name;
+    curname = import_name(*(symtab[i]));
     xlen = strlen(curname) + 1;
     xlen -= match;
     wres = fwrite(&match, 1,1,stream);
@@ -367,7 +501,7 @@ static int write_escaped_stream(const void *ptr, size_t len, FILE* stream) {
 
   while (len) {
     for (okdata = 0; okdata < len; okdata++) {
-      if (cvals[okdata] == MINILINK_RELOC_ESC)
+      if (cvals[okdata] == reloc_esc)
         break;
     }
 
@@ -378,8 +512,7 @@ static int write_escaped_stream(const void *ptr, size_t len, FILE* stream) {
 
     SFWRITE(cvals, okdata, stream);
 
-    putc(0, stream);
-    putc(0, stream);
+    putc(MINILINK_TAG_LITERAL, stream);
     lstats.esc++;
     printf("Wrote escape.\n");
 
@@ -392,37 +525,1477 @@ static int write_escaped_stream(const void *ptr, size_t len, FILE* stream) {
   if (len) {
     SFWRITE(cvals, len, stream);
   }
-  return 0;
+  return 0;
+}
+
+
+/** Target of a relocation */
+struct reloc_target {
+  size_t id;       // Symbol id, or section index for section targets
+  bfd_vma offset;  // Addend of the symbol, or offset within the section
+  unsigned sect:1; // Target is within one of our sections
+  unsigned uses;   // Number of relocations to this target
+  long index;      // Position in the target table, -1 if written inline
+};
+
+/** All distinct relocation targets of the module */
+static struct reloc_target *targets;
+static size_t target_count;
+/** Number of targets written to the target table */
+static size_t target_table_size;
+
+/** Number of bytes needed by write_varint() */
+static size_t varint_len(uint32_t val) {
+  size_t len = 1;
+  while (val >>= 7) len++;
+  return len;
+}
+
+/** Write a number using 7 bits per byte, least significant bits first. */
+static int write_varint(uint32_t val, FILE *stream) {
+  unsigned char tmp;
+
+  do {
+    tmp = val & 0x7F;
+    val >>= 7;
+    if (val) tmp |= 0x80;
+    SFWRITE(&tmp, 1, stream);
+    lstats.relbytes++;
+  } while (val);
+  return 0;
+}
+
+/** Kernel exports by index, from the file given with -I */
+static char **export_index;
+static size_t export_count;
+
+/** Dictionary the symbol names are coded with, from the file given with -D */
+static char **dict_entries;
+static size_t dict_count;
+/** Code the names of the symbols, see import_name() */
+static int encode_symbol_names(const size_t symcount, asymbol ***symtab)
+{
+  size_t i, len;
+
+  coded_names = calloc(symcount, sizeof(*coded_names));
+  if (symcount && coded_names == NULL) {
+    perror("Failed to allocate space for coded names");
+    return -1;
+  }
+  coded_count = symcount;
+  for (i = 0; i < symcount; i++) {
+    len = strlen((*(symtab[i]))->name) + 1;
+    coded_names[i].sym = *(symtab[i]);
+    coded_names[i].name = malloc(len);
+    if (coded_names[i].name == NULL) {
+      perror("Failed to allocate space for coded names");
+      return -1;
+    }
+    if (encode_symbol_name((*(symtab[i]))->name, dict_entries, dict_count,
+        coded_names[i].name, len) < 0) {
+      fprintf(stderr, "Symbol %s can not be coded\n", (*(symtab[i]))->name);
+      return -1;
+    }
+  }
+  qsort(coded_names, symcount, sizeof(*coded_names), cmp_coded_sym);
+  return 0;
+}
+
+/** Write the symbol list as indices into the export table of the kernel */
+static int write_export_list(const size_t symcount, asymbol ***symtab,
+    FILE *stream) {
+  size_t i, idx;
+  const char *curname;
+
+  for (i = 0; i < symcount; i++) {
+    curname = (*(symtab[i]))->name;
+    for (idx = 0; idx < export_count; idx++) {
+      if (strcmp(export_index[idx], curname) == 0) break;
+    }
+    if (idx == export_count) {
+      fprintf(stderr, "Symbol %s is not in the export index\n", curname);
+      return -1;
+    }
+    printf("<%zu>%s\n", idx, curname);
+    if (write_varint(idx, stream) < 0) return -1;
+  }
+  return 0;
+}
+
+static uint16_t zigzag16(int16_t val) {
+  // keep small negative offsets short
+  return val < 0 ? (uint16_t)~((uint16_t)val << 1) : (uint16_t)((uint16_t)val << 1);
+}
+
+/** Input section merged into one of the program sections, as produced by
+ * -ffunction-sections and -fdata-sections */
+struct input_unit {
+  asection *sectptr;
+  uint8_t sect;            // Program section it is merged into
+  arelent **reloc;
+  size_t reloc_count;
+  bfd_byte *content;
+  bfd_vma offset;          // Offset within the program section
+  struct input_unit *fold; // Identical unit used instead, or NULL
+  unsigned used:1;         // Reachable from the process entry
+};
+
+static struct input_unit *units;
+static size_t unit_count;
+
+/** Prefixes of the input sections merged into the program sections */
+static const struct
+{
+  const char *prefix;
+  uint8_t sect;
+} unit_prefixes[] =
+{
+{ ".text.", MINILINK_TEXT },
+{ ".rodata", MINILINK_TEXT },
+{ ".data.", MINILINK_DATA },
+{ ".bss.", MINILINK_BSS }
+};
+
+static void
+collect_unit(bfd *abfd, asection *sect, void *data)
+{
+  struct input_unit *tmp;
+  size_t i;
+  int *status = data;
+
+  (void)abfd;
+  if (*status != 0) return;
+  for (i = 0; i < sizeof(unit_prefixes) / sizeof(unit_prefixes[0]); i++) {
+    if (strncmp(sect->name, unit_prefixes[i].prefix, strlen(unit_prefixes[i].prefix)) == 0) break;
+  }
+  if (i == sizeof(unit_prefixes) / sizeof(unit_prefixes[0])) return;
+
+  tmp = realloc(units, (unit_count + 1) * sizeof(*units));
+  if (tmp == NULL) {
+    perror("Failed to allocate space for input sections");
+    *status = -1;
+    return;
+  }
+  units = tmp;
+  memset(units + unit_count, 0, sizeof(*units));
+  units[unit_count].sectptr = sect;
+  units[unit_count].sect = unit_prefixes[i].sect;
+  unit_count++;
+}
+
+static int
+cmp_reloc_address(const void *a, const void *b)
+{
+  const arelent *rela = *(arelent * const *)a;
+  const arelent *relb = *(arelent * const *)b;
+
+  if (rela->address < relb->address) return -1;
+  if (rela->address > relb->address) return 1;
+  return 0;
+}
+
+/** Find the input sections and load their relocations and contents */
+static int
+load_units(bfd *abfd, asymbol **symtab)
+{
+  size_t i;
+  int status = 0;
+
+  bfd_map_over_sections(abfd, collect_unit, &status);
+  if (status != 0) return -1;
+
+  for (i = 0; i < unit_count; i++) {
+    printf("Input section %s: %lu bytes\n", units[i].sectptr->name,
+        (long unsigned int)units[i].sectptr->size);
+    if (units[i].sect == MINILINK_BSS) continue;
+    if (load_relocations(units[i].sectptr, symtab, &units[i].reloc_count, &units[i].reloc) < 0) return -1;
+    qsort(units[i].reloc, units[i].reloc_count, sizeof(*units[i].reloc), cmp_reloc_address);
+    if (!bfd_malloc_and_get_section(abfd, units[i].sectptr, &units[i].content)) {
+      bfd_perror("Failed to load section");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static struct input_unit *
+unit_of(const asection *sect)
+{
+  size_t i;
+
+  for (i = 0; i < unit_count; i++) {
+    if (units[i].sectptr == sect) return units + i;
+  }
+  return NULL;
+}
+
+/** Mark the units referenced by the given relocations, and the units
+ * they reference in turn.
+ */
+static void
+mark_units(arelent **relocs, size_t reloc_count)
+{
+  struct input_unit *unit;
+  size_t i;
+
+  for (i = 0; i < reloc_count; i++) {
+    unit = unit_of((*relocs[i]->sym_ptr_ptr)->section);
+    if (unit == NULL || unit->used) continue;
+    unit->used = 1;
+    mark_units(unit->reloc, unit->reloc_count);
+  }
+}
+
+/** Mark the unit defining the symbol and the units it references. */
+static void
+mark_symbol_unit(const asymbol *sym)
+{
+  struct input_unit *unit;
+
+  unit = unit_of(sym->section);
+  if (unit != NULL && !unit->used) {
+    unit->used = 1;
+    mark_units(unit->reloc, unit->reloc_count);
+  }
+}
+
+/** Drop the units which can't be reached from the program sections or the
+ * process entry. Everything else is only used through them.
+ * \param symcount Number of symbols in symtab, 0 if the program exports
+ *                 nothing. Otherwise the global symbols are kept as well.
+ */
+static void
+collect_garbage(asymbol *entry, const size_t symcount, asymbol **symtab)
+{
+  size_t i, dropped = 0;
+  uint8_t ctr;
+
+  mark_symbol_unit(entry);
+  for (i = 0; i < symcount; i++) {
+    if (symtab[i]->flags & BSF_GLOBAL) mark_symbol_unit(symtab[i]);
+  }
+  for (ctr = 0; ctr < NUMSECT; ctr++) {
+    if (!sections[ctr].has_relocations) continue;
+    mark_units(sections[ctr].reloc, sections[ctr].reloc_count);
+  }
+
+  for (i = 0; i < unit_count; i++) {
+    if (units[i].used) continue;
+    printf("Dropping unused section %s\n", units[i].sectptr->name);
+    dropped += units[i].sectptr->size;
+  }
+  printf("Unused sections: %zu bytes\n", dropped);
+}
+
+static struct input_unit *
+fold_target(struct input_unit *unit)
+{
+  while (unit != NULL && unit->fold != NULL) unit = unit->fold;
+  return unit;
+}
+
+/** Do two relocations of units a and b refer to the same thing? References
+ * of each unit to itself count as the same.
+ */
+static int
+same_reloc_target(const arelent *ra, const struct input_unit *a,
+    const arelent *rb, const struct input_unit *b)
+{
+  const asymbol *sa = *ra->sym_ptr_ptr, *sb = *rb->sym_ptr_ptr;
+  struct input_unit *ua, *ub;
+
+  if (ra->howto != rb->howto) return 0;
+  if (sa == sb) return ra->addend == rb->addend;
+
+  ua = fold_target(unit_of(sa->section));
+  ub = fold_target(unit_of(sb->section));
+  if (ua == NULL || ub == NULL) return 0;
+  if (sa->value + ra->addend != sb->value + rb->addend) return 0;
+  return ua == ub || (ua == a && ub == b);
+}
+
+static int
+units_identical(struct input_unit *a, struct input_unit *b)
+{
+  size_t i;
+
+  if (a->sectptr->size != b->sectptr->size || a->reloc_count != b->reloc_count) return 0;
+  if (a->sectptr->alignment_power != b->sectptr->alignment_power) return 0;
+  if (memcmp(a->content, b->content, a->sectptr->size) != 0) return 0;
+  for (i = 0; i < a->reloc_count; i++) {
+    if (a->reloc[i]->address != b->reloc[i]->address) return 0;
+    if (!same_reloc_target(a->reloc[i], a, b->reloc[i], b)) return 0;
+  }
+  return 1;
+}
+
+/** Fold functions which are identical, including their relocations.
+ * Folding functions may make their callers identical, so this is repeated
+ * until nothing changes.
+ */
+static void
+fold_identical_code(void)
+{
+  size_t i, j, folded = 0;
+  int changed;
+
+  do {
+    changed = 0;
+    for (i = 0; i < unit_count; i++) {
+      if (!units[i].used || units[i].fold != NULL) continue;
+      if (strncmp(units[i].sectptr->name, ".text.", 6) != 0) continue;
+      for (j = 0; j < i; j++) {
+        if (!units[j].used || units[j].fold != NULL) continue;
+        if (strncmp(units[j].sectptr->name, ".text.", 6) != 0) continue;
+        if (!units_identical(units + j, units + i)) continue;
+        printf("Folding %s into %s\n", units[i].sectptr->name, units[j].sectptr->name);
+        units[i].fold = units + j;
+        folded += units[i].sectptr->size;
+        changed = 1;
+        break;
+      }
+    }
+  } while (changed);
+  printf("Folded functions: %zu bytes\n", folded);
+}
+
+/** Append the units to their program sections. Symbols and relocations
+ * are moved along, so they refer to the program sections only.
+ */
+static int
+merge_units(const size_t symcount, asymbol **symtab)
+{
+  struct input_unit *unit;
+  bfd_byte *content;
+  arelent **relocs;
+  bfd_vma size, align;
+  size_t i, j;
+  uint8_t sect;
+
+  for (i = 0; i < unit_count; i++) {
+    unit = units + i;
+    if (!unit->used || unit->fold != NULL) continue;
+    sect = unit->sect;
+    if (sections[sect].sectptr == NULL) {
+      fprintf(stderr, "No section %s to merge %s into.\n", sections[sect].name,
+          unit->sectptr->name);
+      return -1;
+    }
+
+    align = (bfd_vma)1 << unit->sectptr->alignment_power;
+    size = sections[sect].sectptr->size;
+    unit->offset = (size + align - 1) & ~(align - 1);
+    size = unit->offset + unit->sectptr->size;
+
+    if (sections[sect].has_relocations && size > 0) {
+      content = realloc(sections[sect].content, size);
+      if (content == NULL) {
+        perror("Failed to allocate space for merged sections");
+        return -1;
+      }
+      sections[sect].content = content;
+      memset(content + sections[sect].sectptr->size, 0,
+          unit->offset - sections[sect].sectptr->size);
+      memcpy(content + unit->offset, unit->content, unit->sectptr->size);
+    }
+    if (sections[sect].has_relocations && unit->reloc_count > 0) {
+      relocs = realloc(sections[sect].reloc,
+          (sections[sect].reloc_count + unit->reloc_count) * sizeof(*relocs));
+      if (relocs == NULL) {
+        perror("Failed to allocate space for merged relocations");
+        return -1;
+      }
+      sections[sect].reloc = relocs;
+      for (j = 0; j < unit->reloc_count; j++) {
+        unit->reloc[j]->address += unit->offset;
+        relocs[sections[sect].reloc_count++] = unit->reloc[j];
+      }
+    }
+    sections[sect].sectptr->size = size;
+  }
+
+  for (i = 0; i < symcount; i++) {
+    unit = unit_of(symtab[i]->section);
+    if (unit == NULL) continue;
+    if (unit->fold != NULL) unit = fold_target(unit);
+    if (!unit->used) continue;
+    symtab[i]->section = sections[unit->sect].sectptr;
+    symtab[i]->value += unit->offset;
+  }
+  return 0;
+}
+
+static void
+free_units(void)
+{
+  size_t i;
+
+  for (i = 0; i < unit_count; i++) {
+    free(units[i].reloc);
+    free(units[i].content);
+  }
+  free(units);
+}
+
+/** Kernel sections searched for copies of module code and constants */
+static struct
+{
+  char name[16];
+  asection *sectptr;
+  bfd_byte *content;
+} kernel_sections[] =
+{
+{ .name = ".text" },
+{ .name = ".rodata" }
+};
+#define NUMKSECT (sizeof(kernel_sections) / sizeof(kernel_sections[0]))
+
+static asymbol **kernel_symtab;
+static size_t kernel_symcount;
+
+/** Part of the module text replaced by its copy in the kernel */
+struct dedup_range {
+  bfd_vma start;         // Offset in the module text
+  bfd_vma len;           // Bytes removed from the module text
+  bfd_vma cmplen;        // Bytes that have to match, the rest is padding
+  asymbol *anchor;       // Exported kernel symbol the copy is addressed by
+  bfd_vma kaddr;         // Address of the copy
+  size_t symidx;         // Index of the import in the module symbol table
+};
+
+static struct dedup_range *dedups;
+static size_t dedup_count;
+/** CRC32K of the kernel copies, in the order of dedups */
+static uint32_t dedup_crc;
+/** The global symbols are exported, so their addresses must not move */
+static int dedup_keep_globals;
+/** Jump without relocation in the module text */
+struct text_jump {
+  bfd_vma from;          // Offset behind the jump instruction
+  bfd_vma target;        // Offset jumped to
+};
+static struct text_jump *text_jumps;
+static size_t text_jump_count;
+
+static int
+load_kernel(bfd *kernel)
+{
+  size_t i;
+  bfd_boolean bfdres;
+
+  for (i = 0; i < NUMKSECT; i++) {
+    kernel_sections[i].sectptr = bfd_get_section_by_name(kernel, kernel_sections[i].name);
+    if (kernel_sections[i].sectptr == NULL) continue;
+    bfdres = bfd_malloc_and_get_section(kernel, kernel_sections[i].sectptr,
+        &kernel_sections[i].content);
+    if (!bfdres) {
+      bfd_perror("Failed to load kernel section");
+      return -1;
+    }
+  }
+  return load_symtab(kernel, &kernel_symcount, &kernel_symtab);
+}
+
+/** Find the exported kernel symbol closest in front of the given address,
+ * within the reach of a 16 bit addend.
+ */
+static asymbol *
+kernel_anchor(asection *sect, bfd_vma addr)
+{
+  asymbol *best = NULL;
+  bfd_vma symaddr;
+  size_t i;
+
+  for (i = 0; i < kernel_symcount; i++) {
+    if (kernel_symtab[i]->section != sect) continue;
+    if (!(kernel_symtab[i]->flags & BSF_GLOBAL)) continue;
+    symaddr = kernel_symtab[i]->value + sect->vma;
+    if (symaddr > addr || addr - symaddr > 0x7FFF) continue;
+    if (best == NULL || symaddr > best->value + sect->vma) best = kernel_symtab[i];
+  }
+  return best;
+}
+
+/** Look for a copy of the given bytes in the kernel, which can be
+ * addressed relative to an exported symbol.
+ * \param aligned The copy has to start at an even address
+ * \return Anchor symbol of the copy, NULL if none was found
+ */
+static asymbol *
+find_in_kernel(const bfd_byte *data, size_t len, int aligned, bfd_vma *addr)
+{
+  asymbol *anchor;
+  bfd_size_type pos;
+  size_t i;
+
+  for (i = 0; i < NUMKSECT; i++) {
+    asection *sect = kernel_sections[i].sectptr;
+
+    if (sect == NULL || sect->size < len) continue;
+    for (pos = 0; pos + len <= sect->size; pos++) {
+      if (aligned && ((sect->vma + pos) & 1)) continue;
+      if (memcmp(kernel_sections[i].content + pos, data, len) != 0) continue;
+      anchor = kernel_anchor(sect, sect->vma + pos);
+      if (anchor == NULL) continue;
+      *addr = sect->vma + pos;
+      return anchor;
+    }
+  }
+  return NULL;
+}
+
+/** Check whether the bytes form a C string, possibly followed by a
+ * padding byte.
+ * \return Length of the string including the terminator, 0 if no string
+ */
+static size_t
+cstring_len(const bfd_byte *data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (data[i] == 0) break;
+    if ((data[i] < 0x20 || data[i] > 0x7E) && data[i] != '\t'
+        && data[i] != '\n' && data[i] != '\r') return 0;
+  }
+  if (i == 0 || i == len) return 0;
+  if (len - i > 2 || (len - i == 2 && data[i + 1] != 0)) return 0;
+  return i + 1;
+}
+
+/** Index of the part ending the string starting with part k: Parts are
+ * split by references into the string, it ends with the part holding the
+ * terminator.
+ */
+static size_t
+string_end(const bfd_vma *bounds, size_t k, size_t j)
+{
+  const bfd_byte *text = sections[MINILINK_TEXT].content;
+  size_t m;
+
+  for (m = k + 1; m < j; m++) {
+    if (memchr(text + bounds[k], 0, bounds[m] - bounds[k]) != NULL) break;
+  }
+  return m;
+}
+
+/** Do the parts k up to j consist of strings only? */
+static int
+only_strings(const bfd_vma *bounds, size_t k, size_t j)
+{
+  const bfd_byte *text = sections[MINILINK_TEXT].content;
+  size_t m;
+
+  for (; k < j; k = m) {
+    m = string_end(bounds, k, j);
+    if (!cstring_len(text + bounds[k], bounds[m] - bounds[k])) return 0;
+  }
+  return 1;
+}
+
+/** Does a relocation patch the given range of the text? */
+static int
+text_relocated(bfd_vma start, bfd_vma len)
+{
+  size_t i;
+  bfd_vma first, end;
+
+  for (i = 0; i < sections[MINILINK_TEXT].reloc_count; i++) {
+    reloc_extent(sections[MINILINK_TEXT].reloc[i], &first, &end);
+    if (end > start && first < start + len) return 1;
+  }
+  return 0;
+}
+
+/** Does a jump of the text lead into the given range? Jumps can't reach
+ * the kernel.
+ */
+static int
+text_jump_target(bfd_vma start, bfd_vma len)
+{
+  size_t i;
+  arelent *reloc;
+  bfd_vma target;
+
+  for (i = 0; i < sections[MINILINK_TEXT].reloc_count; i++) {
+    reloc = sections[MINILINK_TEXT].reloc[i];
+    if (pcrel_kind(reloc) < PCREL_JUMP) continue;
+    if ((*reloc->sym_ptr_ptr)->section != sections[MINILINK_TEXT].sectptr) continue;
+    target = (*reloc->sym_ptr_ptr)->value + reloc->addend;
+    if (target >= start && target < start + len) return 1;
+  }
+  return 0;
+}
+
+/** Collect the jumps the assembler resolved. They carry no relocation, so
+ * their distance would change once text between them and their target is
+ * removed. Every word in code that looks like a jump instruction leading
+ * into the text is taken for one: a constant looking like one only keeps
+ * some text in.
+ * \return 0 on success, -1 if out of memory
+ */
+static int
+find_text_jumps(const size_t symcount, asymbol **symtab)
+{
+  const bfd_byte *text = sections[MINILINK_TEXT].content;
+  bfd_vma size = sections[MINILINK_TEXT].sectptr->size;
+  bfd_vma pos, target;
+  uint16_t word;
+  size_t i;
+  int object = 0;
+
+  text_jumps = malloc((size / 2 + 1) * sizeof(*text_jumps));
+  if (text_jumps == NULL) {
+    perror("Failed to allocate space for jumps");
+    return -1;
+  }
+  text_jump_count = 0;
+  for (pos = 0; pos + 1 < size; pos += 2) {
+    //Objects hold no code
+    for (i = 0; i < symcount; i++) {
+      if (symtab[i]->section == sections[MINILINK_TEXT].sectptr && symtab[i]->value == pos
+          && (symtab[i]->flags & (BSF_OBJECT | BSF_FUNCTION))) {
+        object = (symtab[i]->flags & BSF_OBJECT) != 0;
+      }
+    }
+    if (object) continue;
+
+    word = text[pos] | (uint16_t)text[pos + 1] << 8;
+    if ((word & 0xE000) != 0x2000) continue;
+    //Signed offset in words, relative to the next instruction
+    target = pos + 2 + 2 * (bfd_signed_vma)((word & 0x1FF) - (word & 0x200));
+    if (target > size || text_relocated(pos, 2)) continue;
+    text_jumps[text_jump_count].from = pos + 2;
+    text_jumps[text_jump_count++].target = target;
+  }
+  return 0;
+}
+
+/** Does a jump collected by find_text_jumps() cross the given range or
+ * lead into it?
+ */
+static int
+text_jump_across(bfd_vma start, bfd_vma len)
+{
+  bfd_vma from, target;
+  size_t i;
+
+  for (i = 0; i < text_jump_count; i++) {
+    from = text_jumps[i].from;
+    target = text_jumps[i].target;
+    //The jump itself is removed
+    if (from > start && from <= start + len) continue;
+    if (target >= start && target < start + len) return 1;
+    if ((target < from ? target : from) < start + len
+        && (target < from ? from : target) > start) return 1;
+  }
+  return 0;
+}
+
+/** Is the address of a symbol in the given range used apart from the
+ * relocations? This holds for the process entry and for the symbols a
+ * library exports.
+ */
+static const asymbol *
+text_fixed_symbol(bfd_vma start, bfd_vma len, const size_t symcount, asymbol **symtab)
+{
+  size_t i;
+
+  for (i = 0; i < symcount; i++) {
+    if (symtab[i]->section != sections[MINILINK_TEXT].sectptr) continue;
+    if (symtab[i]->value < start || symtab[i]->value >= start + len) continue;
+    if (strcmp(symtab[i]->name, PROCESS_ENTRY_NAME) == 0
+        || (dedup_keep_globals && (symtab[i]->flags & BSF_GLOBAL))) return symtab[i];
+  }
+  return NULL;
+}
+
+/** Is the kernel symbol imported already, or about to be? */
+static int
+anchor_imported(const asymbol *anchor, const size_t symcount, asymbol **symtab)
+{
+  size_t i;
+
+  for (i = 0; i < dedup_count; i++) {
+    if (dedups[i].anchor == anchor) return 1;
+  }
+  for (i = 0; i < symcount; i++) {
+    if (bfd_is_und_section(symtab[i]->section)
+        && strcmp(symtab[i]->name, anchor->name) == 0) return 1;
+  }
+  return 0;
+}
+
+/** Replace a range of the text by the copy in the kernel, if there is one
+ * and the import costs less than the range.
+ */
+static int
+try_dedup(bfd_vma start, bfd_vma len, bfd_vma cmplen, int aligned,
+    const size_t symcount, asymbol **symtab)
+{
+  struct dedup_range *tmp;
+  asymbol *anchor;
+  bfd_vma kaddr;
+  size_t cost;
+
+  if (cmplen < MIN_DEDUP_SIZE || text_relocated(start, len)
+      || text_jump_target(start, len) || text_jump_across(start, len)
+      || text_fixed_symbol(start, len, symcount, symtab) != NULL) return 0;
+
+  anchor = find_in_kernel(sections[MINILINK_TEXT].content + start, cmplen,
+      aligned, &kaddr);
+  if (anchor == NULL) return 0;
+
+  //The check of the copy, and the name of a new import
+  cost = varint_len(zigzag16(kaddr - anchor->value - anchor->section->vma))
+      + varint_len(cmplen) + 1;
+  if (!anchor_imported(anchor, symcount, symtab)) cost += strlen(anchor->name) + 2;
+  if (cost >= len) return 0;
+
+  tmp = realloc(dedups, (dedup_count + 1) * sizeof(*dedups));
+  if (tmp == NULL) {
+    perror("Failed to allocate space for kernel copies");
+    return -1;
+  }
+  dedups = tmp;
+  dedups[dedup_count].start = start;
+  dedups[dedup_count].len = len;
+  dedups[dedup_count].cmplen = cmplen;
+  dedups[dedup_count].anchor = anchor;
+  dedups[dedup_count].kaddr = kaddr;
+  printf("Kernel copy of text %04lx+%lx at %04lx (%s+%lx)\n",
+      (long unsigned int)start, (long unsigned int)len,
+      (long unsigned int)kaddr, anchor->name,
+      (long unsigned int)(kaddr - anchor->value - anchor->section->vma));
+  dedup_count++;
+  return 0;
+}
+
+static int
+cmp_vma(const void *a, const void *b)
+{
+  const bfd_vma va = *(const bfd_vma *)a, vb = *(const bfd_vma *)b;
+
+  if (va < vb) return -1;
+  if (va > vb) return 1;
+  return 0;
+}
+
+/** Flags of the symbols at the given offset of the text, with BSF_LOCAL
+ * or BSF_GLOBAL set if there is a symbol at all.
+ */
+static int
+text_symflags(bfd_vma offset, const size_t symcount, asymbol **symtab)
+{
+  size_t i;
+  int flags = 0;
+
+  for (i = 0; i < symcount; i++) {
+    if (symtab[i]->section != sections[MINILINK_TEXT].sectptr) continue;
+    if (symtab[i]->flags & BSF_SECTION_SYM) continue;
+    if (symtab[i]->value == offset) flags |= symtab[i]->flags | BSF_LOCAL;
+  }
+  return flags;
+}
+
+/** Split the text at every symbol and every address referenced by a
+ * relocation, then pick the parts which have a copy in the kernel:
+ * Functions and objects starting at a symbol, and strings. A function
+ * ends in front of the strings following it, objects end at the next
+ * symbol. Code and objects are only taken if nothing within them is
+ * relocated, so leaf functions and constants.
+ */
+static int
+find_kernel_copies(const size_t symcount, asymbol **symtab)
+{
+  bfd_vma *bounds, *tmp;
+  size_t nbounds = 0, i, j, k, m, ctr;
+  bfd_byte *text = sections[MINILINK_TEXT].content;
+  int flags, retval = -1;
+
+  if (find_text_jumps(symcount, symtab) < 0) return -1;
+  bounds = malloc((symcount + 2) * sizeof(*bounds));
+  if (bounds == NULL) {
+    perror("Failed to allocate space for text boundaries");
+    goto cleanup;
+  }
+  bounds[nbounds++] = 0;
+  bounds[nbounds++] = sections[MINILINK_TEXT].sectptr->size;
+  for (i = 0; i < symcount; i++) {
+    if (symtab[i]->section != sections[MINILINK_TEXT].sectptr) continue;
+    bounds[nbounds++] = symtab[i]->value;
+  }
+  for (ctr = 0; ctr < NUMSECT; ctr++) {
+    if (!sections[ctr].has_relocations) continue;
+    tmp = realloc(bounds, (nbounds + sections[ctr].reloc_count) * sizeof(*bounds));
+    if (tmp == NULL) {
+      perror("Failed to allocate space for text boundaries");
+      goto cleanup;
+    }
+    bounds = tmp;
+    for (i = 0; i < sections[ctr].reloc_count; i++) {
+      asymbol *sym = *sections[ctr].reloc[i]->sym_ptr_ptr;
+      if (sym->section != sections[MINILINK_TEXT].sectptr) continue;
+      bounds[nbounds++] = sym->value + sections[ctr].reloc[i]->addend;
+    }
+  }
+  qsort(bounds, nbounds, sizeof(*bounds), cmp_vma);
+  for (i = 1, j = 1; i < nbounds; i++) {
+    if (bounds[i] != bounds[j - 1]
+        && bounds[i] <= sections[MINILINK_TEXT].sectptr->size) bounds[j++] = bounds[i];
+  }
+  nbounds = j;
+
+  //Part i reaches from bounds[i] to bounds[i + 1]
+  for (i = 0; i + 1 < nbounds; i = j) {
+    flags = text_symflags(bounds[i], symcount, symtab);
+    for (j = i + 1; j + 1 < nbounds; j++) {
+      if (text_symflags(bounds[j], symcount, symtab)) break;
+    }
+
+    k = i;
+    if (flags & BSF_FUNCTION) {
+      for (k = i + 1; k < j; k++) {
+        if (only_strings(bounds, k, j)) break;
+      }
+      if (try_dedup(bounds[i], bounds[k] - bounds[i], bounds[k] - bounds[i], 1,
+          symcount, symtab) < 0) goto cleanup;
+    } else if (flags & BSF_OBJECT) {
+      if (try_dedup(bounds[i], bounds[j] - bounds[i], bounds[j] - bounds[i], 1,
+          symcount, symtab) < 0) goto cleanup;
+      k = j;
+    } else if (flags) {
+      k = j; //Don't know what this is
+    }
+
+    for (; k < j; k = m) {
+      size_t len;
+
+      m = string_end(bounds, k, j);
+      len = cstring_len(text + bounds[k], bounds[m] - bounds[k]);
+      if (len == 0) continue;
+      if (try_dedup(bounds[k], bounds[m] - bounds[k], len, 0,
+          symcount, symtab) < 0) goto cleanup;
+    }
+  }
+  retval = 0;
+
+cleanup:
+  free(bounds);
+  free(text_jumps);
+  text_jumps = NULL;
+  text_jump_count = 0;
+  return retval;
+}
+
+/** Drop parts at the edges of each block of adjacent parts, until the
+ * block starts at an even offset and has an even size. This way the code
+ * behind it stays aligned.
+ */
+static void
+align_kernel_copies(void)
+{
+  size_t i, j, first, last, end;
+  bfd_vma len;
+
+  for (first = 0; first < dedup_count; first = end) {
+    for (end = first + 1; end < dedup_count; end++) {
+      if (dedups[end].start != dedups[end - 1].start + dedups[end - 1].len) break;
+    }
+    last = end;
+    while (first < last) {
+      len = dedups[last - 1].start + dedups[last - 1].len - dedups[first].start;
+      if (dedups[first].start & 1) {
+        dedups[first++].len = 0;
+      } else if (len & 1) {
+        dedups[--last].len = 0;
+      } else {
+        break;
+      }
+    }
+  }
+
+  for (i = 0, j = 0; i < dedup_count; i++) {
+    if (dedups[i].len) dedups[j++] = dedups[i];
+  }
+  dedup_count = j;
+}
+
+/** Number of bytes removed from the text in front of the given offset */
+static bfd_vma
+removed_before(bfd_vma offset)
+{
+  bfd_vma removed = 0;
+  size_t i;
+
+  for (i = 0; i < dedup_count && dedups[i].start < offset; i++) {
+    if (offset < dedups[i].start + dedups[i].len) return removed + offset - dedups[i].start;
+    removed += dedups[i].len;
+  }
+  return removed;
+}
+
+static struct dedup_range *
+dedup_at(bfd_vma offset)
+{
+  size_t i;
+
+  for (i = 0; i < dedup_count; i++) {
+    if (offset >= dedups[i].start && offset < dedups[i].start + dedups[i].len) return dedups + i;
+  }
+  return NULL;
+}
+
+/** Remove the text found in the kernel and let everything referencing it
+ * point to the kernel copy instead. The kernel symbols used are added to
+ * the symbol table as undefined symbols.
+ */
+static int
+apply_kernel_copies(bfd *module, size_t *symcount, asymbol ***symtab)
+{
+  asymbol **newtab;
+  const asymbol *fixed;
+  struct dedup_range *dr;
+  bfd_vma target, val, len, removed;
+  size_t i, j, added = 0;
+  uint8_t ctr;
+
+  //Symbols in the ranges would move to the code behind them
+  for (i = 0; i < dedup_count; i++) {
+    fixed = text_fixed_symbol(dedups[i].start, dedups[i].len, *symcount, *symtab);
+    if (fixed != NULL) {
+      fprintf(stderr, "Symbol %s lies in text found in the kernel\n", fixed->name);
+      return -1;
+    }
+  }
+
+  newtab = malloc((*symcount + dedup_count) * sizeof(*newtab));
+  if (newtab == NULL) {
+    perror("Failed to allocate space for kernel symbols");
+    return -1;
+  }
+  memcpy(newtab, *symtab, *symcount * sizeof(*newtab));
+
+  //Import the anchors, unless they are imported already
+  for (i = 0; i < dedup_count; i++) {
+    for (j = 0; j < *symcount + added; j++) {
+      if (bfd_is_und_section(newtab[j]->section)
+          && strcmp(newtab[j]->name, dedups[i].anchor->name) == 0) break;
+    }
+    if (j == *symcount + added) {
+      newtab[j] = bfd_make_empty_symbol(module);
+      if (newtab[j] == NULL) {
+        bfd_perror("Failed to create kernel symbol");
+        free(newtab);
+        return -1;
+      }
+      newtab[j]->name = dedups[i].anchor->name;
+      newtab[j]->section = bfd_und_section_ptr;
+      newtab[j]->value = 0;
+      newtab[j]->flags = 0;
+      added++;
+    }
+    dedups[i].symidx = j;
+  }
+
+  //Move the relocations over to the new table and retarget them
+  for (ctr = 0; ctr < NUMSECT; ctr++) {
+    if (!sections[ctr].has_relocations) continue;
+    for (i = 0; i < sections[ctr].reloc_count; i++) {
+      arelent *reloc = sections[ctr].reloc[i];
+      asymbol *sym;
+
+      reloc->sym_ptr_ptr = newtab + (reloc->sym_ptr_ptr - *symtab);
+      if (ctr == MINILINK_TEXT) reloc->address -= removed_before(reloc->address);
+
+      sym = *reloc->sym_ptr_ptr;
+      if (sym->section != sections[MINILINK_TEXT].sectptr) continue;
+      target = sym->value + reloc->addend;
+      dr = dedup_at(target);
+      if (dr != NULL) {
+        reloc->sym_ptr_ptr = newtab + dr->symidx;
+        reloc->addend = dr->kaddr - dr->anchor->value - dr->anchor->section->vma
+            + target - dr->start;
+      } else {
+        val = sym->value - removed_before(sym->value);
+        reloc->addend = target - removed_before(target) - val;
+      }
+    }
+  }
+
+  for (i = 0; i < *symcount; i++) {
+    if (newtab[i]->section != sections[MINILINK_TEXT].sectptr) continue;
+    newtab[i]->value -= removed_before(newtab[i]->value);
+  }
+
+  //Close the gaps
+  crc32k_init(&dedup_crc);
+  removed = 0;
+  for (i = 0; i < dedup_count; i++) {
+    for (j = 0; j < NUMKSECT; j++) {
+      asection *sect = kernel_sections[j].sectptr;
+      if (sect != NULL && dedups[i].kaddr >= sect->vma
+          && dedups[i].kaddr < sect->vma + sect->size) {
+        crc32k_add(kernel_sections[j].content + dedups[i].kaddr - sect->vma,
+            dedups[i].cmplen, &dedup_crc);
+      }
+    }
+    len = ((i + 1 < dedup_count) ? dedups[i + 1].start
+        : sections[MINILINK_TEXT].sectptr->size) - dedups[i].start - dedups[i].len;
+    memmove(sections[MINILINK_TEXT].content + dedups[i].start - removed,
+        sections[MINILINK_TEXT].content + dedups[i].start + dedups[i].len, len);
+    removed += dedups[i].len;
+  }
+  sections[MINILINK_TEXT].sectptr->size -= removed;
+  printf("Text found in kernel: %lu bytes in %zu parts, %zu new imports\n",
+      (long unsigned int)removed, dedup_count, added);
+
+  free(*symtab);
+  *symtab = newtab;
+  *symcount += added;
+  return 0;
+}
+
+/** Write what has to be checked in the kernel: For each copy, the
+ * imported symbol, the addend and the length, followed by the CRC of
+ * all copies.
+ */
+static int
+write_kernel_checks(size_t *idmap, FILE *stream)
+{
+  unsigned char crcbuf[4];
+  size_t i;
+
+  for (i = 0; i < dedup_count; i++) {
+    if (write_varint(idmap[dedups[i].symidx], stream) < 0) return -1;
+    if (write_varint(zigzag16(dedups[i].kaddr - dedups[i].anchor->value
+        - dedups[i].anchor->section->vma), stream) < 0) return -1;
+    if (write_varint(dedups[i].cmplen, stream) < 0) return -1;
+  }
+  if (dedup_count == 0) return 0;
+  crcbuf[0] = dedup_crc;
+  crcbuf[1] = dedup_crc >> 8;
+  crcbuf[2] = dedup_crc >> 16;
+  crcbuf[3] = dedup_crc >> 24;
+  SFWRITE(crcbuf, 4, stream);
+  return 0;
+}
+
+/** Fill in the PC-relative relocations within a section. The distance
+ * between both ends doesn't change when the program is loaded. The
+ * relocations are removed, only references to other sections and to the
+ * kernel remain.
+ */
+static int
+resolve_pcrel(uint8_t sect)
+{
+  arelent *reloc;
+  asymbol *sym;
+  bfd_signed_vma value;
+  bfd_byte *field;
+  uint16_t word;
+  size_t i, kept = 0, resolved = 0;
+
+  for (i = 0; i < sections[sect].reloc_count; i++) {
+    reloc = sections[sect].reloc[i];
+    sym = *reloc->sym_ptr_ptr;
+    if (pcrel_kind(reloc) == PCREL_NONE || sym->section != sections[sect].sectptr) {
+      sections[sect].reloc[kept++] = reloc;
+      continue;
+    }
+    if (reloc->address + 2 > sections[sect].sectptr->size
+        || (pcrel_kind(reloc) == PCREL_JUMP2X && reloc->address < 2)) {
+      fprintf(stderr, "Relocation at %lx outside of section %s.\n",
+          (long unsigned int)reloc->address, sections[sect].name);
+      return -1;
+    }
+
+    field = sections[sect].content + reloc->address;
+    value = (bfd_signed_vma)(sym->value + reloc->addend) - (bfd_signed_vma)reloc->address;
+    if (pcrel_kind(reloc) == PCREL_16) {
+      field[0] = value & 0xFF;
+      field[1] = (value >> 8) & 0xFF;
+    } else {
+      //Jumps count in words from behind the instruction
+      value -= 2;
+      if ((value & 1) || value < -1024 || value > 1022) {
+        fprintf(stderr, "Jump at %lx to %s+%lx out of reach.\n",
+            (long unsigned int)reloc->address, sym->name,
+            (long unsigned int)reloc->addend);
+        return -1;
+      }
+      value /= 2;
+      word = field[0] | (field[1] << 8);
+      word = (word & 0xFC00) | (value & 0x3FF);
+      field[0] = word & 0xFF;
+      field[1] = word >> 8;
+      //The first jump of the pair skips the second one
+      if (pcrel_kind(reloc) == PCREL_JUMP2X) {
+        value++;
+        word = field[-2] | (field[-1] << 8);
+        word = (word & 0xFC00) | (value & 0x3FF);
+        field[-2] = word & 0xFF;
+        field[-1] = word >> 8;
+      }
+    }
+    resolved++;
+  }
+  sections[sect].reloc_count = kept;
+  if (resolved) printf("Section %s: %zu PC-relative relocations resolved\n",
+      sections[sect].name, resolved);
+  return 0;
+}
+
+/** Fill in the wide relocations referring to absolute symbols. The
+ * streams have no form for them, as the upper bits of some of them are
+ * stored in front of the value.
+ */
+static void
+resolve_wide_absolute(uint8_t sect)
+{
+  arelent *reloc;
+  bfd_byte *field;
+  uint32_t value;
+  uint16_t word;
+  size_t i, kept = 0;
+  int form;
+
+  for (i = 0; i < sections[sect].reloc_count; i++) {
+    reloc = sections[sect].reloc[i];
+    form = wide_form(reloc);
+    if (form < 0 || !bfd_is_abs_section((*reloc->sym_ptr_ptr)->section)) {
+      sections[sect].reloc[kept++] = reloc;
+      continue;
+    }
+    field = sections[sect].content + reloc->address;
+    value = (*reloc->sym_ptr_ptr)->value + reloc->addend;
+    field[0] = value & 0xFF;
+    field[1] = (value >> 8) & 0xFF;
+    if (form == MINILINK_WIDE_LONG) {
+      field[2] = (value >> 16) & 0xFF;
+      field[3] = (value >> 24) & 0xFF;
+      continue;
+    }
+    field -= MINILINK_WIDE_BACK(form);
+    word = field[0] | (field[1] << 8);
+    word &= ~(0x0F << MINILINK_WIDE_SHIFT(form));
+    word |= ((value >> 16) & 0x0F) << MINILINK_WIDE_SHIFT(form);
+    field[0] = word & 0xFF;
+    field[1] = word >> 8;
+  }
+  sections[sect].reloc_count = kept;
+}
+
+/** Determine the target of a relocation.
+ * \return 0 on success, 1 if the target is an absolute address, -1 on error
+ */
+static int get_reloc_target(arelent *reloc, asymbol **symtab,
+    const size_t symid_max, size_t *idmap, struct reloc_target *target) {
+  asymbol **symentry = reloc->sym_ptr_ptr;
+  asection *sectrel;
+  uint8_t ctr;
+
+  //Check Relocation type
+  if (strcmp(reloc->howto->name, RELTYPE_01_1) && strcmp(reloc->howto->name,
+      RELTYPE_01_2) && strcmp(reloc->howto->name, RELTYPE_ABS16)
+      && wide_form(reloc) < 0 && pcrel_kind(reloc) != PCREL_16) {
+    if (pcrel_kind(reloc) != PCREL_NONE) {
+      fprintf(stderr, "Jump at %lx out of reach, its target is in another section.\n",
+          (long unsigned int)reloc->address);
+    } else {
+      fprintf(stderr, "Unsupported relocation type %s.\n", reloc->howto->name);
+    }
+    return -1;
+  }
+
+  if (symentry == NULL) {
+    perror("ERROR: No symbol attached, assuming relocation section");
+    return -1;
+  }
+
+  if(bfd_is_abs_section((*symentry)->section)) {
+    if (pcrel_kind(reloc) != PCREL_NONE) {
+      fprintf(stderr, "PC-relative reference to absolute symbol %s.\n",
+          (*symentry)->name);
+      return -1;
+    }
+    return 1;
+  }
+
+  memset(target, 0, sizeof(*target));
+  target->index = -1;
+
+  //Check whether this symbol is in the Kernel
+  target->id = idmap[symentry - symtab];
+  if (target->id < symid_max) {
+    target->offset = reloc->addend;
+    return 0;
+  }
+
+  //It's in one of our sections!
+  //The symbol is in text, data, bss, or mig section.
+  sectrel = (*symentry)->section;
+  if (bfd_is_const_section(sectrel)) {
+    fprintf(stderr,
+        "Unexpected reference to section %s by relocation"
+          " referencing symbol %s.\n", sectrel->name,
+        (*symentry)->name);
+
+    return -1;
+  }
+
+  // Lets see in which section it is
+  for(ctr = 0; ctr < NUMSECT; ctr++){
+    if(strcmp(sectrel->name, sections[ctr].name) == 0) break;
+  }
+  if(ctr == NUMSECT){
+    fprintf(stderr, "Referencing section %s not possible in"
+          "minilink file format\n", sectrel->name);
+
+    return -1;
+  }
+
+  target->sect = 1;
+  target->id = ctr;
+  target->offset = (*symentry)->value + reloc->addend;
+  if (target->offset > sections[ctr].size) {
+    fprintf(stderr, "Relocation target %s+%lx outside of section %s.\n",
+        (*symentry)->name, (long unsigned int)reloc->addend, sections[ctr].name);
+    return -1;
+  }
+  return 0;
+}
+
+/** Find a target in the list of all targets */
+static struct reloc_target *
+find_target(const struct reloc_target *target)
+{
+  size_t i;
+
+  for (i = 0; i < target_count; i++) {
+    if (targets[i].sect == target->sect && targets[i].id == target->id
+        && targets[i].offset == target->offset) return targets + i;
+  }
+  return NULL;
+}
+
+/** Number of bytes a target takes when written inline */
+static size_t target_inline_len(const struct reloc_target *target) {
+  if (target->sect) return 1 + varint_len(target->offset >> 3);
+  return 1 + varint_len(target->id) + varint_len(zigzag16(target->offset));
+}
+
+/** Number of bytes of a reference to the given table index */
+static size_t table_ref_len(size_t index) {
+  return (index < MINILINK_TAG_SYMMAX) ? 1 : 1 + varint_len(index);
+}
+
+static int
+cmp_target_uses(const void *a, const void *b)
+{
+  const struct reloc_target *ta = a, *tb = b;
+
+  if (ta->uses > tb->uses) return -1;
+  if (ta->uses < tb->uses) return 1;
+  return 0;
+}
+
+/** Collect the relocation targets of all sections and decide which of them
+ * go to the target table. A target is put into the table, if referencing
+ * it by its table index saves more than the table entry costs. Imported
+ * symbols without addend are always in the table, following the entries.
+ */
+static int
+build_target_table(asymbol **symtab, const size_t symid_max, size_t *idmap)
+{
+  struct reloc_target target, *found;
+  size_t i, tablelen;
+  uint8_t ctr;
+  int intres;
+
+  for(ctr = 0; ctr < NUMSECT; ctr++){
+    if(!sections[ctr].has_relocations) continue;
+    for (i = 0; i < sections[ctr].reloc_count; i++) {
+      intres = get_reloc_target(sections[ctr].reloc[i], symtab, symid_max, idmap, &target);
+      if (intres < 0) return -1;
+      if (intres > 0) continue;
+      //Plain symbols need no entry
+      if (!target.sect && target.offset == 0) continue;
+
+      found = find_target(&target);
+      if (found == NULL) {
+        found = realloc(targets, (target_count + 1) * sizeof(*targets));
+        if (found == NULL) {
+          perror("Failed to allocate space for relocation targets");
+          return -1;
+        }
+        targets = found;
+        found = targets + target_count++;
+        *found = target;
+      }
+      found->uses++;
+    }
+  }
+
+  qsort(targets, target_count, sizeof(*targets), cmp_target_uses);
+
+  target_table_size = 0;
+  for (i = 0; i < target_count; i++) {
+    tablelen = target_inline_len(targets + i);
+    if (targets[i].uses * tablelen
+        <= tablelen + targets[i].uses * table_ref_len(target_table_size)) break;
+    targets[i].index = target_table_size++;
+  }
+  printf("Relocation targets: %zd, in table: %zd\n", target_count, target_table_size);
+  return 0;
+}
+
+/** Write a target in its inline form */
+static int write_target(const struct reloc_target *target, FILE *stream) {
+  unsigned char tmp;
+
+  if (target->sect) {
+    tmp = MINILINK_TAG_SECT | (target->id << 3) | (target->offset & 0x07);
+    SFWRITE(&tmp, 1, stream);
+    lstats.relbytes++;
+    return write_varint(target->offset >> 3, stream);
+  }
+
+  tmp = MINILINK_TAG_SYMADD;
+  SFWRITE(&tmp, 1, stream);
+  lstats.relbytes++;
+  if (write_varint(target->id, stream) < 0) return -1;
+  return write_varint(zigzag16(target->offset), stream);
+}
+
+/** Write a reference to the given table index */
+static int write_table_ref(size_t index, FILE *stream) {
+  unsigned char tmp;
+
+  if (index < MINILINK_TAG_SYMMAX) {
+    tmp = index + 1;
+    SFWRITE(&tmp, 1, stream);
+    lstats.relbytes++;
+    return 0;
+  }
+  tmp = MINILINK_TAG_TABLE;
+  SFWRITE(&tmp, 1, stream);
+  lstats.relbytes++;
+  return write_varint(index, stream);
+}
+
+static int write_target_table(FILE *stream) {
+  size_t i;
+
+  for (i = 0; i < target_count; i++) {
+    if (targets[i].index < 0) continue;
+    if (write_target(targets + i, stream) < 0) return -1;
+  }
+  return 0;
+}
+
+/** Write the places in the text section that refer to the kernel, so the
+ * installed program can be relinked after a kernel update.
+ */
+static int write_import_sites(asymbol **symtab, const size_t symid_max,
+    size_t *idmap, FILE *stream) {
+  struct reloc_target target;
+  arelent *reloc;
+  bfd_vma last = 0;
+  size_t i, count = 0;
+  unsigned char form;
+  int pass;
+
+  //Count the sites first, the number comes first
+  for (pass = 0; pass < 2; pass++) {
+    if (pass && write_varint(count, stream) < 0) return -1;
+    for (i = 0; i < sections[0].reloc_count; i++) {
+      reloc = *sections[0].sorted_reloc[i];
+      if (get_reloc_target(reloc, symtab, symid_max, idmap, &target) != 0) continue;
+      if (target.sect) continue;
+      if (!pass) {
+        count++;
+        continue;
+      }
+      if (write_varint(reloc->address - last, stream) < 0) return -1;
+      if (write_varint(target.id << 2 | (wide_form(reloc) >= 0) << 1
+          | (pcrel_kind(reloc) != PCREL_NONE), stream) < 0) return -1;
+      if (wide_form(reloc) >= 0) {
+        form = wide_form(reloc);
+        SFWRITE(&form, 1, stream);
+      }
+      if (write_varint(zigzag16(target.offset), stream) < 0) return -1;
+      last = reloc->address;
+    }
+  }
+  return count;
+}
+
+/** Write the global symbols the program defines, for programs loaded
+ * after it to import.
+ * \return Number of symbols written, -1 on error
+ */
+static int write_program_exports(const size_t symcount, asymbol **symtab,
+    FILE *stream) {
+  const asymbol *sym;
+  const char *name;
+  char code[MINILINK_MAX_SYMLEN];
+  size_t i, len, count = 0;
+  uint8_t sect;
+  int pass;
+
+  //Count the symbols first, the number comes first
+  for (pass = 0; pass < 2; pass++) {
+    if (pass && write_varint(count, stream) < 0) return -1;
+    for (i = 0; i < symcount; i++) {
+      sym = symtab[i];
+      if (!(sym->flags & BSF_GLOBAL)) continue;
+      if (strcmp(sym->name, PROCESS_ENTRY_NAME) == 0) continue;
+      for (sect = 0; sect < NUMSECT; sect++) {
+        if (sections[sect].sectptr != NULL && sym->section == sections[sect].sectptr) break;
+      }
+      if (sect == NUMSECT) continue;
+      //Imports are compared in coded form
+      name = sym->name;
+      if (dict_count) {
+        name = (encode_symbol_name(sym->name, dict_entries, dict_count, code, sizeof(code)) < 0) ? NULL : code;
+      }
+      len = (name != NULL) ? strlen(name) + 1 : 0;
+      if (name == NULL || len > MINILINK_MAX_SYMLEN) {
+        if (pass) fprintf(stderr, "WARNING: Name of %s too long to export\n", sym->name);
+        continue;
+      }
+      if (!pass) {
+        count++;
+        continue;
+      }
+      printf("Export %s: %s+%04lx\n", sym->name, sections[sect].name, (unsigned long)sym->value);
+      SFWRITE(name, len, stream);
+      SFWRITE(&sect, 1, stream);
+      if (write_varint(sym->value, stream) < 0) return -1;
+    }
+  }
+  return count;
 }
 
-
+/** Write a relocation to the stream.
+ * \param escape Write the escape byte first, not done within runs
+ * \return Number of bytes of the section covered, -1 on error
+ */
 static int write_relocation(arelent *reloc, asymbol **symtab,
-    const size_t symid_max, size_t *idmap, FILE *stream) {
+    const size_t symid_max, size_t *idmap, int escape, FILE *stream) {
   asymbol **symentry = reloc->sym_ptr_ptr;
-  size_t outsymid;
-  bfd_vma outaddr;
-  unsigned char tmp;
-  uint8_t ctr;
-
-
-
-
-
-  //Check Relocation type
-  if (strcmp(reloc->howto->name, RELTYPE_01_1) && strcmp(reloc->howto->name,
-      RELTYPE_01_2)) {
-    fprintf(stderr, "Unsupported relocation type %s.\n", reloc->howto->name);
-    return -1;
-  }
+  struct reloc_target target, *found;
+  unsigned char tmp[2];
+  int intres, form = wide_form(reloc);
 
-  if (symentry == NULL) {
-    perror("ERROR: No symbol attached, assuming relocation section");
-    return -1;
-  }
+  intres = get_reloc_target(reloc, symtab, symid_max, idmap, &target);
+  if (intres < 0) return -1;
 
   //If the relocation is a absolute address, we can just write it to the file
-  if(bfd_is_abs_section((*symentry)->section)){
-    SFWRITE(&((*symentry)->value), 2, stream);
+  if (intres > 0 && escape) {
+    uint16_t absval = (*symentry)->value;
+    if (write_escaped_stream(&absval, 2, stream) < 0) return -1;
     printf("wrote Absolute address for %s:%0lx to %0lx\n",
         (*symentry)->name,
         (long unsigned int)((*symentry)->value),
@@ -431,103 +2004,103 @@ static int write_relocation(arelent *reloc, asymbol **symtab,
   }
 
 
-  //Write escape char
-  tmp = MINILINK_RELOC_ESC;
-  SFWRITE(&tmp, 1, stream);
-
-
-
-  outsymid = idmap[symentry - symtab];
-
-  printf("ADDR: %.4x ", (uint32_t)reloc->address);
-
-
-  //Check whether this symbol is in the Kernel
-  if(outsymid < symid_max){
-    //Yes it is!
-    printf("Symbol: %s, ID:%zx",(*symentry)->name, outsymid);
-    if( reloc->addend == 0 ){ // No offset
-      outsymid += 1;
-      SFWRITE(&outsymid, 2, stream);
-      printf("\n");
-      lstats.link_simp ++;
-
-    } else { //We have an offset -> two words
-      outsymid += 1 + symid_max;
-      SFWRITE(&outsymid, 2, stream); //Write symbol
-      SFWRITE(&(reloc->addend), 2 , stream); // Write offset.
-      printf("--->Symid: %zx Offset: %x\n", outsymid, (int)reloc->addend);
-      lstats.link_comp ++;
-    }
+  if (intres > 0) {
+    fputs("Absolute relocation within a relocation run.\n", stderr);
+    return -1;
   }
 
-  else {
-    //It's in one of our sections!
-
-    //The symbol is in text, data, bss, or mig section.
-    asection *sectrel = (*symentry)->section;
-
-    if (bfd_is_const_section(sectrel)) {
-      fprintf(stderr,
-          "Unexpected reference to section %s by relocation"
-            " referencing symbol %s.\n", sectrel->name,
-          (*symentry)->name);
+  //Write escape char
+  if (escape) {
+    tmp[0] = reloc_esc;
+    SFWRITE(tmp, 1, stream);
+    lstats.relbytes++;
+  }
 
+  //The loader subtracts the address of the word from the target
+  if (pcrel_kind(reloc) != PCREL_NONE) {
+    if (!escape) {
+      fputs("PC-relative relocation within a relocation run.\n", stderr);
       return -1;
     }
+    tmp[0] = MINILINK_TAG_PCREL;
+    SFWRITE(tmp, 1, stream);
+    lstats.relbytes++;
+    printf("PC-relative ");
+  }
 
-    // Lets see in which section it is
-
-    outaddr = symid_max * 2 + 1;
-
-
-    for(ctr = 0; ctr < NUMSECT; ctr++){
-      if(strcmp(sectrel->name, sections[ctr].name) == 0) break;
-      outaddr += sections[ctr].size;
-    }
-    if(ctr == NUMSECT){
-      fprintf(stderr, "Referencing section %s not possible in"
-            "minilink file format\n", sectrel->name);
-
+  //The loader puts the upper bits where the form says
+  if (form >= 0) {
+    if (!escape) {
+      fputs("Wide relocation within a relocation run.\n", stderr);
       return -1;
     }
+    tmp[0] = MINILINK_TAG_WIDE;
+    tmp[1] = form;
+    SFWRITE(tmp, 2, stream);
+    lstats.relbytes += 2;
+    printf("Wide %02x ", form);
+  }
 
+  printf("ADDR: %.4x ", (uint32_t)reloc->address);
 
-    printf("Sect: %5s:%04x + Symbol-offset %02x + Reloc-Offset: %02x ", sections[ctr].name, (uint16_t)outaddr, (uint16_t)(*symentry)->value, (uint16_t)reloc->addend);
-    //outaddr += (unsigned char*)data;
-    outaddr += (*symentry)->value + reloc->addend;
-    printf("= %04x   (%s)\n", (uint16_t)outaddr, (*symentry)->name);
+  if (target.sect) {
+    printf("Sect: %5s + Offset %04x (%s)", sections[target.id].name,
+        (uint16_t)target.offset, (*symentry)->name);
     lstats.reloc++;
+  } else {
+    printf("Symbol: %s, ID:%zx Offset: %x", (*symentry)->name, target.id,
+        (int)target.offset);
+    if (target.offset == 0) {
+      lstats.link_simp++;
+    } else {
+      lstats.link_comp++;
+    }
+  }
 
-
-    //Write address
-    SFWRITE(&outaddr, 2, stream);
+  //Plain symbols follow the entries of the table
+  if (!target.sect && target.offset == 0) {
+    printf(" -> table %zx\n", target.id + target_table_size);
+    intres = write_table_ref(target.id + target_table_size, stream);
+  } else {
+    found = find_target(&target);
+    if (found != NULL && found->index >= 0) {
+      printf(" -> table %lx\n", found->index);
+      intres = write_table_ref(found->index, stream);
+    } else {
+      printf("\n");
+      intres = write_target(&target, stream);
+    }
   }
+  if (intres < 0) return -1;
+  return (form == MINILINK_WIDE_LONG) ? 4 : 2;
+}
 
-  return 2;
+/** Count the relocations starting at the given one, which cover
+ * consecutive words and can be part of a relocation run.
+ */
+static size_t reloc_run_length(size_t reloc_count, arelent ***relocs,
+    asymbol **symtab, const size_t symid_max, size_t *idmap) {
+  struct reloc_target target;
+  size_t len;
+
+  for (len = 0; len < reloc_count; len++) {
+    if (len && (*relocs[len])->address != (*relocs[len - 1])->address + 2) break;
+    //Absolute values are written as data, they end the run
+    if (get_reloc_target(*relocs[len], symtab, symid_max, idmap, &target) != 0) break;
+    if (pcrel_kind(*relocs[len]) != PCREL_NONE || wide_form(*relocs[len]) >= 0) break;
+  }
+  return len;
 }
 
 static int write_reloc_stream(const size_t datalen, void *data,
     size_t reloc_count, arelent ***relocs, asymbol **symtab,
     const size_t symid_max, size_t *idmap, FILE *stream) {
 
-  size_t i, baseoff = 0;
+  size_t i, run, baseoff = 0;
   int intres;
   arelent *curreloc;
   unsigned char *xdata = data;
-
-  //Check whether the address space is big enough
-  {
-    uint32_t memsize;
-    uint8_t ctr;
-    memsize = reloc_count * 2;
-    for(ctr = 0; ctr < NUMSECT; ctr++){
-      memsize += sections[ctr].size;
-    }
-    if (memsize  > 0xFFFF) {
-      perror("Address space is not big enough to save module!");
-    }
-  }
+  unsigned char tmp[2];
 
   memset(&lstats, 0, sizeof(lstats));
 
@@ -544,9 +2117,29 @@ static int write_reloc_stream(const size_t datalen, void *data,
     }
 
     baseoff = curreloc->address;
+
+    //Pointer tables: write the relocations without escape bytes
+    run = reloc_run_length(reloc_count - i, relocs + i, symtab, symid_max, idmap);
+    if (run >= MIN_RELOC_RUN) {
+      printf("Relocation run of %zd words\n", run);
+      tmp[0] = reloc_esc;
+      tmp[1] = MINILINK_TAG_RUN;
+      SFWRITE(tmp, 2, stream);
+      lstats.relbytes += 2;
+      lstats.runs++;
+      if (write_varint(run, stream) < 0) return -1;
+      for (; run; run--, i++) {
+        intres = write_relocation(*(relocs[i]), symtab, symid_max, idmap, 0, stream);
+        if (intres < 0) return -1;
+        baseoff += intres;
+      }
+      i--;
+      continue;
+    }
+
     //Write relocation to stream
     //printf("Value: %x\n", * ((uint16_t *) (xdata + baseoff) ));
-    intres = write_relocation(curreloc, symtab, symid_max, idmap, stream);
+    intres = write_relocation(curreloc, symtab, symid_max, idmap, 1, stream);
 
     if (intres < 0)
       return -1;
@@ -558,7 +2151,10 @@ static int write_reloc_stream(const size_t datalen, void *data,
   printf("Number of reloc: %i \n", lstats.reloc);
   printf("Number of link_simp: %i \n", lstats.link_simp);
   printf("Number of link_comp %i \n", lstats.link_comp);
-  printf("Number of esc: %i  \n\n\n", lstats.esc);
+  printf("Number of esc: %i  \n", lstats.esc);
+  printf("Number of relocation runs: %i  \n", lstats.runs);
+  printf("Relocation bytes: %i (%i in old format)\n\n\n", lstats.relbytes,
+      lstats.reloc * 3 + lstats.link_simp * 3 + lstats.link_comp * 5);
 
   {
     int *ipi = &lstats.esc;
@@ -584,6 +2180,299 @@ static int write_reloc_stream(const size_t datalen, void *data,
   return 0;
 }
 
+/** Address of a section in the nominal layout of base-delta sections.
+ * The sections are placed back to back, leaving two bytes between them.
+ * This way a pointer to the end of a section can't be taken for a pointer
+ * into the next one.
+ */
+static bfd_vma nominal_base(uint8_t sect) {
+  bfd_vma base = 0;
+  uint8_t ctr;
+
+  for (ctr = 0; ctr < sect; ctr++) base += sections[ctr].size + 2;
+  return base;
+}
+
+/** Write section data in base-delta form: The image linked to the nominal
+ * layout, with a bitmap of the words that need relocation in front of
+ * every MINILINK_DELTA_GROUP bytes.
+ * \return 0 on success, 1 if the section can't be written in this form,
+ *         -1 on error
+ */
+static int write_delta_stream(const size_t datalen, void *data,
+    size_t reloc_count, arelent ***relocs, asymbol **symtab,
+    const size_t symid_max, size_t *idmap, FILE *stream) {
+  struct reloc_target target;
+  unsigned char *image = NULL, *kind = NULL, map[2];
+  size_t *index = NULL;
+  size_t i, pos, len, word;
+  uint32_t value;
+  int intres, retval = -1;
+
+  image = malloc(datalen + 1);
+  kind = calloc(datalen / 2 + 1, 1);
+  index = calloc(datalen / 2 + 1, sizeof(*index));
+  if (image == NULL || kind == NULL || index == NULL) {
+    perror("Failed to allocate space for base-delta image");
+    goto cleanup;
+  }
+  memcpy(image, data, datalen);
+
+  if (nominal_base(NUMSECT) > 0xFFFF) {
+    puts("Sections too large for base-delta form.");
+    retval = 1;
+    goto cleanup;
+  }
+
+  for (i = 0; i < reloc_count; i++) {
+    arelent *curreloc = *(relocs[i]);
+
+    intres = get_reloc_target(curreloc, symtab, symid_max, idmap, &target);
+    if (intres < 0) goto cleanup;
+
+    //The image can't hold the distance to other sections
+    if (pcrel_kind(curreloc) != PCREL_NONE) {
+      puts("PC-relative relocation, no base-delta form.");
+      retval = 1;
+      goto cleanup;
+    }
+
+    //Nor more than 16 bits
+    if (wide_form(curreloc) >= 0) {
+      puts("Wide relocation, no base-delta form.");
+      retval = 1;
+      goto cleanup;
+    }
+
+    //The bitmap covers words only
+    if (curreloc->address & 1) {
+      printf("Relocation at odd address %lx, no base-delta form.\n",
+          (long unsigned int)curreloc->address);
+      retval = 1;
+      goto cleanup;
+    }
+
+    word = curreloc->address / 2;
+    if (intres > 0) {
+      value = (*curreloc->sym_ptr_ptr)->value;
+    } else if (target.sect) {
+      value = nominal_base(target.id) + target.offset;
+      kind[word] = 1;
+    } else {
+      //Imports keep the addend in the image
+      value = target.offset;
+      kind[word] = 2;
+      index[word] = target.id + target_table_size;
+    }
+    image[curreloc->address] = value & 0xFF;
+    image[curreloc->address + 1] = (value >> 8) & 0xFF;
+  }
+
+  for (pos = 0; pos < datalen; pos += MINILINK_DELTA_GROUP) {
+    map[0] = map[1] = 0;
+    for (i = 0; i < MINILINK_DELTA_GROUP / 2 && pos + 2 * i < datalen; i++) {
+      if (kind[pos / 2 + i]) map[0] |= 1 << i;
+      if (kind[pos / 2 + i] == 2) map[1] |= 1 << i;
+    }
+    //The import bitmap is left out, if no word needs relocation
+    len = map[0] ? 2 : 1;
+    if (len != fwrite(map, 1, len, stream)) {
+      perror("Failed writing file");
+      goto cleanup;
+    }
+    for (i = 0; i < MINILINK_DELTA_GROUP / 2; i++) {
+      if (map[1] & (1 << i)) {
+        if (write_varint(index[pos / 2 + i], stream) < 0) goto cleanup;
+      }
+    }
+
+    len = datalen - pos;
+    if (len > MINILINK_DELTA_GROUP) len = MINILINK_DELTA_GROUP;
+    if (len != fwrite(image + pos, 1, len, stream)) {
+      perror("Failed writing file");
+      goto cleanup;
+    }
+  }
+  retval = 0;
+
+cleanup:
+  free(image);
+  free(kind);
+  free(index);
+  return retval;
+}
+
+/** Encode the data of a section in both forms and keep the smaller one
+ * in sections[sect].stream.
+ * \return 0 if the escaped form is used, 1 for base-delta form, -1 on error
+ */
+static int encode_section(uint8_t sect, asymbol **symtab,
+    const size_t symid_max, size_t *idmap) {
+  FILE *delta;
+  long esclen, deltalen;
+  int intres;
+
+  sections[sect].stream = tmpfile();
+  delta = tmpfile();
+  if (sections[sect].stream == NULL || delta == NULL) {
+    perror("Failed to create temporary file");
+    if (delta) fclose(delta);
+    return -1;
+  }
+
+  printf("Section %s:\n", sections[sect].name);
+  intres = write_reloc_stream(sections[sect].sectptr->size, sections[sect].content,
+      sections[sect].reloc_count, sections[sect].sorted_reloc, symtab, symid_max, idmap,
+      sections[sect].stream);
+  if (intres == 0) {
+    intres = write_delta_stream(sections[sect].sectptr->size, sections[sect].content,
+        sections[sect].reloc_count, sections[sect].sorted_reloc, symtab, symid_max, idmap,
+        delta);
+  }
+  if (intres != 0) {
+    fclose(delta);
+    return (intres < 0) ? -1 : 0;
+  }
+
+  esclen = ftell(sections[sect].stream);
+  deltalen = ftell(delta);
+  printf("Section %s: %ld bytes escaped, %ld bytes base-delta\n",
+      sections[sect].name, esclen, deltalen);
+  if (deltalen < esclen) {
+    fclose(sections[sect].stream);
+    sections[sect].stream = delta;
+    return 1;
+  }
+  fclose(delta);
+  return 0;
+}
+
+/** Append the contents of a temporary file to the given stream */
+static int copy_stream(FILE *src, FILE *dest) {
+  size_t xres;
+
+  rewind(src);
+  do {
+    xres = fread(databuf, 1, sizeof(databuf), src);
+    if (xres < sizeof(databuf) && ferror(src)) {
+      perror("Failed to read temporary file");
+      return -1;
+    }
+    SFWRITE(databuf, xres, dest);
+  } while (xres == sizeof(databuf));
+  return 0;
+}
+
+/** Longest LZ match */
+#define LZ_MAXMATCH (MINILINK_LZ_MINMATCH + 255)
+
+/** Compress the contents of a temporary file with the LZ scheme of the
+ * loader: Groups of eight items, each group preceded by a byte with a bit
+ * per item, lowest bit first. Literals are written as is, matches as two
+ * bytes: distance minus one and length minus MINILINK_LZ_MINMATCH.
+ * \param outlen Output for the number of bytes written
+ */
+static int write_lz_stream(FILE *src, FILE *dest, long *outlen) {
+  unsigned char *data, item[2 * 8 + 1];
+  long len, pos, back, best, bestdist, mlen, outpos;
+  size_t itemlen = 1;
+  int nitems = 0, retval = -1;
+
+  if (fseek(src, 0, SEEK_END) != 0 || (len = ftell(src)) < 0) {
+    perror("Failed to read temporary file");
+    return -1;
+  }
+  rewind(src);
+  data = malloc(len + 1);
+  if (data == NULL) {
+    perror("Failed to allocate space for compression");
+    return -1;
+  }
+  if ((size_t)len != fread(data, 1, len, src)) {
+    perror("Failed to read temporary file");
+    goto cleanup;
+  }
+
+  outpos = ftell(dest);
+  item[0] = 0;
+  for (pos = 0; pos < len; pos += best) {
+    //Find the longest match within the window
+    best = 1;
+    bestdist = 0;
+    for (back = 1; back <= MINILINK_LZ_WINDOW && back <= pos; back++) {
+      for (mlen = 0; mlen < LZ_MAXMATCH && pos + mlen < len; mlen++) {
+        if (data[pos + mlen] != data[pos - back + mlen]) break;
+      }
+      if (mlen > best) {
+        best = mlen;
+        bestdist = back;
+      }
+    }
+
+    if (best >= MINILINK_LZ_MINMATCH) {
+      item[0] |= 1 << nitems;
+      item[itemlen++] = bestdist - 1;
+      item[itemlen++] = best - MINILINK_LZ_MINMATCH;
+    } else {
+      best = 1;
+      item[itemlen++] = data[pos];
+    }
+
+    if (++nitems == 8 || pos + best >= len) {
+      if (itemlen != fwrite(item, 1, itemlen, dest)) {
+        perror("Failed writing file");
+        goto cleanup;
+      }
+      item[0] = 0;
+      itemlen = 1;
+      nitems = 0;
+    }
+  }
+  *outlen = ftell(dest) - outpos;
+  retval = 0;
+
+cleanup:
+  free(data);
+  return retval;
+}
+
+/** Pick the byte value used least in the section data as escape byte.
+ * Every literal occurrence of the escape byte costs two extra bytes.
+ * Bytes replaced by relocations are not counted.
+ */
+static unsigned char
+choose_escape_byte(void)
+{
+  size_t count[256];
+  size_t i, r, best = MINILINK_RELOC_ESC;
+  bfd_vma start, end;
+  uint8_t ctr;
+
+  memset(count, 0, sizeof(count));
+  for(ctr = 0; ctr < NUMSECT; ctr++){
+    if(!sections[ctr].has_relocations) continue;
+    if(sections[ctr].content == NULL) continue;
+    r = 0;
+    for (i = 0; i < sections[ctr].sectptr->size; i++) {
+      for (; r < sections[ctr].reloc_count; r++) {
+        reloc_extent(*sections[ctr].sorted_reloc[r], &start, &end);
+        if (end > i) break;
+      }
+      if (r < sections[ctr].reloc_count
+          && (size_t)(*sections[ctr].sorted_reloc[r])->address <= i) continue;
+      count[sections[ctr].content[i]]++;
+    }
+  }
+
+  //Keep the default on ties
+  for (i = 0; i < 256; i++) {
+    if (count[i] < count[best]) best = i;
+  }
+  printf("Escape byte: %.2zx, used %zd times (%.2x: %zd times)\n", best,
+      count[best], MINILINK_RELOC_ESC, count[MINILINK_RELOC_ESC]);
+  return best;
+}
+
 static int
 crc32k_checksum_stream(FILE *stream, uint32_t *checksum) {
   size_t xres;
@@ -606,8 +2495,28 @@ print_usage(void)
 {
   fputs("mkminimod creates a loadable program for sky platform\n"
   "Usage:\n"
-  "    mkminimod <input> <output>\n\n"
+  "    mkminimod [-z] [-O] [-r] [-x] [-k kernel] [-I index | -D dictionary]\n"
+  "              <input> <output>\n\n"
   "Parameters:\n"
+  "    -z              Compress the section data\n"
+  "    -O              Drop sections not used by the process and fold\n"
+  "                    identical functions. The input should be compiled\n"
+  "                    with -ffunction-sections and -fdata-sections.\n"
+  "    -r              Keep the places in the code referring to the kernel.\n"
+  "                    minilink_relink_all() uses them to relink the\n"
+  "                    installed program after a kernel update.\n"
+  "    -x              Export the global symbols of the program to the\n"
+  "                    programs loaded after it. Programs built with -I\n"
+  "                    import by index and can't import them.\n"
+  "    -k kernel       ELF File containing the kernel. Constants and leaf\n"
+  "                    functions found in it are used from there, the\n"
+  "                    program only loads if the kernel still has them.\n"
+  "    -I index        Export index of the kernel, as kept by mksymtab -I.\n"
+  "                    Kernel symbols are imported by index, the program\n"
+  "                    needs no symbol table to load.\n"
+  "    -D dictionary   Dictionary of the symbol table, as kept by\n"
+  "                    mksymtab -D. The names of the imported symbols are\n"
+  "                    coded with it.\n"
   "    input           ELF File containing kernel\n"
   "    output          Output file to create\n\n", stderr);
 }
@@ -615,11 +2524,14 @@ print_usage(void)
 int
 main(int argc, const char *argv[])
 {
-  FILE *foutput = NULL;
-  bfd *elfinput = NULL;
+  FILE *foutput = NULL, *payload = NULL, *sites = NULL, *exporttab = NULL;
+  bfd *elfinput = NULL, *kernelinput = NULL;
+  const char *kernelfile = NULL, *indexfile = NULL, *dictfile = NULL;
   bfd_boolean bfdres;
   int intres, retval = EXIT_FAILURE;
-  size_t ffunres, symbol_count;
+  int compress = 0, optimize = 0, keepsites = 0, exports = 0;
+  long payloadlen = 0, lzlen = 0;
+  size_t ffunres, symbol_count, ctr_unit;
   size_t undefsym_count;
   asymbol *autostart_sym, **symbol_table = NULL;
 
@@ -633,7 +2545,34 @@ main(int argc, const char *argv[])
   memset(&headerdata, 0, sizeof(headerdata));
 
   /* --- check arguments ---------------------------------- */
-  if (argc != 3) {
+  while (argc > 3 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      compress = 1;
+    } else if (strcmp(argv[1], "-O") == 0) {
+      optimize = 1;
+    } else if (strcmp(argv[1], "-r") == 0) {
+      keepsites = 1;
+    } else if (strcmp(argv[1], "-x") == 0) {
+      exports = 1;
+    } else if (strcmp(argv[1], "-k") == 0 && argc > 4) {
+      kernelfile = argv[2];
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-I") == 0 && argc > 4) {
+      indexfile = argv[2];
+      argc--;
+      argv++;
+    } else if (strcmp(argv[1], "-D") == 0 && argc > 4) {
+      dictfile = argv[2];
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
+  if (argc != 3 || (indexfile != NULL && dictfile != NULL)) {
     fputs("Bad number of arguments.\n\n", stderr);
     print_usage();
     return EXIT_FAILURE;
@@ -654,6 +2593,30 @@ main(int argc, const char *argv[])
     goto cleanup_closefiles;
   }
 
+  if (kernelfile != NULL) {
+    kernelinput = bfd_openr(kernelfile, NULL);
+    if (kernelinput == NULL) {
+      bfd_perror("Failed to open kernel file");
+      goto cleanup_closefiles;
+    }
+    if (bfd_check_format(kernelinput, bfd_object) != TRUE) {
+      bfd_perror("Unable to detect kernel file format");
+      goto cleanup_closefiles;
+    }
+  }
+
+  if (indexfile != NULL) {
+    intres = read_name_lines(indexfile, &export_index, &export_count);
+    if (intres > 0) fprintf(stderr, "Export index %s not found\n", indexfile);
+    if (intres != 0) goto cleanup_closefiles;
+  }
+
+  if (dictfile != NULL) {
+    intres = read_dictionary(dictfile, &dict_entries, &dict_count);
+    if (intres > 0) fprintf(stderr, "Dictionary %s not found\n", dictfile);
+    if (intres != 0) goto cleanup_closefiles;
+  }
+
   foutput = fopen(argv[2], "w+b");
   if (foutput == NULL) {
     perror("Failed to open output file");
@@ -699,17 +2662,6 @@ main(int argc, const char *argv[])
             (*sections[ctr_sect].reloc[ctr]->sym_ptr_ptr)->name);
       }
     }
-
-
-    // Alloc space to sort the relocations
-    sections[ctr_sect].sorted_reloc = malloc(sections[ctr_sect].reloc_count * sizeof(void*));
-    if (sections[ctr_sect].sorted_reloc == NULL) {
-      fprintf(stderr, "Not enough memory for sorting %s relocations",  sections[ctr_sect].name);
-      goto cleanup_free;
-    }
-    // Sort the relocations by offset, so the ones at the beginning of
-    // the code come first
-    sort_relocs_by_offset(sections[ctr_sect].reloc_count, sections[ctr_sect].reloc, sections[ctr_sect].sorted_reloc);
   }
 
 
@@ -731,6 +2683,52 @@ main(int argc, const char *argv[])
 
 
 
+  /* --- merge split input sections ----------------------- */
+  intres = load_units(elfinput, symbol_table);
+  if (intres < 0) goto cleanup_free;
+  if (optimize) {
+    autostart_sym = my_get_symbol_by_name(PROCESS_ENTRY_NAME, symbol_count, symbol_table);
+    if (autostart_sym == NULL) {
+      fputs("Process entry not found\n", stderr);
+      goto cleanup_free;
+    }
+    collect_garbage(autostart_sym, exports ? symbol_count : 0, symbol_table);
+    fold_identical_code();
+  } else {
+    for (ctr_unit = 0; ctr_unit < unit_count; ctr_unit++) units[ctr_unit].used = 1;
+  }
+  intres = merge_units(symbol_count, symbol_table);
+  if (intres < 0) goto cleanup_free;
+
+  /* --- use code and constants of the kernel ------------- */
+  if (kernelinput != NULL) {
+    intres = load_kernel(kernelinput);
+    if (intres < 0) goto cleanup_free;
+    dedup_keep_globals = exports;
+    intres = find_kernel_copies(symbol_count, symbol_table);
+    if (intres < 0) goto cleanup_free;
+    align_kernel_copies();
+    intres = apply_kernel_copies(elfinput, &symbol_count, &symbol_table);
+    if (intres < 0) goto cleanup_free;
+  }
+
+  for(ctr_sect = 0; ctr_sect < NUMSECT; ctr_sect ++){
+    if(!sections[ctr_sect].has_relocations) continue;
+    if(sections[ctr_sect].sectptr == NULL) continue;
+    intres = resolve_pcrel(ctr_sect);
+    if (intres < 0) goto cleanup_free;
+    resolve_wide_absolute(ctr_sect);
+    // Alloc space to sort the relocations
+    sections[ctr_sect].sorted_reloc = malloc(sections[ctr_sect].reloc_count * sizeof(void*));
+    if (sections[ctr_sect].sorted_reloc == NULL) {
+      fprintf(stderr, "Not enough memory for sorting %s relocations",  sections[ctr_sect].name);
+      goto cleanup_free;
+    }
+    // Sort the relocations by offset, so the ones at the beginning of
+    // the code come first
+    sort_relocs_by_offset(sections[ctr_sect].reloc_count, sections[ctr_sect].reloc, sections[ctr_sect].sorted_reloc);
+  }
+
   /* --- get usage statistics ----------------------------- */
   symusage = calloc((symbol_count + CHAR_BIT - 1) / CHAR_BIT, 1);
     // was: bitarray_alloc(symbol_count);
@@ -770,6 +2768,12 @@ main(int argc, const char *argv[])
 
 
 
+  // names are sorted and compared in coded form
+  if (dict_count) {
+    intres = encode_symbol_names(undefsym_count, undefsyms);
+    if (intres < 0) goto cleanup_free;
+  }
+
   // sort the undefined symbols by name so they can be found more quickly while linking
   sort_symbols_by_name(undefsym_count, undefsyms);
 
@@ -828,6 +2832,55 @@ main(int argc, const char *argv[])
   headerdata.symentries = undefsym_count;
   printf("headerdata.symentries: %.4x\n", headerdata.symentries);
 
+  headerdata.version = MINILINK_PGM_VERSION;
+  headerdata.kchecks = dedup_count;
+  headerdata.dictionary = dictionary_id(dict_entries, dict_count);
+  reloc_esc = choose_escape_byte();
+  headerdata.escape = reloc_esc;
+
+  intres = build_target_table(symbol_table, undefsym_count, symidlist);
+  if (intres != 0) goto cleanup_free;
+  headerdata.targets = target_table_size;
+  printf("headerdata.targets: %.4x\n", headerdata.targets);
+
+  /* --- encode section data ------------------------------ */
+  for(ctr_sect = 0; ctr_sect < NUMSECT; ctr_sect ++){
+    if(!sections[ctr_sect].has_relocations) continue;
+    if(sections[ctr_sect].size == 0) continue;
+
+    intres = encode_section(ctr_sect, symbol_table, undefsym_count, symidlist);
+    if (intres < 0) goto cleanup_free;
+    if (intres > 0) headerdata.delta |= 1 << ctr_sect;
+  }
+  printf("headerdata.delta: %.2x\n", headerdata.delta);
+
+  //The header holds the sizes of the import sites and exports, so they are collected first
+  if (keepsites) {
+    sites = tmpfile();
+    if (sites == NULL) {
+      perror("Failed to create temporary file");
+      goto cleanup_free;
+    }
+    intres = write_import_sites(symbol_table, undefsym_count, symidlist, sites);
+    if (intres < 0) goto cleanup_free;
+    headerdata.sitesize = ftell(sites);
+    printf("Import sites: %d, %u bytes\n", intres, headerdata.sitesize);
+  }
+  if (exports) {
+    exporttab = tmpfile();
+    if (exporttab == NULL) {
+      perror("Failed to create temporary file");
+      goto cleanup_free;
+    }
+    intres = write_program_exports(symbol_count, symbol_table, exporttab);
+    if (intres < 0) goto cleanup_free;
+    headerdata.exportsize = ftell(exporttab);
+    printf("Exports: %d, %u bytes\n", intres, headerdata.exportsize);
+  }
+
+  if (compress) headerdata.flags |= MINILINK_FLAG_LZ;
+  if (indexfile != NULL) headerdata.flags |= MINILINK_FLAG_ABI;
+
   //Make sure sections are word-alligned
   if (headerdata.textsize & 1) {
     fputs("WARNING: Text section not word aligned!", stderr);
@@ -853,24 +2906,56 @@ main(int argc, const char *argv[])
   }
 
   /* --- write symbol list -------------------------------- */
-  intres = write_symbollist(undefsym_count, undefsyms, foutput);
+  if (indexfile != NULL) {
+    intres = write_export_list(undefsym_count, undefsyms, foutput);
+  } else {
+    intres = write_symbollist(undefsym_count, undefsyms, foutput);
+  }
+  if (intres != 0) goto cleanup_free;
+
+  /* --- write kernel checks ------------------------------ */
+  intres = write_kernel_checks(symidlist, foutput);
+  if (intres != 0) goto cleanup_free;
+
+  /* --- write target table ------------------------------- */
+  memset(&lstats, 0, sizeof(lstats));
+  intres = write_target_table(foutput);
   if (intres != 0) goto cleanup_free;
+  tstats.relbytes += lstats.relbytes;
+
+  /* --- write import sites ------------------------------- */
+  if (keepsites) {
+    intres = copy_stream(sites, foutput);
+    if (intres < 0) goto cleanup_free;
+  }
+
+  /* --- write export table ------------------------------- */
+  if (exports) {
+    intres = copy_stream(exporttab, foutput);
+    if (intres < 0) goto cleanup_free;
+  }
+
+  /* --- output section data ----------------------------- */
+  //Compressed data is collected first
+  payload = foutput;
+  if (compress) {
+    payload = tmpfile();
+    if (payload == NULL) {
+      perror("Failed to create temporary file");
+      goto cleanup_free;
+    }
+  }
 
-  /* --- output escaped section data ---------------------- */
   for(ctr_sect = 0; ctr_sect < NUMSECT; ctr_sect ++){
     uint8_t lsect = (ctr_sect + 1) % NUMSECT; //Text sect last
-    if(!sections[lsect].has_relocations) continue;
-    if(sections[lsect].size == 0) continue;
-
-    printf("Section %s:\n",sections[lsect].name);
-    intres = write_reloc_stream(sections[lsect].sectptr->size, sections[lsect].content, sections[lsect].reloc_count,
-        sections[lsect].sorted_reloc, symbol_table, undefsym_count, symidlist, foutput);
+    if(sections[lsect].stream == NULL) continue;
 
+    intres = copy_stream(sections[lsect].stream, payload);
     if (intres < 0) goto cleanup_free;
 
     // If datasect isn't word aligned datasize has be increased by one, before.
     if (sections[lsect].sectptr->size != sections[lsect].size) {
-      intres = putc(0, foutput);
+      intres = putc(0, payload);
       if (intres != 0) {
         perror("Failed to add padding byte");
         goto cleanup_free;
@@ -879,6 +2964,13 @@ main(int argc, const char *argv[])
 
   }
 
+  if (compress) {
+    payloadlen = ftell(payload);
+    intres = write_lz_stream(payload, foutput, &lzlen);
+    if (intres < 0) goto cleanup_free;
+    printf("Section data: %ld bytes, compressed: %ld bytes\n", payloadlen, lzlen);
+  }
+
 
   /* Last byte in file must not be zero, otherwise cfs-coffe won't be able
    * to determine the proper file size.
@@ -941,7 +3033,15 @@ main(int argc, const char *argv[])
   printf("Number of reloc: %i \n", tstats.reloc);
   printf("Number of link_simp: %i \n", tstats.link_simp);
   printf("Number of link_comp %i \n", tstats.link_comp);
-  printf("Number of esc: %i  \n\n\n", tstats.esc);
+  printf("Number of esc: %i  \n", tstats.esc);
+  printf("Number of relocation runs: %i  \n", tstats.runs);
+  printf("Relocation bytes: %i (%i in old format)\n", tstats.relbytes,
+      tstats.reloc * 3 + tstats.link_simp * 3 + tstats.link_comp * 5);
+  if (compress && payloadlen) {
+    printf("Compressed section data: %ld of %ld bytes (%ld%%)\n", lzlen,
+        payloadlen, lzlen * 100 / payloadlen);
+  }
+  puts("\n");
 
   /* --- everything went ok ------------------------------- */
   retval = EXIT_SUCCESS;
@@ -951,14 +3051,29 @@ cleanup_free:
     free(sections[ctr_sect].sorted_reloc);
     free(sections[ctr_sect].content);
     free(sections[ctr_sect].reloc);
+    if (sections[ctr_sect].stream) fclose(sections[ctr_sect].stream);
+  }
+  for (ctr_sect = 0; ctr_sect < NUMKSECT; ctr_sect++) {
+    free(kernel_sections[ctr_sect].content);
   }
+  free(kernel_symtab);
+  free(dedups);
+  free_units();
+  free(targets);
   free(symidlist);
   free(undefsyms);
   free(symusage);
   free(symbol_table);
 cleanup_closefiles:
+  if (compress && payload) fclose(payload);
+  if (sites) fclose(sites);
+  if (exporttab) fclose(exporttab);
   if (elfinput) bfd_close(elfinput);
+  if (kernelinput) bfd_close(kernelinput);
   if (foutput)  fclose(foutput);
+  free_name_lines(export_index, export_count);
+  free_name_lines(dict_entries, dict_count);
+  free_coded_names();
   return retval;
 }
 
@@ -0,0 +1,656 @@
+/*
+ * Copyright (c) 2010, Friedrich-Alexander University Erlangen, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ */
+
+/**
+ * \addtogroup minilink
+ * @{
+ * \file
+ *         Tool to create a patch turning one program file into another, or
+ *         a delta turning one symbol table into another
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <crc32k.h>
+
+#include <inttypes.h>
+
+#include "filelib.h"
+
+/** Program files are limited to 16 bit sizes on the device */
+#define PGM_MAXSIZE 0xFFFF
+/** Bytes hashed to find match candidates in the old file */
+#define HASH_BYTES 4
+#define HASH_SIZE 4096
+/** Shorter matches cost more as copy command than as literal bytes */
+#define MIN_COPY 6
+
+#define PATCH_HEADSIZE 16
+#define SYMDELTA_HEADSIZE 20
+#define SYMTAB_HEADSIZE 16
+
+static unsigned char databuf[SYMDELTA_HEADSIZE];
+
+/** The patch, built up in memory to checksum it before writing */
+static unsigned char *patch;
+static size_t patch_len, patch_space;
+
+static struct {
+  size_t copies;
+  size_t copybytes;
+  size_t literals;
+  size_t literalbytes;
+} pstats;
+
+static struct {
+  size_t shifts;
+  size_t kept;
+  size_t dropped;
+  size_t added;
+} dstats;
+
+/** Entry of a symbol table */
+struct sym_entry {
+  char name[MINILINK_SYMDELTA_NAMELEN];
+  uint32_t value;
+};
+
+static int append_byte(unsigned char byte) {
+  unsigned char *tmp;
+
+  if (patch_len == patch_space) {
+    patch_space = patch_space ? patch_space * 2 : 1024;
+    tmp = realloc(patch, patch_space);
+    if (tmp == NULL) {
+      fputs("Not enough memory for patch.\n", stderr);
+      return -1;
+    }
+    patch = tmp;
+  }
+  patch[patch_len++] = byte;
+  return 0;
+}
+
+/** Append a number using 7 bits per byte, least significant bits first. */
+static int append_varint(uint32_t val) {
+  unsigned char tmp;
+
+  do {
+    tmp = val & 0x7F;
+    val >>= 7;
+    if (val) tmp |= 0x80;
+    if (append_byte(tmp) < 0) return -1;
+  } while (val);
+  return 0;
+}
+
+static int append_literals(const unsigned char *data, size_t len) {
+  size_t chunk;
+
+  while (len > 0) {
+    chunk = len > MINILINK_PATCH_MAXLEN ? MINILINK_PATCH_MAXLEN : len;
+    if (append_varint(chunk << 1) < 0) return -1;
+    pstats.literals++;
+    pstats.literalbytes += chunk;
+    len -= chunk;
+    while (chunk--) {
+      if (append_byte(*data++) < 0) return -1;
+    }
+  }
+  return 0;
+}
+
+static int append_copy(size_t offset, size_t len) {
+  size_t chunk;
+
+  while (len > 0) {
+    chunk = len > MINILINK_PATCH_MAXLEN ? MINILINK_PATCH_MAXLEN : len;
+    if (append_varint(chunk << 1 | 1) < 0) return -1;
+    if (append_varint(offset) < 0) return -1;
+    pstats.copies++;
+    pstats.copybytes += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+static unsigned hash_at(const unsigned char *data) {
+  unsigned h = 0, i;
+
+  for (i = 0; i < HASH_BYTES; i++) h = h * 33 + data[i];
+  return h % HASH_SIZE;
+}
+
+/**
+ * Write the commands turning the old file into the new one. Each position
+ * of the new file is looked up in the old one, the longest match is copied
+ * if it is worth it. Everything else is sent as literal bytes.
+ */
+static int build_patch(const unsigned char *old, size_t oldlen,
+    const unsigned char *new, size_t newlen) {
+  long head[HASH_SIZE];
+  long *chain;
+  long cand;
+  size_t pos = 0, litstart = 0, best_len, best_off, len, i;
+  int retval = -1;
+
+  chain = malloc((oldlen + 1) * sizeof(*chain));
+  if (chain == NULL) {
+    fputs("Not enough memory to index old file.\n", stderr);
+    return -1;
+  }
+  for (i = 0; i < HASH_SIZE; i++) head[i] = -1;
+  for (i = 0; i + HASH_BYTES <= oldlen; i++) {
+    unsigned h = hash_at(old + i);
+    chain[i] = head[h];
+    head[h] = i;
+  }
+
+  while (pos < newlen) {
+    best_len = 0;
+    best_off = 0;
+    if (pos + HASH_BYTES <= newlen) {
+      for (cand = head[hash_at(new + pos)]; cand >= 0; cand = chain[cand]) {
+        len = 0;
+        while (pos + len < newlen && cand + len < oldlen
+            && new[pos + len] == old[cand + len]) len++;
+        if (len > best_len) {
+          best_len = len;
+          best_off = cand;
+        }
+      }
+    }
+
+    if (best_len < MIN_COPY) {
+      pos++;
+      continue;
+    }
+    if (append_literals(new + litstart, pos - litstart) < 0) goto cleanup;
+    if (append_copy(best_off, best_len) < 0) goto cleanup;
+    pos += best_len;
+    litstart = pos;
+  }
+  if (append_literals(new + litstart, pos - litstart) < 0) goto cleanup;
+  retval = 0;
+
+cleanup:
+  free(chain);
+  return retval;
+}
+
+static uint16_t zigzag16(int16_t val) {
+  // keep small negative shifts short
+  return val < 0 ? (uint16_t)~((uint16_t)val << 1) : (uint16_t)((uint16_t)val << 1);
+}
+
+/** Zigzag code a shift of 20-bit values, taken modulo 1 MB */
+static uint32_t zigzag20(uint32_t val) {
+  int32_t sval = (val & 0x80000) ? (int32_t)(val & 0xFFFFF) - 0x100000 : (int32_t)(val & 0xFFFFF);
+
+  return sval < 0 ? ~((uint32_t)sval << 1) : (uint32_t)sval << 1;
+}
+
+/** Split a symbol table into its entries. Names are kept as stored, coded
+ * with the dictionary of the table.
+ */
+static int
+read_symtab_entries(const char *filename, const unsigned char *data, size_t len,
+    struct sym_entry **entries, size_t *count) {
+  Minilink_SymbolHeader hdr;
+  struct sym_entry *tmp, *cur;
+  size_t pos, same, space = 0;
+  uint32_t lastval = 0, mask;
+  unsigned char attr;
+  int hdrlen;
+
+  *entries = NULL;
+  *count = 0;
+  hdrlen = read_symbol_header((unsigned char *)data, len, &hdr);
+  if (hdrlen < 0 || (size_t)hdrlen + hdr.dictsize > len) goto broken;
+  mask = (hdr.flags & MINILINK_SYMFLAG_ADDR20) ? 0xFFFFF : 0xFFFF;
+
+  //The table ends with a single 0xFF
+  for (pos = hdrlen + hdr.dictsize; pos + 1 < len; ) {
+    if (*count == space) {
+      space = space ? space * 2 : 256;
+      tmp = realloc(*entries, space * sizeof(*tmp));
+      if (tmp == NULL) {
+        fputs("Not enough memory for symbol table.\n", stderr);
+        return -1;
+      }
+      *entries = tmp;
+    }
+    cur = &(*entries)[*count];
+    attr = data[pos++];
+    same = attr & 0x3F;
+    if (*count) {
+      memcpy(cur->name, cur[-1].name, sizeof(cur->name));
+    } else {
+      cur->name[0] = 0;
+    }
+    if (same > strlen(cur->name)) goto broken;
+    do {
+      if (pos >= len) goto broken;
+      if (same >= sizeof(cur->name)) {
+        fprintf(stderr, "%s: Names must be shorter than %u chars.\n", filename,
+            MINILINK_SYMDELTA_NAMELEN);
+        return -1;
+      }
+      cur->name[same] = data[pos++];
+    } while (cur->name[same++] != 0);
+
+    switch (attr >> 6) {
+    case 0:
+      if (pos + (mask > 0xFFFF ? 3 : 2) > len) goto broken;
+      cur->value = get_le16_val((unsigned char *)data + pos);
+      pos += 2;
+      if (mask > 0xFFFF) cur->value |= (uint32_t)data[pos++] << 16;
+      break;
+    case 1:
+      cur->value = lastval - 1 - data[pos++];
+      break;
+    case 2:
+      cur->value = lastval + data[pos++];
+      break;
+    default:
+      cur->value = lastval + 0x100 + data[pos++];
+      break;
+    }
+    cur->value &= mask;
+    lastval = cur->value;
+    (*count)++;
+  }
+  if (pos >= len) goto broken;
+  return 0;
+
+broken:
+  fprintf(stderr, "%s: Symbol table is broken.\n", filename);
+  return -1;
+}
+
+static int append_delta_cmd(unsigned kind, size_t count) {
+  size_t chunk;
+
+  while (count > 0) {
+    chunk = count > 0x3FFF ? 0x3FFF : count;
+    if (append_varint(chunk << 2 | kind) < 0) return -1;
+    count -= chunk;
+  }
+  return 0;
+}
+
+static int append_delta_add(const struct sym_entry *entry) {
+  const char *c = entry->name;
+
+  if (append_varint(MINILINK_SYMDELTA_ADD) < 0) return -1;
+  do {
+    if (append_byte(*c) < 0) return -1;
+  } while (*c++ != 0);
+  dstats.added++;
+  return append_varint(entry->value);
+}
+
+static const struct sym_entry *oldsyms;
+
+static int cmp_old_value(const void *a, const void *b) {
+  size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+
+  if (oldsyms[ia].value != oldsyms[ib].value) {
+    return oldsyms[ia].value < oldsyms[ib].value ? -1 : 1;
+  }
+  return ia < ib ? -1 : ia > ib;
+}
+
+/**
+ * Write the delta turning the old symbol table into the new one. Symbols
+ * found in both tables are kept if their value can be derived from the old
+ * one by shifting the address range it is in. All other symbols of the old
+ * table are dropped and the ones of the new table added.
+ */
+static int build_symdelta(const unsigned char *old, size_t oldlen,
+    const unsigned char *new, size_t newlen) {
+  Minilink_SymbolHeader oldhdr, newhdr;
+  struct sym_entry *olde = NULL, *newe = NULL;
+  size_t oldcount, newcount, *match = NULL, *order = NULL, matched = 0;
+  size_t i, j, run = 0;
+  unsigned char *keep = NULL;
+  uint32_t *starts = NULL, *shifts = NULL, shift, curshift = 0, mask;
+  unsigned kind, runkind = MINILINK_SYMDELTA_KEEP;
+  int cmp, retval = -1;
+
+  if (read_symtab_entries("old", old, oldlen, &olde, &oldcount) < 0) goto cleanup;
+  if (read_symtab_entries("new", new, newlen, &newe, &newcount) < 0) goto cleanup;
+  read_symbol_header((unsigned char *)old, oldlen, &oldhdr);
+  read_symbol_header((unsigned char *)new, newlen, &newhdr);
+  if (oldhdr.dictionary != newhdr.dictionary || oldhdr.dictsize != newhdr.dictsize
+      || memcmp(old + SYMTAB_HEADSIZE, new + SYMTAB_HEADSIZE, oldhdr.dictsize) != 0) {
+    fputs("The symbol tables use different dictionaries.\n", stderr);
+    goto cleanup;
+  }
+  if (oldhdr.flags != newhdr.flags) {
+    fputs("The symbol tables store their values differently.\n", stderr);
+    goto cleanup;
+  }
+  mask = (oldhdr.flags & MINILINK_SYMFLAG_ADDR20) ? 0xFFFFF : 0xFFFF;
+
+  match = malloc((oldcount + 1) * sizeof(*match));
+  order = malloc((oldcount + 1) * sizeof(*order));
+  starts = malloc((oldcount + 1) * sizeof(*starts));
+  shifts = malloc((oldcount + 1) * sizeof(*shifts));
+  keep = calloc(oldcount + 1, 1);
+  if (match == NULL || order == NULL || starts == NULL || shifts == NULL
+      || keep == NULL) {
+    fputs("Not enough memory to compare symbol tables.\n", stderr);
+    goto cleanup;
+  }
+
+  //Both tables are sorted by name
+  for (i = j = 0; i < oldcount; i++) {
+    while (j < newcount && strcmp(newe[j].name, olde[i].name) < 0) j++;
+    match[i] = newcount;
+    if (j < newcount && strcmp(newe[j].name, olde[i].name) == 0) {
+      match[i] = j;
+      order[matched++] = i;
+    }
+  }
+
+  //Shifts apply to ranges of old values, all symbols of a value move alike
+  oldsyms = olde;
+  qsort(order, matched, sizeof(*order), cmp_old_value);
+  for (i = 0; i < matched; i++) {
+    shift = (newe[match[order[i]]].value - olde[order[i]].value) & mask;
+    if (i && olde[order[i]].value == olde[order[i - 1]].value) {
+      keep[order[i]] = (shift == curshift);
+      continue;
+    }
+    keep[order[i]] = 1;
+    if (shift != curshift) {
+      starts[dstats.shifts] = olde[order[i]].value;
+      shifts[dstats.shifts++] = shift;
+      curshift = shift;
+    }
+  }
+  if (append_varint(dstats.shifts) < 0) goto cleanup;
+  for (i = 0; i < dstats.shifts; i++) {
+    if (append_varint((starts[i] - (i ? starts[i - 1] : 0)) & mask) < 0) goto cleanup;
+    if (append_varint(mask > 0xFFFF ? zigzag20(shifts[i]) : zigzag16(shifts[i])) < 0) goto cleanup;
+  }
+
+  //Walk both tables, keeping what can be kept
+  for (i = j = 0; i < oldcount || j < newcount; ) {
+    cmp = (i == oldcount) ? 1 : (j == newcount) ? -1 : strcmp(olde[i].name, newe[j].name);
+    if (cmp <= 0) {
+      kind = (cmp == 0 && keep[i]) ? MINILINK_SYMDELTA_KEEP : MINILINK_SYMDELTA_DROP;
+      if (kind != runkind) {
+        if (append_delta_cmd(runkind, run) < 0) goto cleanup;
+        run = 0;
+        runkind = kind;
+      }
+      run++;
+      i++;
+      if (kind == MINILINK_SYMDELTA_KEEP) {
+        dstats.kept++;
+        j++;
+        continue;
+      }
+      dstats.dropped++;
+      if (cmp < 0) continue;
+    }
+    if (append_delta_cmd(runkind, run) < 0) goto cleanup;
+    run = 0;
+    if (append_delta_add(&newe[j++]) < 0) goto cleanup;
+  }
+  //Entries left in the old table are dropped by ending the commands
+  if (runkind == MINILINK_SYMDELTA_KEEP && append_delta_cmd(runkind, run) < 0) goto cleanup;
+  if (append_varint(MINILINK_SYMDELTA_KEEP) < 0) goto cleanup;
+  retval = 0;
+
+cleanup:
+  free(olde);
+  free(newe);
+  free(match);
+  free(order);
+  free(starts);
+  free(shifts);
+  free(keep);
+  return retval;
+}
+
+/** Read a program file or symbol table and check its header. */
+static unsigned char *
+read_program(const char *filename, size_t *size) {
+  FILE *input;
+  unsigned char *data;
+  size_t len;
+
+  input = fopen(filename, "rb");
+  if (input == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  data = malloc(PGM_MAXSIZE + 1);
+  if (data == NULL) {
+    fputs("Not enough memory to load program.\n", stderr);
+    fclose(input);
+    return NULL;
+  }
+  len = fread(data, 1, PGM_MAXSIZE + 1, input);
+  if (ferror(input)) {
+    perror(filename);
+    goto error;
+  }
+  if (len > PGM_MAXSIZE) {
+    fprintf(stderr, "%s: Too large for a program file.\n", filename);
+    goto error;
+  }
+  if (len < sizeof(Minilink_CommonHeader) || (get_le16_val(data) != MINILINK_PGM_MAGIC
+      && get_le16_val(data) != MINILINK_SYM_MAGIC)) {
+    fprintf(stderr, "%s: Neither a program file nor a symbol table.\n", filename);
+    goto error;
+  }
+  fclose(input);
+  *size = len;
+  return data;
+
+error:
+  fclose(input);
+  free(data);
+  return NULL;
+}
+
+/** Build a delta turning one symbol table into another */
+static int
+make_symdelta(unsigned char *olddata, size_t oldlen,
+    unsigned char *newdata, size_t newlen) {
+  Minilink_SymDeltaHeader headerdata;
+  Minilink_SymbolHeader symdata;
+  size_t i;
+  int intres;
+
+  /* --- build symbol table delta ------------------------- */
+  if (read_symbol_header(newdata, newlen, &symdata) < 0) {
+    fputs("New symbol table is too short.\n", stderr);
+    return -1;
+  }
+  headerdata.common.magic = MINILINK_SYMDELTA_MAGIC;
+  headerdata.common.crc = 0;
+  headerdata.oldcrc = get_le32_val(olddata + 2);
+  headerdata.newcrc = symdata.common.crc;
+  headerdata.newsize = newlen;
+  headerdata.kernelchksum = symdata.kernelchksum;
+
+  intres = convert_symdelta_header(&headerdata, databuf, sizeof(databuf));
+  if (intres < 0) {
+    fputs("Internal error when serializing header data.\n", stderr);
+    return -1;
+  }
+  for (i = 0; i < (size_t)intres; i++) {
+    if (append_byte(databuf[i]) < 0) return -1;
+  }
+  if (build_symdelta(olddata, oldlen, newdata, newlen) < 0) return -1;
+  if (append_byte(0xff) < 0) return -1;
+
+  crc32k_init(&headerdata.common.crc);
+  crc32k_add(patch, patch_len, &headerdata.common.crc);
+  intres = convert_symdelta_header(&headerdata, patch, patch_len);
+  if (intres < 0) {
+    fputs("Internal error when serializing header data.\n", stderr);
+    return -1;
+  }
+  return 0;
+}
+
+/** Build a patch turning one program file into another */
+static int
+make_patch(unsigned char *olddata, size_t oldlen,
+    unsigned char *newdata, size_t newlen) {
+  Minilink_PatchHeader headerdata;
+  size_t i;
+  int intres;
+
+  /* --- build patch -------------------------------------- */
+  headerdata.common.magic = MINILINK_PATCH_MAGIC;
+  headerdata.common.crc = 0;
+  headerdata.oldcrc = get_le32_val(olddata + 2);
+  headerdata.newcrc = get_le32_val(newdata + 2);
+  headerdata.newsize = newlen;
+
+  intres = convert_patch_header(&headerdata, databuf, sizeof(databuf));
+  if (intres < 0) {
+    fputs("Internal error when serializing header data.\n", stderr);
+    return -1;
+  }
+  for (i = 0; i < (size_t)intres; i++) {
+    if (append_byte(databuf[i]) < 0) return -1;
+  }
+
+  if (build_patch(olddata, oldlen, newdata, newlen) < 0) return -1;
+
+  /* Last byte in file must not be zero, otherwise cfs-coffe won't be able
+   * to determine the proper file size.
+  */
+  if (append_byte(0xff) < 0) return -1;
+
+  /* --- checksum data ------------------------------------ */
+  crc32k_init(&headerdata.common.crc);
+  crc32k_add(patch, patch_len, &headerdata.common.crc);
+  intres = convert_patch_header(&headerdata, patch, patch_len);
+  if (intres < 0) {
+    fputs("Internal error when serializing header data.\n", stderr);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+print_usage(void) {
+  fputs("mkmlpatch creates a patch to update an installed program or symbol\n"
+  "table\n"
+  "Usage:\n"
+  "    mkmlpatch <old> <new> <output>\n\n"
+  "Parameters:\n"
+  "    old             Program file or symbol table installed on the node\n"
+  "    new             Program file or symbol table to create from it\n"
+  "    output          Patch file to create. For symbol tables this is a\n"
+  "                    delta for minilink_symtab_update().\n\n", stderr);
+}
+
+int main(int argc, const char *argv[]) {
+  FILE *foutput = NULL;
+  unsigned char *olddata = NULL, *newdata = NULL;
+  size_t oldlen, newlen, ffunres;
+  int intres, retval = EXIT_FAILURE;
+
+  /* --- check arguments ---------------------------------- */
+  if (argc != 4) {
+    fputs("Bad number of arguments.\n\n", stderr);
+    print_usage();
+    return EXIT_FAILURE;
+  }
+
+  /* --- load input files --------------------------------- */
+  olddata = read_program(argv[1], &oldlen);
+  if (olddata == NULL) goto cleanup;
+  newdata = read_program(argv[2], &newlen);
+  if (newdata == NULL) goto cleanup;
+  if (get_le16_val(olddata) != get_le16_val(newdata)) {
+    fputs("Can not patch a program file into a symbol table.\n", stderr);
+    goto cleanup;
+  }
+
+  if (get_le16_val(newdata) == MINILINK_SYM_MAGIC) {
+    intres = make_symdelta(olddata, oldlen, newdata, newlen);
+  } else {
+    intres = make_patch(olddata, oldlen, newdata, newlen);
+  }
+  if (intres < 0) goto cleanup;
+
+  /* --- write output ------------------------------------- */
+  foutput = fopen(argv[3], "wb");
+  if (foutput == NULL) {
+    perror("Failed to open output file");
+    goto cleanup;
+  }
+  ffunres = fwrite(patch, 1, patch_len, foutput);
+  intres = fclose(foutput);
+  if (ffunres != patch_len || intres != 0) {
+    perror("Failed to write output file");
+    goto cleanup;
+  }
+
+  if (get_le16_val(newdata) == MINILINK_SYM_MAGIC) {
+    printf("Delta: %zu bytes for %zu byte symbol table (%zu%%)\n"
+        "  %zu shifts\n"
+        "  %zu symbols kept, %zu dropped, %zu added\n",
+        patch_len, newlen, patch_len * 100 / newlen, dstats.shifts,
+        dstats.kept, dstats.dropped, dstats.added);
+  } else {
+    printf("Patch: %zu bytes for %zu byte program (%zu%%)\n"
+        "  %zu copies, %zu bytes\n"
+        "  %zu literal runs, %zu bytes\n",
+        patch_len, newlen, patch_len * 100 / newlen,
+        pstats.copies, pstats.copybytes,
+        pstats.literals, pstats.literalbytes);
+  }
+  retval = EXIT_SUCCESS;
+
+cleanup:
+  free(olddata);
+  free(newdata);
+  free(patch);
+  return retval;
+}
+
+/** @} */
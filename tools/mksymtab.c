@@ -54,6 +54,12 @@
 #define KERNHEAD_MAXSIZE 128
 static unsigned char databuf[KERNHEAD_MAXSIZE];
 
+/** Dictionary the symbol names are coded with */
+static char **dict_entries;
+static size_t dict_count;
+/** Values are stored with 20 bits, see MINILINK_SYMFLAG_ADDR20 */
+static int addr20;
+
 static inline int LITTLE_ENDIAN(void) {
 	int i = 1;
 	return  * ( (char *) &i ) ;
@@ -143,9 +149,9 @@ write_symbollist(const size_t symcount, asymbol **symtab, FILE *stream)
   unsigned char symlen;
   unsigned char symattrib;
   asymbol *cursym;
-  uint16_t symval;
-  uint16_t lastsymval = 0;
-  uint16_t bytes_written = 0;
+  uint32_t symval;
+  uint32_t lastsymval = 0;
+  uint32_t bytes_written = 0;
   asymbol * lastsym; //The last symbol
   int chars_saved_symbol_name = 0;
   int chars_saved_offset = 0;
@@ -188,6 +194,11 @@ write_symbollist(const size_t symcount, asymbol **symtab, FILE *stream)
 
     //Now see if we can save some bytes in the address
     symval = cursym->value + cursym->section->vma;
+    if (symval > (addr20 ? 0xFFFFFu : 0xFFFFu)) {
+      fprintf(stderr, "Value of %s out of range: %lx%s\n", cursym->name,
+          (unsigned long)symval, addr20 ? "" : ", use -X");
+      return -1;
+    }
 
     // Calculate the offset
     offset = (int)(symval) - (int)lastsymval;
@@ -196,7 +207,7 @@ write_symbollist(const size_t symcount, asymbol **symtab, FILE *stream)
     lastsymval = symval;
 
     if(offset < -((int)0x100) || offset > 0x1FF){ //Nothing to save :-(
-    	symlen = 2;
+    	symlen = addr20 ? 3 : 2;
     	symattrib = 0;
     	//symval does not change
     } else {
@@ -218,7 +229,7 @@ write_symbollist(const size_t symcount, asymbol **symtab, FILE *stream)
 
 
 
-    printf("Same: %i l:%s - attr: %x addr:%x\n", same_chars ,  cursym->name, symattrib, symval);
+    printf("Same: %i l:%s - attr: %x addr:%" PRIx32 "\n", same_chars ,  cursym->name, symattrib, symval);
 
     // Write attribute an number of same chars
     symattrib |= same_chars;
@@ -251,8 +262,8 @@ write_symbollist(const size_t symcount, asymbol **symtab, FILE *stream)
   printf("Bytes saved by new algo: %i\n", chars_saved_symbol_name);
   printf("Bytes saved using offset: %i of %zi \n", chars_saved_offset, symcount);
   printf("Bytes saved in total: %i \n", chars_saved_offset + chars_saved_symbol_name);
-  printf("Total size: %i\n", bytes_written );
-  printf("Total size without compression: %i\n", bytes_written + chars_saved_offset + chars_saved_symbol_name);
+  printf("Total size: %" PRIu32 "\n", bytes_written );
+  printf("Total size without compression: %" PRIu32 "\n", bytes_written + chars_saved_offset + chars_saved_symbol_name);
 
   return 0;
 }
@@ -274,6 +285,733 @@ get_exported_symbols(const size_t symcount, asymbol **symtab,
   return retval;
 }
 
+/** Sorted list of symbol names */
+struct name_list {
+  char **names;
+  size_t count;
+};
+
+static int
+add_name(struct name_list *list, const char *name)
+{
+  char **tmp;
+
+  tmp = realloc(list->names, (list->count + 1) * sizeof(*tmp));
+  if (tmp == NULL) {
+    perror("Failed to allocate space for symbol names");
+    return -1;
+  }
+  list->names = tmp;
+  list->names[list->count] = strdup(name);
+  if (list->names[list->count] == NULL) {
+    perror("Failed to allocate space for symbol names");
+    return -1;
+  }
+  list->count++;
+  return 0;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void
+sort_names(struct name_list *list)
+{
+  qsort(list->names, list->count, sizeof(*list->names), cmp_name);
+}
+
+static int
+in_list(const struct name_list *list, const char *name)
+{
+  return list->count != 0 && bsearch(&name, list->names, list->count,
+      sizeof(*list->names), cmp_name) != NULL;
+}
+
+static void
+free_names(struct name_list *list)
+{
+  size_t i;
+
+  for (i = 0; i < list->count; i++) free(list->names[i]);
+  free(list->names);
+}
+
+/** Read a list of symbol names, one per line. Empty lines and lines
+ * starting with # are skipped.
+ */
+static int
+load_name_list(const char *filename, struct name_list *list)
+{
+  FILE *f;
+  char line[256];
+  size_t len;
+  int retval = 0;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    perror("Failed to open symbol list");
+    return -1;
+  }
+  while (retval == 0 && fgets(line, sizeof(line), f) != NULL) {
+    len = strcspn(line, " \t\r\n");
+    line[len] = 0;
+    if (len == 0 || line[0] == '#') continue;
+    retval = add_name(list, line);
+  }
+  if (ferror(f)) {
+    perror("Failed to read symbol list");
+    retval = -1;
+  }
+  fclose(f);
+  return retval;
+}
+
+/** Add the symbols imported by a program file to the list */
+static int
+load_program_imports(FILE *f, struct name_list *list)
+{
+  Minilink_Header mlh;
+  char name[256], plain[256];
+  size_t pos;
+  int c, hdrlen;
+  uint16_t i;
+
+  hdrlen = read_program_header(databuf, fread(databuf, 1, KERNHEAD_MAXSIZE, f), &mlh);
+  if (hdrlen < 0 || mlh.common.magic != MINILINK_PGM_MAGIC) return 1;
+  if (mlh.version != MINILINK_PGM_VERSION) {
+    fprintf(stderr, "Program file has version %u, expected %u.\n", mlh.version,
+        MINILINK_PGM_VERSION);
+    return -1;
+  }
+  if (mlh.flags & MINILINK_FLAG_ABI) {
+    puts("Program imports by index, its imports are not known.");
+    return 0;
+  }
+  if (mlh.dictionary != dictionary_id(dict_entries, dict_count)) {
+    fputs("Program was built with another dictionary.\n", stderr);
+    return -1;
+  }
+  if (fseek(f, hdrlen, SEEK_SET) != 0) {
+    perror("Failed to seek in program file");
+    return -1;
+  }
+
+  //Each name starts with the number of chars shared with the previous one
+  name[0] = 0;
+  for (i = 0; i < mlh.symentries; i++) {
+    c = getc(f);
+    if (c == EOF || (size_t)c > strlen(name)) goto broken;
+    pos = c;
+    do {
+      c = getc(f);
+      if (c == EOF || pos >= sizeof(name)) goto broken;
+      name[pos++] = c;
+    } while (c != 0);
+    if (decode_symbol_name(name, dict_entries, dict_count, plain, sizeof(plain)) < 0) {
+      goto broken;
+    }
+    if (pos > 1 && add_name(list, plain) < 0) return -1;
+  }
+  return 0;
+
+broken:
+  fputs("Program file is broken.\n", stderr);
+  return -1;
+}
+
+/** Add the symbols imported by a program to the list. The program is given
+ * as program file or as ELF file.
+ */
+static int
+load_module_imports(const char *filename, struct name_list *list)
+{
+  FILE *f;
+  bfd *module;
+  asymbol **symtab = NULL;
+  size_t i, count;
+  int intres;
+
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror("Failed to open module");
+    return -1;
+  }
+  intres = load_program_imports(f, list);
+  fclose(f);
+  if (intres <= 0) return intres;
+
+  module = bfd_openr(filename, NULL);
+  if (module == NULL) {
+    bfd_perror("Failed to open module");
+    return -1;
+  }
+  if (bfd_check_format(module, bfd_object) != TRUE) {
+    bfd_perror("Module is neither a program file nor an ELF file");
+    bfd_close(module);
+    return -1;
+  }
+  intres = load_symtab(module, &count, &symtab);
+  for (i = 0; intres == 0 && i < count; i++) {
+    if (bfd_is_und_section(symtab[i]->section)) intres = add_name(list, symtab[i]->name);
+  }
+  free(symtab);
+  bfd_close(module);
+  return intres;
+}
+
+/** Size of the symbol list written by write_symbollist() */
+static size_t
+symbollist_size(const size_t symcount, asymbol **symtab)
+{
+  size_t i, size = 0;
+  int same_chars, offset;
+  uint32_t symval, lastsymval = 0;
+
+  for (i = 0; i < symcount; i++) {
+    same_chars = i ? str_num_same(symtab[i - 1]->name, symtab[i]->name) : 0;
+    if (same_chars > 63) same_chars = 63;
+    symval = symtab[i]->value + symtab[i]->section->vma;
+    offset = (int)symval - (int)lastsymval;
+    lastsymval = symval;
+    size += 1 + strlen(symtab[i]->name) + 1 - same_chars;
+    size += (offset < -((int)0x100) || offset > 0x1FF) ? (addr20 ? 3 : 2) : 1;
+  }
+  return size;
+}
+
+/** Keep the symbols which are in the list, or the ones which aren't if
+ * keep is zero. The order of the symbols stays the same.
+ */
+static size_t
+prune_symbols(const size_t symcount, asymbol **symtab,
+    const struct name_list *list, int keep)
+{
+  size_t i, kept = 0;
+
+  for (i = 0; i < symcount; i++) {
+    if (in_list(list, symtab[i]->name) == keep) symtab[kept++] = symtab[i];
+  }
+  return kept;
+}
+
+static void
+report_pruning(const char *step, const size_t before, const size_t after,
+    asymbol **symtab, size_t *size)
+{
+  size_t newsize = symbollist_size(after, symtab);
+
+  printf("%s: %zu of %zu symbols kept, %zu bytes saved\n", step, after,
+      before, *size - newsize);
+  *size = newsize;
+}
+
+static void
+free_coded_symbols(const size_t symcount, asymbol *copies, asymbol **coded)
+{
+  size_t i;
+
+  for (i = 0; i < symcount; i++) free((char *)copies[i].name);
+  free(copies);
+  free(coded);
+}
+
+/** Copy the symbols with their names coded with the dictionary. The
+ * pointers to the copies are sorted by the coded names. Free them with
+ * free_coded_symbols().
+ */
+static int
+code_symbols(const size_t symcount, asymbol **symtab, asymbol **copies,
+    asymbol ***coded)
+{
+  size_t i, len;
+  char *name;
+
+  *copies = malloc(symcount * sizeof(**copies) + 1);
+  *coded = malloc(symcount * sizeof(**coded) + 1);
+  if (*copies == NULL || *coded == NULL) {
+    perror("Failed to allocate space for coded names");
+    free(*copies);
+    free(*coded);
+    return -1;
+  }
+  for (i = 0; i < symcount; i++) {
+    (*copies)[i] = *symtab[i];
+    (*coded)[i] = &(*copies)[i];
+    len = strlen(symtab[i]->name) + 1;
+    name = malloc(len);
+    if (name == NULL ||
+        encode_symbol_name(symtab[i]->name, dict_entries, dict_count, name, len) < 0) {
+      fprintf(stderr, "Symbol %s can not be coded\n", symtab[i]->name);
+      free(name);
+      free_coded_symbols(i, *copies, *coded);
+      return -1;
+    }
+    (*copies)[i].name = name;
+  }
+  sort_symbols_by_name(symcount, *coded);
+  return 0;
+}
+
+/** Size of the dictionary as stored in the symbol table */
+static size_t
+dictionary_size(void)
+{
+  size_t i, size = 0;
+
+  for (i = 0; i < dict_count; i++) size += strlen(dict_entries[i]) + 1;
+  return size;
+}
+
+/** Size of the symbol list coded with the dictionary, dictionary included */
+static long
+coded_list_size(const size_t symcount, asymbol **symtab)
+{
+  asymbol *copies, **coded;
+  size_t size;
+
+  if (code_symbols(symcount, symtab, &copies, &coded) < 0) return -1;
+  size = symbollist_size(symcount, coded) + dictionary_size();
+  free_coded_symbols(symcount, copies, coded);
+  return size;
+}
+
+/** Longest dictionary entry trained */
+#define DICT_MAXLEN 12
+
+struct dict_candidate {
+  const char *str;
+  size_t len;
+};
+
+static int
+cmp_dict_candidate(const void *a, const void *b)
+{
+  const struct dict_candidate *ca = a, *cb = b;
+  int res;
+
+  res = memcmp(ca->str, cb->str, ca->len < cb->len ? ca->len : cb->len);
+  if (res != 0) return res;
+  return (ca->len > cb->len) - (ca->len < cb->len);
+}
+
+/** Train a dictionary of the substrings most common in the names of the
+ * symbols, which are sorted by name. Only the parts of the names front
+ * coding leaves are counted. Entries are added as long as they save
+ * bytes, then the dictionary is cut back to the size giving the smallest
+ * symbol list.
+ */
+static int
+train_dictionary(const size_t symcount, asymbol **symtab)
+{
+  struct dict_candidate *cand = NULL;
+  size_t i, j, candcount, candmax = 0, pos, start, len, run, bestcount = 0;
+  long size, bestsize, score, bestscore;
+  char code[256], **tmp;
+  const char *name, *beststr;
+  unsigned char c;
+
+  bestsize = symbollist_size(symcount, symtab);
+  printf("Symbol list without dictionary: %ld bytes\n", bestsize);
+  while (dict_count < MINILINK_DICT_MAX) {
+    //Collect the substrings of the parts not coded yet
+    candcount = 0;
+    for (i = 0; i < symcount; i++) {
+      name = symtab[i]->name;
+      start = i ? str_num_same(symtab[i - 1]->name, name) : 0;
+      if (start > 63) start = 63;
+      if (encode_symbol_name(name, dict_entries, dict_count, code, sizeof(code)) < 0) {
+        continue;
+      }
+      pos = 0;
+      for (j = 0; code[j]; j++) {
+        c = code[j];
+        if (c >= MINILINK_DICT_TOKEN) {
+          pos += strlen(dict_entries[c - MINILINK_DICT_TOKEN]);
+          continue;
+        }
+        //Substrings of the run of uncoded chars starting here
+        for (run = 0; code[j + run] && (unsigned char)code[j + run] < MINILINK_DICT_TOKEN; run++);
+        for (len = 3; pos >= start && len <= DICT_MAXLEN && len <= run; len++) {
+          if (candcount == candmax) {
+            struct dict_candidate *ctmp;
+            candmax = candmax ? 2 * candmax : 1024;
+            ctmp = realloc(cand, candmax * sizeof(*cand));
+            if (ctmp == NULL) {
+              perror("Failed to allocate space for dictionary training");
+              free(cand);
+              return -1;
+            }
+            cand = ctmp;
+          }
+          cand[candcount].str = name + pos;
+          cand[candcount].len = len;
+          candcount++;
+        }
+        pos++;
+      }
+    }
+
+    //Pick the substring saving the most
+    qsort(cand, candcount, sizeof(*cand), cmp_dict_candidate);
+    bestscore = 0;
+    beststr = NULL;
+    len = 0;
+    for (i = 0; i < candcount; i = j) {
+      for (j = i + 1; j < candcount && cmp_dict_candidate(&cand[i], &cand[j]) == 0; j++);
+      score = (long)(j - i) * (cand[i].len - 1) - (cand[i].len + 1);
+      if (score > bestscore) {
+        bestscore = score;
+        beststr = cand[i].str;
+        len = cand[i].len;
+      }
+    }
+    if (beststr == NULL) break;
+
+    tmp = realloc(dict_entries, (dict_count + 1) * sizeof(*tmp));
+    if (tmp == NULL) {
+      perror("Failed to allocate space for dictionary");
+      free(cand);
+      return -1;
+    }
+    dict_entries = tmp;
+    dict_entries[dict_count] = malloc(len + 1);
+    if (dict_entries[dict_count] == NULL) {
+      perror("Failed to allocate space for dictionary");
+      free(cand);
+      return -1;
+    }
+    memcpy(dict_entries[dict_count], beststr, len);
+    dict_entries[dict_count][len] = 0;
+    dict_count++;
+
+    size = coded_list_size(symcount, symtab);
+    if (size < 0) {
+      free(cand);
+      return -1;
+    }
+    if (size < bestsize) {
+      bestsize = size;
+      bestcount = dict_count;
+    }
+  }
+  free(cand);
+
+  while (dict_count > bestcount) free(dict_entries[--dict_count]);
+  printf("Dictionary: %zu entries, symbol list with dictionary: %ld bytes\n",
+      dict_count, bestsize);
+  return 0;
+}
+
+/** Write the dictionary, one entry per line */
+static int
+write_dictionary(const char *filename)
+{
+  FILE *f;
+  size_t i;
+
+  f = fopen(filename, "w");
+  if (f == NULL) {
+    perror("Failed to open dictionary");
+    return -1;
+  }
+  for (i = 0; i < dict_count; i++) fprintf(f, "%s\n", dict_entries[i]);
+  if (fclose(f) != 0) {
+    perror("Failed to write dictionary");
+    return -1;
+  }
+  return 0;
+}
+
+/** Index of an exported symbol in the sorted table, or count if missing */
+static size_t
+find_symbol(const size_t symcount, asymbol **symtab, const char *name)
+{
+  asymbol key, *keyp = &key, **res;
+
+  key.name = name;
+  res = bsearch(&keyp, symtab, symcount, sizeof(*symtab), cmp_symname);
+  return res == NULL ? symcount : (size_t)(res - symtab);
+}
+
+struct hot_candidate {
+  const char *name;
+  size_t uses;
+  char code[MINILINK_MAX_SYMLEN]; /**< Name coded with the dictionary */
+};
+
+static int
+cmp_hot_uses(const void *a, const void *b)
+{
+  const struct hot_candidate *ha = a, *hb = b;
+
+  if (ha->uses != hb->uses) return ha->uses > hb->uses ? -1 : 1;
+  return strcmp(ha->name, hb->name);
+}
+
+static int
+cmp_hot_code(const void *a, const void *b)
+{
+  return strcmp(((const struct hot_candidate *)a)->code,
+      ((const struct hot_candidate *)b)->code);
+}
+
+/** Write the hot tier of the symbol table as C source to compile into the
+ * kernel. It holds the exported symbols imported by the most modules. The
+ * names in imports are sorted and listed once per module.
+ */
+static int
+write_hot_table(const char *filename, const struct name_list *imports,
+    const size_t symcount, asymbol **symtab, size_t hotmax)
+{
+  struct hot_candidate *cand;
+  size_t i, count = 0;
+  FILE *f;
+  int retval = -1;
+
+  cand = malloc((imports->count + 1) * sizeof(*cand));
+  if (cand == NULL) {
+    perror("Failed to allocate space for the hot tier");
+    return -1;
+  }
+  for (i = 0; i < imports->count; i++) {
+    if (count && strcmp(cand[count - 1].name, imports->names[i]) == 0) {
+      cand[count - 1].uses++;
+      continue;
+    }
+    //The loader only keeps names of this length
+    if (encode_symbol_name(imports->names[i], dict_entries, dict_count,
+        cand[count].code, sizeof(cand[count].code)) < 0) continue;
+    if (find_symbol(symcount, symtab, imports->names[i]) == symcount) continue;
+    cand[count].name = imports->names[i];
+    cand[count].uses = 1;
+    count++;
+  }
+
+  qsort(cand, count, sizeof(*cand), cmp_hot_uses);
+  if (count > hotmax) count = hotmax;
+  for (i = 0; i < count; i++) {
+    printf("Hot tier: %s, imported by %zu modules\n", cand[i].name, cand[i].uses);
+  }
+  qsort(cand, count, sizeof(*cand), cmp_hot_code);
+
+  f = fopen(filename, "w");
+  if (f == NULL) {
+    perror("Failed to open hot tier output file");
+    goto cleanup;
+  }
+  fputs("/* Hot tier of the kernel symbol table, generated by mksymtab.\n"
+      " * Compile it into the kernel with MINILINK_HOT_SYMBOLS set.\n"
+      " */\n#include \"minilink.h\"\n\n", f);
+  for (i = 0; i < count; i++) {
+    fprintf(f, "extern char hot_sym_%zu[] __asm__(\"%s\");\n", i, cand[i].name);
+  }
+  fputs("\nconst Minilink_HotSymbol minilink_hot_symbols[] = {\n", f);
+  for (i = 0; i < count; i++) {
+    const char *c;
+    //Coded names are compared, chars of the dictionary are written octal
+    fputs("  { \"", f);
+    for (c = cand[i].code; *c; c++) {
+      if ((unsigned char)*c >= MINILINK_DICT_TOKEN) {
+        fprintf(f, "\\%03o", (unsigned char)*c);
+      } else {
+        putc(*c, f);
+      }
+    }
+    fprintf(f, "\", hot_sym_%zu },\n", i);
+  }
+  //An array must not be empty
+  if (count == 0) fputs("  { NULL, NULL },\n", f);
+  fprintf(f, "};\n\nconst uint16_t minilink_hot_count = %zu;\n", count);
+
+  if (fclose(f) != 0) {
+    perror("Failed to close hot tier output file");
+    goto cleanup;
+  }
+  retval = 0;
+
+cleanup:
+  free(cand);
+  return retval;
+}
+
+/** Add the exported symbols missing from the export index to its end and
+ * write the export table as C source to compile into the kernel. Indices
+ * of symbols the kernel no longer exports stay reserved.
+ */
+static int
+write_export_table(const char *indexfile, const char *filename,
+    const size_t symcount, asymbol **symtab)
+{
+  char **names = NULL, **tmp;
+  size_t count, oldcount, i;
+  FILE *f;
+  int retval = -1;
+
+  if (read_name_lines(indexfile, &names, &count) < 0) return -1;
+  oldcount = count;
+  for (i = 0; i < symcount; i++) {
+    size_t j;
+    for (j = 0; j < oldcount; j++) {
+      if (strcmp(names[j], symtab[i]->name) == 0) break;
+    }
+    if (j < oldcount) continue;
+    tmp = realloc(names, (count + 1) * sizeof(*tmp));
+    if (tmp == NULL) {
+      perror("Failed to allocate space for export index");
+      goto cleanup;
+    }
+    names = tmp;
+    names[count] = strdup(symtab[i]->name);
+    if (names[count] == NULL) {
+      perror("Failed to allocate space for export index");
+      goto cleanup;
+    }
+    count++;
+  }
+  printf("Export index: %zu entries, %zu new\n", count, count - oldcount);
+
+  if (count != oldcount) {
+    f = fopen(indexfile, "w");
+    if (f == NULL) {
+      perror("Failed to open export index");
+      goto cleanup;
+    }
+    for (i = 0; i < count; i++) fprintf(f, "%s\n", names[i]);
+    if (fclose(f) != 0) {
+      perror("Failed to write export index");
+      goto cleanup;
+    }
+  }
+
+  f = fopen(filename, "w");
+  if (f == NULL) {
+    perror("Failed to open export table output file");
+    goto cleanup;
+  }
+  fputs("/* Export table of the kernel, generated by mksymtab.\n"
+      " * Compile it into the kernel with MINILINK_ABI_TABLE set.\n"
+      " */\n#include \"minilink.h\"\n\n", f);
+  for (i = 0; i < count; i++) {
+    if (names[i][0] == 0) continue;
+    if (find_symbol(symcount, symtab, names[i]) == symcount) {
+      printf("Warning: %s of the export index is gone\n", names[i]);
+      names[i][0] = 0;
+      continue;
+    }
+    fprintf(f, "extern char abi_sym_%zu[] __asm__(\"%s\");\n", i, names[i]);
+  }
+  fputs("\nconst void * const minilink_abi_table[] = {\n", f);
+  for (i = 0; i < count; i++) {
+    if (names[i][0] == 0) {
+      fprintf(f, "  NULL, /* %zu */\n", i);
+    } else {
+      fprintf(f, "  abi_sym_%zu,\n", i);
+    }
+  }
+  //An array must not be empty
+  if (count == 0) fputs("  NULL,\n", f);
+  fprintf(f, "};\n\nconst uint16_t minilink_abi_count = %zu;\n", count);
+
+  if (fclose(f) != 0) {
+    perror("Failed to close export table output file");
+    goto cleanup;
+  }
+  retval = 0;
+
+cleanup:
+  free_name_lines(names, count);
+  return retval;
+}
+
+struct section_find {
+  bfd_vma addr;
+  asection *found;
+};
+
+static void
+find_section_cb(bfd *abfd, asection *sect, void *obj)
+{
+  struct section_find *sf = obj;
+
+  (void)abfd;
+  if (sf->found == NULL && sf->addr >= sect->vma &&
+      sf->addr < sect->vma + bfd_get_section_size(sect)) {
+    sf->found = sect;
+  }
+}
+
+/** Read up to len bytes of the kernel image at the given address. Stops
+ * at the end of the section.
+ * \return Number of bytes read, -1 on error
+ */
+static long
+read_kernel_bytes(bfd *elf, bfd_vma addr, void *out, size_t len)
+{
+  struct section_find sf = { addr, NULL };
+  bfd_byte *contents = NULL;
+  bfd_vma offset;
+
+  bfd_map_over_sections(elf, find_section_cb, &sf);
+  if (sf.found == NULL || !bfd_malloc_and_get_section(elf, sf.found, &contents)) {
+    fprintf(stderr, "Kernel has no contents at 0x%04lx\n", (unsigned long)addr);
+    free(contents);
+    return -1;
+  }
+  offset = addr - sf.found->vma;
+  if (len > bfd_get_section_size(sf.found) - offset) {
+    len = bfd_get_section_size(sf.found) - offset;
+  }
+  memcpy(out, contents + offset, len);
+  free(contents);
+  return len;
+}
+
+/** Size of a pointer in the kernel, a hot tier entry holds two */
+#define KERNEL_PTR_SIZE (addr20 ? 4 : 2)
+
+/** Add the names of the hot tier compiled into the kernel to the list.
+ * Nothing is added if the kernel has none. The names are coded with the
+ * dictionary, they are added expanded.
+ */
+static int
+load_kernel_hot_tier(bfd *elf, const size_t symcount, asymbol **symtab,
+    struct name_list *list)
+{
+  asymbol *table = NULL, *count = NULL;
+  unsigned char raw[4];
+  char name[MINILINK_MAX_SYMLEN], plain[256];
+  uint16_t entries, i;
+  long len;
+
+  for (i = 0; i < symcount; i++) {
+    if (!(symtab[i]->flags & BSF_GLOBAL)) continue;
+    if (strcmp(symtab[i]->name, "minilink_hot_symbols") == 0) table = symtab[i];
+    if (strcmp(symtab[i]->name, "minilink_hot_count") == 0) count = symtab[i];
+  }
+  if (table == NULL || count == NULL) return 0;
+
+  if (read_kernel_bytes(elf, bfd_asymbol_value(count), raw, 2) != 2) return -1;
+  entries = raw[0] | raw[1] << 8;
+  for (i = 0; i < entries; i++) {
+    if (read_kernel_bytes(elf, bfd_asymbol_value(table) + i * 2 * KERNEL_PTR_SIZE,
+        raw, KERNEL_PTR_SIZE) != KERNEL_PTR_SIZE) return -1;
+    len = read_kernel_bytes(elf, raw[0] | raw[1] << 8 | (addr20 ? raw[2] << 16 : 0),
+        name, sizeof(name));
+    if (len < 0) return -1;
+    if (memchr(name, 0, len) == NULL
+        || decode_symbol_name(name, dict_entries, dict_count, plain, sizeof(plain)) < 0) {
+      fputs("Hot tier of the kernel is broken.\n", stderr);
+      return -1;
+    }
+    if (add_name(list, plain) < 0) return -1;
+  }
+  printf("Kernel has %u hot symbols\n", entries);
+  return 0;
+}
+
 static int
 crc32k_checksum_stream(FILE *stream, uint32_t *checksum) {
   size_t xres;
@@ -326,8 +1064,34 @@ static void
 print_usage(void) {
   fputs("mksymtab creates a kernel symbol table for linking support\n"
   "Usage:\n"
-  "    mksymtab <input> <output> [kernelfile]\n\n"
+  "    mksymtab [-m module]... [-a allowlist] [-d denylist] [-H hotfile]\n"
+  "             [-t count] [-I index -J tablefile] [-D dictionary] [-X]\n"
+  "             <input> <output> [kernelfile]\n\n"
   "Parameters:\n"
+  "    -m module       Program file or ELF file of a module. If given, only\n"
+  "                    the symbols imported by the modules are exported.\n"
+  "                    Can be given more than once.\n"
+  "    -a allowlist    File listing symbols to export, one per line. Use it\n"
+  "                    to reserve symbols for modules to come.\n"
+  "    -d denylist     File listing symbols never to export\n"
+  "    -H hotfile      Write the symbols imported by the most modules to this\n"
+  "                    C file. Compiled into the kernel, they are resolved\n"
+  "                    without reading the symbol table. Symbols the kernel\n"
+  "                    has in its hot tier are left out of the output.\n"
+  "    -t count        Number of symbols in the hot tier, default 16\n"
+  "    -I index        Export index, listing a symbol per line. Exported\n"
+  "                    symbols not in it are added to its end. Keep it with\n"
+  "                    the sources, so the indices stay the same.\n"
+  "    -J tablefile    Write the export table to this C file. Compiled into\n"
+  "                    the kernel, it links programs built with\n"
+  "                    mkminimod -I without a symbol table.\n"
+  "    -D dictionary   Dictionary of substrings to code the names with, one\n"
+  "                    per line. If it does not exist, it is trained on the\n"
+  "                    exported names and written. Build the modules with\n"
+  "                    mkminimod -D and keep it with the sources.\n"
+  "    -X              Kernel uses the 20-bit addresses of MSP430X parts.\n"
+  "                    Needed for symbols above 64 KB, the kernel is built\n"
+  "                    with MINILINK_ADDR20 set.\n"
   "    input           ELF File containing kernel\n"
   "    output          Output file to create\n"
   "    kernelfile      Kernel image belonging to ELF input\n\n", stderr);
@@ -340,21 +1104,78 @@ int main(int argc, const char *argv[]) {
   int intres, retval = EXIT_FAILURE;
   asymbol **symbol_table = NULL, **sorted_symbol_table = NULL;
   Minilink_SymbolHeader headerdata;
-  size_t ffunres, symbol_count, exports_count;
+  size_t ffunres, symbol_count, exports_count, pruned_count, listsize, i, j;
+  struct name_list imports = { NULL, 0 }, allowed = { NULL, 0 }, denied = { NULL, 0 };
+  struct name_list kernelhot = { NULL, 0 }, modules = { NULL, 0 };
+  int restrict_exports = 0, train = 0;
+  const char *hotfile = NULL, *indexfile = NULL, *tablefile = NULL;
+  const char *dictfile = NULL;
+  asymbol *coded_copies = NULL, **coded_table = NULL;
+  size_t hotmax = 16;
+
+  bfd_init();
 
   /* --- check arguments ---------------------------------- */
-  if (argc != 3 && argc != 4) {
+  while (argc > 2 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-m") == 0) {
+      //Loaded once the dictionary is known
+      intres = add_name(&modules, argv[2]);
+      restrict_exports = 1;
+    } else if (strcmp(argv[1], "-a") == 0) {
+      intres = load_name_list(argv[2], &allowed);
+      restrict_exports = 1;
+    } else if (strcmp(argv[1], "-d") == 0) {
+      intres = load_name_list(argv[2], &denied);
+    } else if (strcmp(argv[1], "-H") == 0) {
+      hotfile = argv[2];
+      intres = 0;
+    } else if (strcmp(argv[1], "-t") == 0) {
+      hotmax = strtoul(argv[2], NULL, 0);
+      intres = 0;
+    } else if (strcmp(argv[1], "-I") == 0) {
+      indexfile = argv[2];
+      intres = 0;
+    } else if (strcmp(argv[1], "-J") == 0) {
+      tablefile = argv[2];
+      intres = 0;
+    } else if (strcmp(argv[1], "-D") == 0) {
+      dictfile = argv[2];
+      intres = 0;
+    } else if (strcmp(argv[1], "-X") == 0) {
+      //Takes no argument
+      addr20 = 1;
+      argc--;
+      argv++;
+      continue;
+    } else {
+      break;
+    }
+    if (intres < 0) goto cleanup_lists;
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc != 3 && argc != 4) || (indexfile == NULL) != (tablefile == NULL)) {
     fputs("Bad number of arguments.\n\n", stderr);
     print_usage();
-    return EXIT_FAILURE;
+    goto cleanup_lists;
   }
+  if (dictfile != NULL) {
+    intres = read_dictionary(dictfile, &dict_entries, &dict_count);
+    if (intres < 0) goto cleanup_lists;
+    train = (intres > 0);
+  }
+  for (i = 0; i < modules.count; i++) {
+    if (load_module_imports(modules.names[i], &imports) < 0) goto cleanup_lists;
+  }
+  sort_names(&imports);
+  sort_names(&allowed);
+  sort_names(&denied);
 
   /* --- open input files --------------------------------- */
-  bfd_init();
   elfinput = bfd_openr(argv[1], NULL);
   if (elfinput == NULL) {
     bfd_perror("Failed to open input file");
-    return EXIT_FAILURE;
+    goto cleanup_lists;
   }
   bfdres = bfd_check_format(elfinput, bfd_object);
   if (bfdres != TRUE) {
@@ -393,9 +1214,86 @@ int main(int argc, const char *argv[]) {
   get_exported_symbols(symbol_count, symbol_table, sorted_symbol_table);
   sort_symbols_by_name(exports_count, sorted_symbol_table);
 
+  intres = load_kernel_hot_tier(elfinput, symbol_count, symbol_table, &kernelhot);
+  if (intres < 0) goto cleanup_free;
+  sort_names(&kernelhot);
+
+  /* --- leave out symbols no module uses ----------------- */
+  listsize = symbollist_size(exports_count, sorted_symbol_table);
+  printf("Exported symbols: %zu, %zu bytes\n", exports_count, listsize);
+  if (denied.count) {
+    pruned_count = prune_symbols(exports_count, sorted_symbol_table, &denied, 0);
+    report_pruning("Deny list", exports_count, pruned_count, sorted_symbol_table, &listsize);
+    exports_count = pruned_count;
+  }
+  if (restrict_exports) {
+    /* The module imports are allowed as well. They are merged into the allow
+     * list, the hot tier only counts the uses by modules.
+     */
+    for (i = 0; i < imports.count; i++) {
+      if (add_name(&allowed, imports.names[i]) < 0) goto cleanup_free;
+    }
+    sort_names(&allowed);
+    pruned_count = prune_symbols(exports_count, sorted_symbol_table, &allowed, 1);
+    report_pruning("Module imports and allow list", exports_count, pruned_count,
+        sorted_symbol_table, &listsize);
+    exports_count = pruned_count;
+
+    for (i = 0; i < allowed.count; i++) {
+      if (i && strcmp(allowed.names[i - 1], allowed.names[i]) == 0) continue;
+      if (in_list(&denied, allowed.names[i])) continue;
+      for (j = 0; j < exports_count; j++) {
+        if (strcmp(sorted_symbol_table[j]->name, allowed.names[i]) == 0) break;
+      }
+      if (j == exports_count) {
+        printf("Warning: %s is not exported by the kernel\n", allowed.names[i]);
+      }
+    }
+  }
+
+  /* --- train the dictionary ---------------------------- */
+  if (train) {
+    intres = train_dictionary(exports_count, sorted_symbol_table);
+    if (intres < 0) goto cleanup_free;
+    intres = write_dictionary(dictfile);
+    if (intres < 0) goto cleanup_free;
+  }
+
+  /* --- assign export indices --------------------------- */
+  if (indexfile != NULL) {
+    intres = write_export_table(indexfile, tablefile, exports_count,
+        sorted_symbol_table);
+    if (intres < 0) goto cleanup_free;
+  }
+
+  /* --- split off the hot tier --------------------------- */
+  if (hotfile != NULL) {
+    intres = write_hot_table(hotfile, &imports, exports_count, sorted_symbol_table,
+        hotmax);
+    if (intres < 0) goto cleanup_free;
+  }
+  if (kernelhot.count) {
+    pruned_count = prune_symbols(exports_count, sorted_symbol_table, &kernelhot, 0);
+    report_pruning("Hot tier in kernel", exports_count, pruned_count,
+        sorted_symbol_table, &listsize);
+    exports_count = pruned_count;
+  }
+
+  /* --- code the names ---------------------------------- */
+  if (dict_count) {
+    intres = code_symbols(exports_count, sorted_symbol_table, &coded_copies,
+        &coded_table);
+    if (intres < 0) goto cleanup_free;
+    printf("Symbol list: %zu bytes, coded: %zu bytes and %zu bytes dictionary\n",
+        listsize, symbollist_size(exports_count, coded_table), dictionary_size());
+  }
+
   /* --- build header ------------------------------------- */
   headerdata.common.magic = MINILINK_SYM_MAGIC;
   headerdata.common.crc = 0;
+  headerdata.dictionary = dictionary_id(dict_entries, dict_count);
+  headerdata.dictsize = dictionary_size();
+  headerdata.flags = addr20 ? MINILINK_SYMFLAG_ADDR20 : 0;
   intres = get_kernel_crc(knlinput, &headerdata.kernelchksum);
   if (intres != 0) goto cleanup_free;
 
@@ -412,7 +1310,16 @@ int main(int argc, const char *argv[]) {
     goto cleanup_free;
   }
 
-  intres = write_symbollist(exports_count, sorted_symbol_table, foutput);
+  for (i = 0; i < dict_count; i++) {
+    ffunres = strlen(dict_entries[i]) + 1;
+    if (fwrite(dict_entries[i], 1, ffunres, foutput) != ffunres) {
+      perror("Failed to write dictionary");
+      goto cleanup_free;
+    }
+  }
+
+  intres = write_symbollist(exports_count,
+      coded_table ? coded_table : sorted_symbol_table, foutput);
   if (intres < 0) goto cleanup_free;
 
   /* Last byte in file must not be zero, otherwise cfs-coffe won't be able
@@ -468,12 +1375,20 @@ int main(int argc, const char *argv[]) {
   retval = EXIT_SUCCESS;
 
 cleanup_free:
+  if (coded_table) free_coded_symbols(exports_count, coded_copies, coded_table);
   free(sorted_symbol_table);
   free(symbol_table);
 cleanup_closefiles:
   if (elfinput) bfd_close(elfinput);
   if (foutput)  fclose(foutput);
   if (knlinput) fclose(knlinput);
+cleanup_lists:
+  free_names(&imports);
+  free_names(&allowed);
+  free_names(&denied);
+  free_names(&kernelhot);
+  free_names(&modules);
+  free_name_lines(dict_entries, dict_count);
   return retval;
 }
 /* @} */